@@ -1,204 +1,4998 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#define st_ctim st_ctimespec
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#define INPUT_BUFFER_SIZE (1 << 20)
+#define XOR_WORD_SIZE 32
+#define XOR_PAD_BYTE 0x16
+#define MASK_FLUSH_WORDS ((size_t)1 << 30)
+#define SEARCH_SHORT_MAX 32
+#define PARALLEL_MIN_CHUNK ((size_t)16 << 20)
+#define PARALLEL_ALIGN ((size_t)2 << 20)
+#define FUSED_SLICE ((size_t)256 << 10)
+#define MAX_OPERATIONS 16
+#define URING_BATCH 64
+#define URING_MAX_FILE ((size_t)1 << 20)
+#define SELFTEST_WORDS 4099
+#define INDEX_MAGIC "TRIGIDX1"
+#define INDEX_VERSION 1
+#define TRIGRAM_SPACE (1 << 24)
+#define MASK_SET_MAX 256
+#define MASK_SET_TILE 4096
+#define CRC32C_POLY 0x82F63B78u
+#define CRC_BLOCK 4096
+#define HASH_STRIPE 64
+#define HASH_BLOCK_STRIPES 16
+#define HASH_LEAF (64 * 1024)
+#define HASH_STRIPE_KEY 0x9E3779B97F4A7C15ULL
+#define HASH_PRIME32 0x9E3779B1u
+#define HASH_PRIME64_1 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME64_2 0x165667B19E3779F9ULL
+#define REGEX_MAX_NODES 20000
+#define REGEX_MAX_REPEAT 1000
+#define REGEX_MAX_LITERAL 255
+#define DFA_MAX_STATES 1024
+#define DFA_TABLE_SIZE (2 * DFA_MAX_STATES)
+#define DFA_ACCEPT 1
+#define DFA_EOL_ACCEPT 2
+#define DFA_DEAD 4
+#define CACHE_MAGIC "XMCACHE1"
+#define CACHE_VERSION 1
+#define CACHE_INITIAL_SLOTS 4096
+#define CACHE_RACY_SECONDS 2
+#define CACHE_FOREIGN (-2)
+
+enum {
+    OP_XOR,
+    OP_MASK,
+    OP_MASK_SET,
+    OP_CRC32C,
+    OP_HASH,
+    OP_FIND,
+    OP_FIND_REGEX
+};
+
+enum {
+    NFA_SET,
+    NFA_EMPTY,
+    NFA_SPLIT,
+    NFA_BOL,
+    NFA_EOL,
+    NFA_MATCH
+};
+
+enum {
+    ISA_SCALAR,
+    ISA_SSE2,
+    ISA_SSE42,
+    ISA_AVX2,
+    ISA_AVX512
+};
+
+enum {
+    STATS_OFF,
+    STATS_TABLE,
+    STATS_JSON
+};
+
+enum {
+    PHASE_OTHER,
+    PHASE_OPEN,
+    PHASE_READ,
+    PHASE_COMPUTE,
+    PHASE_COPY,
+    PHASE_OUTPUT,
+    PHASE_WAIT,
+    PHASE_COUNT
+};
+
+enum {
+    COUNTER_FILES,
+    COUNTER_BYTES_READ,
+    COUNTER_BYTES_WRITTEN,
+    COUNTER_SYSCALLS,
+    COUNTER_ALLOCATIONS,
+    COUNTER_ALLOCATED_BYTES,
+    COUNTER_COUNT
+};
+
+typedef void (*XorFoldFn)(unsigned char *acc, const unsigned char *data, size_t len);
+typedef unsigned long long (*MaskCountFn)(const unsigned char *data, size_t words, unsigned int mask);
+typedef void (*MaskSetFn)(const unsigned char *data, size_t words, const uint64_t *masks, int maskCount,
+                          unsigned long long *counts);
+typedef uint32_t (*CrcUpdateFn)(uint32_t reg, const unsigned char *data, size_t len);
+typedef void (*HashStripeFn)(uint64_t *acc, const unsigned char *data, size_t stripes, uint64_t firstStripe);
+
+typedef struct {
+    const unsigned char *needle;
+    size_t len;
+    size_t critical;
+    size_t period;
+    size_t memory0;
+    size_t shift[256];
+} SearchPattern;
+
+typedef const unsigned char *(*SearchFn)(const SearchPattern *p, const unsigned char *hay, size_t len);
+
+typedef struct {
+    const char *name;
+    int isa;
+    XorFoldFn fn;
+} XorKernel;
+
+typedef struct {
+    const char *name;
+    int isa;
+    MaskCountFn fn;
+} MaskKernel;
+
+typedef struct {
+    const char *name;
+    int isa;
+    MaskSetFn fn[4];
+} MaskSetKernel;
+
+typedef struct {
+    const char *name;
+    int isa;
+    CrcUpdateFn fn;
+} CrcKernel;
+
+typedef struct {
+    const char *name;
+    int isa;
+    HashStripeFn fn;
+} HashKernel;
+
+typedef struct {
+    const char *name;
+    int isa;
+    SearchFn fn;
+} SearchKernel;
+
+typedef struct {
+    uint64_t phaseNs[PHASE_COUNT];
+    uint64_t counters[COUNTER_COUNT];
+    uint64_t since;
+    int phase;
+} ThreadStats;
+
+typedef struct {
+    uint64_t jobs;
+    uint64_t busyNs;
+    uint64_t idleNs;
+} WorkerStats;
+
+typedef struct {
+    int mode;
+    uint64_t start;
+    pthread_mutex_t lock;
+    ThreadStats total;
+    WorkerStats *workers;
+    int workerCount;
+} Stats;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t capacity;
+    uint64_t used;
+} CacheHeader;
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint32_t kind;
+    uint32_t param;
+    uint64_t value;
+    unsigned char acc[32];
+} CacheRecord;
+
+typedef struct {
+    int fd;
+    CacheHeader *header;
+    CacheRecord *records;
+    size_t mapSize;
+    pthread_mutex_t lock;
+} ResultCache;
+
+typedef struct {
+    int findAll;
+    int findCount;
+    int findLines;
+    int jobs;
+    int uring;
+    const char *indexPath;
+    ResultCache *cache;
+} Options;
+
+typedef void (*JobFn)(int index, FILE *out, void *ctx);
+
+typedef struct {
+    int begin;
+    int end;
+    pthread_mutex_t lock;
+} WorkDeque;
+
+typedef struct {
+    JobFn fn;
+    void *ctx;
+    int jobCount;
+    int workerCount;
+    WorkDeque *deques;
+    char **outputs;
+    size_t *outputLens;
+    char *ready;
+    int nextToPrint;
+    pthread_mutex_t printLock;
+} WorkPool;
+
+typedef struct {
+    WorkPool *pool;
+    int id;
+    WorkerStats stats;
+} Worker;
+
+typedef void (*RangeFn)(void *state, const unsigned char *data, size_t len);
+
+typedef struct {
+    RangeFn fn;
+    void *state;
+    const unsigned char *data;
+    size_t len;
+} RangeTask;
+
+typedef struct {
+    const char *name;
+    int fd;
+    int mapped;
+    int done;
+    unsigned char *map;
+    unsigned long long size;
+    unsigned char *buffer;
+} InputFile;
+
+typedef struct {
+    unsigned char acc[XOR_WORD_SIZE];
+    unsigned long long length;
+} XorState;
+
+typedef struct {
+    unsigned int mask;
+    unsigned long long count;
+    unsigned char carry[sizeof(unsigned int)];
+    size_t carryLen;
+} MaskState;
+
+typedef struct {
+    const struct Operation *op;
+    unsigned long long counts[MASK_SET_MAX];
+    unsigned char carry[sizeof(uint64_t)];
+    size_t carryLen;
+} MaskSetState;
+
+typedef struct {
+    uint32_t reg;
+    unsigned long long length;
+} CrcState;
+
+typedef struct {
+    uint64_t acc[8];
+    size_t leafFill;
+    unsigned char stripe[HASH_STRIPE];
+    size_t stripeLen;
+    unsigned long long leafIndex;
+    uint64_t sumLo;
+    uint64_t sumHi;
+    unsigned long long length;
+    const unsigned char *base;
+} HashState;
+
+typedef struct {
+    int *fds;
+    int count;
+    int failed;
+} CopyState;
+
+typedef struct {
+    char **fileNames;
+    int N;
+} CopyJob;
+
+typedef struct {
+    const SearchPattern *pattern;
+    const Options *options;
+    const char *fileName;
+    FILE *out;
+    int stopAtFirst;
+    unsigned long long matches;
+    unsigned long long offset;
+    unsigned long long lines;
+    unsigned char *carry;
+    size_t carryLen;
+} FindState;
+
+typedef struct {
+    int kind;
+    int out;
+    int out1;
+    uint32_t set[8];
+} NfaNode;
+
+typedef struct {
+    NfaNode *nodes;
+    int count;
+    int capacity;
+    int start;
+} Nfa;
+
+typedef struct {
+    Nfa forward;
+    Nfa reverse;
+    char *literal;
+} Regex;
+
+typedef struct {
+    int start;
+    int end;
+} NfaFragment;
+
+typedef struct {
+    const char *pattern;
+    size_t pos;
+    int reverse;
+    Nfa *nfa;
+    const char *error;
+} RegexParser;
+
+typedef struct {
+    int *set;
+    int count;
+    int flags;
+    unsigned hash;
+    int next[256];
+} DfaState;
+
+typedef struct {
+    const Nfa *nfa;
+    int unanchored;
+    DfaState *states;
+    int count;
+    int capacity;
+    unsigned resets;
+    int *table;
+    unsigned *mark;
+    unsigned generation;
+    int *stack;
+    int *scratch;
+    int startLine;
+    int startMid;
+} Dfa;
+
+typedef struct {
+    FindState find;
+    const Regex *regex;
+    Dfa dfa[3];
+    unsigned char *line;
+    size_t lineLen;
+    size_t lineCap;
+    int failed;
+} RegexState;
+
+typedef struct Operation {
+    int kind;
+    int N;
+    unsigned int mask;
+    int width;
+    int maskCount;
+    uint64_t *masks;
+    uint64_t *matchMasks;
+    Regex *regex;
+    SearchPattern pattern;
+} Operation;
+
+typedef struct {
+    const Operation *op;
+    union {
+        XorState xor;
+        MaskState mask;
+        MaskSetState maskSet;
+        CrcState crc;
+        HashState hash;
+        FindState find;
+        RegexState regex;
+    } u;
+} OpState;
+
+typedef struct {
+    char **fileNames;
+    const Operation *ops;
+    int opCount;
+    const Options *options;
+    const char *skip;
+} FileJob;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t fileCount;
+    uint64_t trigramCount;
+    uint64_t postingCount;
+    uint64_t namesSize;
+} IndexHeader;
+
+typedef struct {
+    uint64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint64_t nameOffset;
+} IndexFile;
+
+typedef struct {
+    uint32_t trigram;
+    uint32_t count;
+    uint64_t offset;
+} IndexTrigram;
+
+typedef struct {
+    void *map;
+    size_t mapSize;
+    const IndexHeader *header;
+    const IndexFile *files;
+    const IndexTrigram *trigrams;
+    const uint32_t *postings;
+    const char *names;
+} TrigramIndex;
+
+typedef struct {
+    char *path;
+    uint64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    int oldId;
+    uint32_t *trigrams;
+    size_t count;
+} IndexEntry;
+
+#ifdef HAVE_IO_URING
+typedef struct {
+    int fd;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    size_t sqesSize;
+    unsigned queued;
+} Ring;
+
+typedef struct {
+    int fd;
+    int openError;
+    int statError;
+    int readResult;
+    struct statx stx;
+    unsigned char *buffer;
+    size_t capacity;
+} UringSlot;
+#endif
+
+Stats stats = {STATS_OFF, 0, PTHREAD_MUTEX_INITIALIZER, {{0}, {0}, 0, 0}, NULL, 0};
+__thread ThreadStats threadStats;
+
+const char *const phaseNames[PHASE_COUNT] = {"other", "open", "read", "compute", "copy", "output", "wait"};
+const char *const counterNames[COUNTER_COUNT] = {"files", "bytes_read", "bytes_written", "syscalls",
+                                                 "allocations", "allocated_bytes"};
+
+uint64_t statsClock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Switches the calling thread to another phase and returns the one it was
+ * in, so that callers can restore it.  Time is charged to exactly one phase
+ * per thread; with --stats off this is a single predictable branch.
+ */
+static inline int statsPhase(int phase) {
+    if (!stats.mode)
+        return PHASE_OTHER;
+    uint64_t now = statsClock();
+    int previous = threadStats.phase;
+    if (threadStats.since)
+        threadStats.phaseNs[previous] += now - threadStats.since;
+    threadStats.since = now;
+    threadStats.phase = phase;
+    return previous;
+}
+
+static inline void statsCount(int counter, uint64_t n) {
+    if (stats.mode)
+        threadStats.counters[counter] += n;
+}
+
+void statsFlushThread(void) {
+    if (!stats.mode)
+        return;
+    statsPhase(threadStats.phase);
+    pthread_mutex_lock(&stats.lock);
+    for (int k = 0; k < PHASE_COUNT; k++)
+        stats.total.phaseNs[k] += threadStats.phaseNs[k];
+    for (int k = 0; k < COUNTER_COUNT; k++)
+        stats.total.counters[k] += threadStats.counters[k];
+    pthread_mutex_unlock(&stats.lock);
+    memset(threadStats.phaseNs, 0, sizeof(threadStats.phaseNs));
+    memset(threadStats.counters, 0, sizeof(threadStats.counters));
+}
+
+void statsWorker(int id, const WorkerStats *worker) {
+    if (!stats.mode)
+        return;
+    pthread_mutex_lock(&stats.lock);
+    if (id >= stats.workerCount) {
+        WorkerStats *grown = realloc(stats.workers, (id + 1) * sizeof(WorkerStats));
+        if (grown) {
+            memset(grown + stats.workerCount, 0, (id + 1 - stats.workerCount) * sizeof(WorkerStats));
+            stats.workers = grown;
+            stats.workerCount = id + 1;
+        }
+    }
+    if (id < stats.workerCount) {
+        stats.workers[id].jobs += worker->jobs;
+        stats.workers[id].busyNs += worker->busyNs;
+        stats.workers[id].idleNs += worker->idleNs;
+    }
+    pthread_mutex_unlock(&stats.lock);
+}
+
+/*
+ * Allocations are counted where they are made: the tool calls these
+ * wrappers instead of malloc, calloc and realloc, and statsAllocated for
+ * buffers that strdup, realpath and open_memstream hand back.
+ */
+void statsAllocated(size_t size) {
+    statsCount(COUNTER_ALLOCATIONS, 1);
+    statsCount(COUNTER_ALLOCATED_BYTES, size);
+}
+
+void *statsMalloc(size_t size) {
+    statsAllocated(size);
+    return malloc(size);
+}
+
+void *statsCalloc(size_t count, size_t size) {
+    statsAllocated(count * size);
+    return calloc(count, size);
+}
+
+void *statsRealloc(void *ptr, size_t size) {
+    statsAllocated(size);
+    return realloc(ptr, size);
+}
+
+
+void statsBegin(int mode) {
+    stats.mode = mode;
+    stats.start = statsClock();
+    statsPhase(PHASE_OTHER);
+}
+
+void statsReport(void) {
+    struct rusage usage;
+    uint64_t wall;
+    uint64_t userNs = 0;
+    uint64_t systemNs = 0;
+    long maxRss = 0;
+
+    if (!stats.mode)
+        return;
+    wall = statsClock() - stats.start;
+    statsFlushThread();
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        userNs = (uint64_t)usage.ru_utime.tv_sec * 1000000000ULL + usage.ru_utime.tv_usec * 1000ULL;
+        systemNs = (uint64_t)usage.ru_stime.tv_sec * 1000000000ULL + usage.ru_stime.tv_usec * 1000ULL;
+        maxRss = usage.ru_maxrss;
+#ifdef __APPLE__
+        maxRss /= 1024;
+#endif
+    }
+
+    if (stats.mode == STATS_JSON) {
+        fprintf(stderr, "{\"wall_ns\": %llu, \"user_ns\": %llu, \"system_ns\": %llu, \"max_rss_kib\": %ld,\n",
+                (unsigned long long)wall, (unsigned long long)userNs, (unsigned long long)systemNs, maxRss);
+        fprintf(stderr, " \"phases_ns\": {");
+        for (int k = 0; k < PHASE_COUNT; k++)
+            fprintf(stderr, "%s\"%s\": %llu", k ? ", " : "", phaseNames[k],
+                    (unsigned long long)stats.total.phaseNs[k]);
+        fprintf(stderr, "},\n \"counters\": {");
+        for (int k = 0; k < COUNTER_COUNT; k++)
+            fprintf(stderr, "%s\"%s\": %llu", k ? ", " : "", counterNames[k],
+                    (unsigned long long)stats.total.counters[k]);
+        fprintf(stderr, "},\n \"workers\": [");
+        for (int w = 0; w < stats.workerCount; w++)
+            fprintf(stderr, "%s{\"jobs\": %llu, \"busy_ns\": %llu, \"idle_ns\": %llu}", w ? ", " : "",
+                    (unsigned long long)stats.workers[w].jobs, (unsigned long long)stats.workers[w].busyNs,
+                    (unsigned long long)stats.workers[w].idleNs);
+        fprintf(stderr, "]}\n");
+    } else {
+        fprintf(stderr, "Statistics:\n");
+        fprintf(stderr, "  %-16s %12.3f ms\n", "wall", wall / 1e6);
+        fprintf(stderr, "  %-16s %12.3f ms\n", "user", userNs / 1e6);
+        fprintf(stderr, "  %-16s %12.3f ms\n", "system", systemNs / 1e6);
+        fprintf(stderr, "  %-16s %12ld KiB\n", "max rss", maxRss);
+        fprintf(stderr, "Phases (summed over threads):\n");
+        for (int k = 0; k < PHASE_COUNT; k++)
+            fprintf(stderr, "  %-16s %12.3f ms\n", phaseNames[k], stats.total.phaseNs[k] / 1e6);
+        fprintf(stderr, "Counters:\n");
+        for (int k = 0; k < COUNTER_COUNT; k++)
+            fprintf(stderr, "  %-16s %12llu\n", counterNames[k], (unsigned long long)stats.total.counters[k]);
+        if (stats.workerCount > 0)
+            fprintf(stderr, "Workers:\n  %-6s %8s %12s %12s\n", "id", "jobs", "busy ms", "idle ms");
+        for (int w = 0; w < stats.workerCount; w++)
+            fprintf(stderr, "  %-6d %8llu %12.3f %12.3f\n", w, (unsigned long long)stats.workers[w].jobs,
+                    stats.workers[w].busyNs / 1e6, stats.workers[w].idleNs / 1e6);
+    }
+    free(stats.workers);
+    stats.workers = NULL;
+    stats.workerCount = 0;
+}
 
 void usage(const char *progName) {
     fprintf(stderr, "Usage:\n");
-    fprintf(stderr, "  %s <file1> [file2 ...] xorN\n", progName);
-    fprintf(stderr, "  %s <file1> [file2 ...] mask <hex>\n", progName);
-    fprintf(stderr, "  %s <file1> [file2 ...] copyN\n", progName);
-    fprintf(stderr, "  %s <file1> [file2 ...] find <SomeString>\n", progName);
+    fprintf(stderr, "  %s [options] <file1> [file2 ...] xorN\n", progName);
+    fprintf(stderr, "  %s [options] <file1> [file2 ...] mask <hex>\n", progName);
+    fprintf(stderr, "  %s [options] <file1> [file2 ...] mask[8|16|32|64][le|be] <hex,hex,...|@maskFile>\n", progName);
+    fprintf(stderr, "  %s [options] <file1> [file2 ...] crc32c | hash64 | hash128\n", progName);
+    fprintf(stderr, "  %s [options] <file1> [file2 ...] copyN\n", progName);
+    fprintf(stderr, "  %s [options] <file1> [file2 ...] find <SomeString>\n", progName);
+    fprintf(stderr, "  %s [options] <file1> [file2 ...] findre <regex>\n", progName);
+    fprintf(stderr, "  %s [options] <file1> [file2 ...] <operation> [operation ...]\n", progName);
+    fprintf(stderr, "      (xorN, mask, crc32c, hashN, find and findre may be combined; each file is read once)\n");
+    fprintf(stderr, "      (findre matches line by line: . [] | () * + ? {m,n} ^ $ \\d \\w \\s)\n");
+    fprintf(stderr, "  %s <file1> [file2 ...] index <indexFile>\n", progName);
+    fprintf(stderr, "  %s selftest\n", progName);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -a  find, findre: report the offset of every match\n");
+    fprintf(stderr, "  -c  find, findre: report the number of matches\n");
+    fprintf(stderr, "  -n  find, findre: report the line number of every match\n");
+    fprintf(stderr, "  -j N  use N threads: one file per thread for copy, find and combined operations,\n");
+    fprintf(stderr, "        aligned chunks of large files for xor/mask (default: online CPUs)\n");
+    fprintf(stderr, "  --uring  xor/mask/find: batch opens and reads of small files through io_uring\n");
+    fprintf(stderr, "  -I FILE  find: skip indexed, unchanged files that cannot contain the string\n");
+    fprintf(stderr, "  -C FILE  xor/mask: reuse results of files whose device, inode, size and mtime are unchanged\n");
+    fprintf(stderr, "  --stats[=json]  print phase timers, counters and per-worker busy/idle time to stderr at exit\n");
+    fprintf(stderr, "A file name of - reads standard input once; copyN of - writes stdin_copy1..stdin_copyN.\n");
+}
+
+int inputOpenFd(InputFile *in, const char *name, int fd) {
+    struct stat st;
+
+    memset(in, 0, sizeof(*in));
+    in->name = name;
+    in->fd = fd;
+
+    int phase = statsPhase(PHASE_OPEN);
+    statsCount(COUNTER_SYSCALLS, 1);
+    if (fstat(in->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+        statsCount(COUNTER_SYSCALLS, 1);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            statsCount(COUNTER_SYSCALLS, 1);
+#ifdef MADV_HUGEPAGE
+            madvise(map, st.st_size, MADV_HUGEPAGE);
+            statsCount(COUNTER_SYSCALLS, 1);
+#endif
+            in->map = map;
+            in->size = st.st_size;
+            in->mapped = 1;
+            statsPhase(phase);
+            return 0;
+        }
+    }
+
+    in->buffer = statsMalloc(INPUT_BUFFER_SIZE);
+    statsPhase(phase);
+    if (!in->buffer) {
+        close(in->fd);
+        in->fd = -1;
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+int isStdin(const char *name) {
+    return strcmp(name, "-") == 0;
+}
+
+int inputOpen(InputFile *in, const char *name) {
+    int phase = statsPhase(PHASE_OPEN);
+    int fd = isStdin(name) ? dup(STDIN_FILENO) : open(name, O_RDONLY);
+    statsCount(COUNTER_SYSCALLS, 1);
+    statsPhase(phase);
+    if (fd < 0)
+        return -1;
+    return inputOpenFd(in, name, fd);
+}
+
+ssize_t inputNext(InputFile *in, const unsigned char **data) {
+    if (in->done)
+        return 0;
+
+    if (in->mapped) {
+        in->done = 1;
+        *data = in->map;
+        statsCount(COUNTER_BYTES_READ, in->size);
+        return in->size;
+    }
+
+    ssize_t got;
+    int phase = statsPhase(PHASE_READ);
+    do {
+        got = read(in->fd, in->buffer, INPUT_BUFFER_SIZE);
+        statsCount(COUNTER_SYSCALLS, 1);
+    } while (got < 0 && errno == EINTR);
+    statsPhase(phase);
+    if (got > 0)
+        statsCount(COUNTER_BYTES_READ, got);
+    if (got <= 0)
+        in->done = 1;
+    *data = in->buffer;
+    return got;
+}
+
+void inputClose(InputFile *in) {
+    int phase = statsPhase(PHASE_OPEN);
+    statsCount(COUNTER_SYSCALLS, in->mapped + (in->fd >= 0));
+    if (in->mapped)
+        munmap(in->map, in->size);
+    free(in->buffer);
+    if (in->fd >= 0)
+        close(in->fd);
+    in->fd = -1;
+    statsPhase(phase);
+}
+
+void xorFoldScalar(unsigned char *acc, const unsigned char *data, size_t len) {
+    uint64_t a[XOR_WORD_SIZE / 8];
+    memcpy(a, acc, XOR_WORD_SIZE);
+    for (size_t i = 0; i < len; i += XOR_WORD_SIZE) {
+        for (int k = 0; k < XOR_WORD_SIZE / 8; k++) {
+            uint64_t w;
+            memcpy(&w, data + i + k * 8, 8);
+            a[k] ^= w;
+        }
+    }
+    memcpy(acc, a, XOR_WORD_SIZE);
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+void xorFoldSse2(unsigned char *acc, const unsigned char *data, size_t len) {
+    __m128i a0 = _mm_loadu_si128((const __m128i *)acc);
+    __m128i a1 = _mm_loadu_si128((const __m128i *)(acc + 16));
+    size_t i = 0;
+    for (; i + 4 * XOR_WORD_SIZE <= len; i += 4 * XOR_WORD_SIZE) {
+        __m128i b0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(data + i)),
+                                   _mm_loadu_si128((const __m128i *)(data + i + 32)));
+        __m128i b1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(data + i + 16)),
+                                   _mm_loadu_si128((const __m128i *)(data + i + 48)));
+        __m128i c0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(data + i + 64)),
+                                   _mm_loadu_si128((const __m128i *)(data + i + 96)));
+        __m128i c1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(data + i + 80)),
+                                   _mm_loadu_si128((const __m128i *)(data + i + 112)));
+        a0 = _mm_xor_si128(a0, _mm_xor_si128(b0, c0));
+        a1 = _mm_xor_si128(a1, _mm_xor_si128(b1, c1));
+    }
+    for (; i < len; i += XOR_WORD_SIZE) {
+        a0 = _mm_xor_si128(a0, _mm_loadu_si128((const __m128i *)(data + i)));
+        a1 = _mm_xor_si128(a1, _mm_loadu_si128((const __m128i *)(data + i + 16)));
+    }
+    _mm_storeu_si128((__m128i *)acc, a0);
+    _mm_storeu_si128((__m128i *)(acc + 16), a1);
+}
+
+__attribute__((target("avx2")))
+void xorFoldAvx2(unsigned char *acc, const unsigned char *data, size_t len) {
+    __m256i a0 = _mm256_loadu_si256((const __m256i *)acc);
+    __m256i a1 = _mm256_setzero_si256();
+    __m256i a2 = _mm256_setzero_si256();
+    __m256i a3 = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 * XOR_WORD_SIZE <= len; i += 4 * XOR_WORD_SIZE) {
+        a0 = _mm256_xor_si256(a0, _mm256_loadu_si256((const __m256i *)(data + i)));
+        a1 = _mm256_xor_si256(a1, _mm256_loadu_si256((const __m256i *)(data + i + 32)));
+        a2 = _mm256_xor_si256(a2, _mm256_loadu_si256((const __m256i *)(data + i + 64)));
+        a3 = _mm256_xor_si256(a3, _mm256_loadu_si256((const __m256i *)(data + i + 96)));
+    }
+    for (; i < len; i += XOR_WORD_SIZE)
+        a0 = _mm256_xor_si256(a0, _mm256_loadu_si256((const __m256i *)(data + i)));
+    a0 = _mm256_xor_si256(_mm256_xor_si256(a0, a1), _mm256_xor_si256(a2, a3));
+    _mm256_storeu_si256((__m256i *)acc, a0);
+}
+#endif
+
+unsigned long long countMaskedScalar(const unsigned char *data, size_t words, unsigned int mask) {
+    unsigned long long count = 0;
+    for (size_t i = 0; i < words; i++) {
+        unsigned int value;
+        memcpy(&value, data + i * sizeof(unsigned int), sizeof(unsigned int));
+        if ((value & mask) == mask)
+            count++;
+    }
+    return count;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+unsigned long long countMaskedSse2(const unsigned char *data, size_t words, unsigned int mask) {
+    const __m128i m = _mm_set1_epi32((int)mask);
+    unsigned long long count = 0;
+    size_t i = 0;
+
+    while (words - i >= 4) {
+        size_t stop = words - i > MASK_FLUSH_WORDS ? i + MASK_FLUSH_WORDS : words;
+        __m128i acc0 = _mm_setzero_si128();
+        __m128i acc1 = _mm_setzero_si128();
+        for (; i + 8 <= stop; i += 8) {
+            __m128i v0 = _mm_loadu_si128((const __m128i *)(data + i * 4));
+            __m128i v1 = _mm_loadu_si128((const __m128i *)(data + i * 4 + 16));
+            acc0 = _mm_sub_epi32(acc0, _mm_cmpeq_epi32(_mm_and_si128(v0, m), m));
+            acc1 = _mm_sub_epi32(acc1, _mm_cmpeq_epi32(_mm_and_si128(v1, m), m));
+        }
+        for (; i + 4 <= stop; i += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(data + i * 4));
+            acc0 = _mm_sub_epi32(acc0, _mm_cmpeq_epi32(_mm_and_si128(v, m), m));
+        }
+        uint32_t lanes[4];
+        _mm_storeu_si128((__m128i *)lanes, _mm_add_epi32(acc0, acc1));
+        count += (unsigned long long)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    return count + countMaskedScalar(data + i * 4, words - i, mask);
+}
+
+__attribute__((target("avx2")))
+unsigned long long countMaskedAvx2(const unsigned char *data, size_t words, unsigned int mask) {
+    const __m256i m = _mm256_set1_epi32((int)mask);
+    unsigned long long count = 0;
+    size_t i = 0;
+
+    while (words - i >= 8) {
+        size_t stop = words - i > MASK_FLUSH_WORDS ? i + MASK_FLUSH_WORDS : words;
+        __m256i acc0 = _mm256_setzero_si256();
+        __m256i acc1 = _mm256_setzero_si256();
+        for (; i + 16 <= stop; i += 16) {
+            __m256i v0 = _mm256_loadu_si256((const __m256i *)(data + i * 4));
+            __m256i v1 = _mm256_loadu_si256((const __m256i *)(data + i * 4 + 32));
+            acc0 = _mm256_sub_epi32(acc0, _mm256_cmpeq_epi32(_mm256_and_si256(v0, m), m));
+            acc1 = _mm256_sub_epi32(acc1, _mm256_cmpeq_epi32(_mm256_and_si256(v1, m), m));
+        }
+        for (; i + 8 <= stop; i += 8) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(data + i * 4));
+            acc0 = _mm256_sub_epi32(acc0, _mm256_cmpeq_epi32(_mm256_and_si256(v, m), m));
+        }
+        uint32_t lanes[8];
+        _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi32(acc0, acc1));
+        for (int k = 0; k < 8; k++)
+            count += lanes[k];
+    }
+    return count + countMaskedScalar(data + i * 4, words - i, mask);
+}
+
+__attribute__((target("avx512f")))
+unsigned long long countMaskedAvx512(const unsigned char *data, size_t words, unsigned int mask) {
+    const __m512i m = _mm512_set1_epi32((int)mask);
+    const __m512i one = _mm512_set1_epi32(1);
+    unsigned long long count = 0;
+    size_t i = 0;
+
+    while (words - i >= 16) {
+        size_t stop = words - i > MASK_FLUSH_WORDS ? i + MASK_FLUSH_WORDS : words;
+        __m512i acc0 = _mm512_setzero_si512();
+        __m512i acc1 = _mm512_setzero_si512();
+        for (; i + 32 <= stop; i += 32) {
+            __m512i v0 = _mm512_loadu_si512(data + i * 4);
+            __m512i v1 = _mm512_loadu_si512(data + i * 4 + 64);
+            __mmask16 k0 = _mm512_cmpeq_epi32_mask(_mm512_and_si512(v0, m), m);
+            __mmask16 k1 = _mm512_cmpeq_epi32_mask(_mm512_and_si512(v1, m), m);
+            acc0 = _mm512_mask_add_epi32(acc0, k0, acc0, one);
+            acc1 = _mm512_mask_add_epi32(acc1, k1, acc1, one);
+        }
+        for (; i + 16 <= stop; i += 16) {
+            __m512i v = _mm512_loadu_si512(data + i * 4);
+            __mmask16 k = _mm512_cmpeq_epi32_mask(_mm512_and_si512(v, m), m);
+            acc0 = _mm512_mask_add_epi32(acc0, k, acc0, one);
+        }
+        uint32_t lanes[16];
+        _mm512_storeu_si512(lanes, _mm512_add_epi32(acc0, acc1));
+        for (int k = 0; k < 16; k++)
+            count += lanes[k];
+    }
+    return count + countMaskedScalar(data + i * 4, words - i, mask);
+}
+#endif
+
+/*
+ * Multi-mask kernels count, for every mask of the set, the words of one
+ * width that contain all of its bits.  Each width gets its own kernel so
+ * the inner loop never branches on it.  The SIMD versions walk the data
+ * in L1-sized tiles of 128 vectors and test every mask against a tile
+ * before moving on; a match sets all width/8 bytes of its lane, so 8-bit
+ * per-byte counters cannot overflow and are summed and divided back down.
+ */
+#define DEFINE_MASK_SET_SCALAR(bits)                                                                  \
+    void countMaskSet##bits##Scalar(const unsigned char *data, size_t words, const uint64_t *masks,  \
+                                    int maskCount, unsigned long long *counts) {                     \
+        for (size_t i = 0; i < words; i++) {                                                          \
+            uint##bits##_t value;                                                                     \
+            memcpy(&value, data + i * sizeof(value), sizeof(value));                                  \
+            for (int m = 0; m < maskCount; m++)                                                       \
+                counts[m] += (value & (uint##bits##_t)masks[m]) == (uint##bits##_t)masks[m];          \
+        }                                                                                             \
+    }
+
+DEFINE_MASK_SET_SCALAR(8)
+DEFINE_MASK_SET_SCALAR(16)
+DEFINE_MASK_SET_SCALAR(32)
+DEFINE_MASK_SET_SCALAR(64)
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static inline __m128i cmpeq64Sse2(__m128i a, __m128i b) {
+    __m128i eq = _mm_cmpeq_epi32(a, b);
+    return _mm_and_si128(eq, _mm_shuffle_epi32(eq, 0xB1));
+}
+
+#define DEFINE_MASK_SET_SSE2(bits, set1, cmpeq)                                                       \
+    __attribute__((target("sse2")))                                                                   \
+    void countMaskSet##bits##Sse2(const unsigned char *data, size_t words, const uint64_t *masks,    \
+                                  int maskCount, unsigned long long *counts) {                       \
+        size_t tiled = words * (bits / 8) & ~(size_t)15;                                              \
+        for (size_t start = 0; start < tiled; start += MASK_SET_TILE / 2) {                           \
+            size_t stop = tiled - start < MASK_SET_TILE / 2 ? tiled : start + MASK_SET_TILE / 2;      \
+            for (int m = 0; m < maskCount; m++) {                                                     \
+                const __m128i mv = set1(masks[m]);                                                    \
+                __m128i acc = _mm_setzero_si128();                                                    \
+                for (size_t i = start; i < stop; i += 16) {                                           \
+                    __m128i v = _mm_loadu_si128((const __m128i *)(data + i));                         \
+                    acc = _mm_sub_epi8(acc, cmpeq(_mm_and_si128(v, mv), mv));                         \
+                }                                                                                     \
+                uint64_t sums[2];                                                                     \
+                _mm_storeu_si128((__m128i *)sums, _mm_sad_epu8(acc, _mm_setzero_si128()));            \
+                counts[m] += (sums[0] + sums[1]) / (bits / 8);                                        \
+            }                                                                                         \
+        }                                                                                             \
+        countMaskSet##bits##Scalar(data + tiled, words - tiled / (bits / 8), masks, maskCount, counts); \
+    }
+
+#define DEFINE_MASK_SET_AVX2(bits, set1, cmpeq)                                                       \
+    __attribute__((target("avx2")))                                                                   \
+    void countMaskSet##bits##Avx2(const unsigned char *data, size_t words, const uint64_t *masks,    \
+                                  int maskCount, unsigned long long *counts) {                       \
+        size_t tiled = words * (bits / 8) & ~(size_t)31;                                              \
+        for (size_t start = 0; start < tiled; start += MASK_SET_TILE) {                               \
+            size_t stop = tiled - start < MASK_SET_TILE ? tiled : start + MASK_SET_TILE;              \
+            for (int m = 0; m < maskCount; m++) {                                                     \
+                const __m256i mv = set1(masks[m]);                                                    \
+                const __m256i zero = _mm256_setzero_si256();                                          \
+                __m256i acc0 = zero;                                                                  \
+                __m256i acc1 = zero;                                                                  \
+                size_t i = start;                                                                     \
+                for (; i + 64 <= stop; i += 64) {                                                     \
+                    __m256i v0 = _mm256_loadu_si256((const __m256i *)(data + i));                     \
+                    __m256i v1 = _mm256_loadu_si256((const __m256i *)(data + i + 32));                \
+                    acc0 = _mm256_sub_epi8(acc0, cmpeq(_mm256_and_si256(v0, mv), mv));                \
+                    acc1 = _mm256_sub_epi8(acc1, cmpeq(_mm256_and_si256(v1, mv), mv));                \
+                }                                                                                     \
+                if (i < stop) {                                                                       \
+                    __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));                      \
+                    acc0 = _mm256_sub_epi8(acc0, cmpeq(_mm256_and_si256(v, mv), mv));                 \
+                }                                                                                     \
+                uint64_t sums[4];                                                                     \
+                __m256i total = _mm256_add_epi64(_mm256_sad_epu8(acc0, zero), _mm256_sad_epu8(acc1, zero)); \
+                _mm256_storeu_si256((__m256i *)sums, total);                                          \
+                counts[m] += (sums[0] + sums[1] + sums[2] + sums[3]) / (bits / 8);                    \
+            }                                                                                         \
+        }                                                                                             \
+        countMaskSet##bits##Scalar(data + tiled, words - tiled / (bits / 8), masks, maskCount, counts); \
+    }
+
+#define SET1_8_SSE2(m) _mm_set1_epi8((char)(m))
+#define SET1_16_SSE2(m) _mm_set1_epi16((short)(m))
+#define SET1_32_SSE2(m) _mm_set1_epi32((int)(m))
+#define SET1_64_SSE2(m) _mm_set1_epi64x((long long)(m))
+#define SET1_8_AVX2(m) _mm256_set1_epi8((char)(m))
+#define SET1_16_AVX2(m) _mm256_set1_epi16((short)(m))
+#define SET1_32_AVX2(m) _mm256_set1_epi32((int)(m))
+#define SET1_64_AVX2(m) _mm256_set1_epi64x((long long)(m))
+
+DEFINE_MASK_SET_SSE2(8, SET1_8_SSE2, _mm_cmpeq_epi8)
+DEFINE_MASK_SET_SSE2(16, SET1_16_SSE2, _mm_cmpeq_epi16)
+DEFINE_MASK_SET_SSE2(32, SET1_32_SSE2, _mm_cmpeq_epi32)
+DEFINE_MASK_SET_SSE2(64, SET1_64_SSE2, cmpeq64Sse2)
+DEFINE_MASK_SET_AVX2(8, SET1_8_AVX2, _mm256_cmpeq_epi8)
+DEFINE_MASK_SET_AVX2(16, SET1_16_AVX2, _mm256_cmpeq_epi16)
+DEFINE_MASK_SET_AVX2(32, SET1_32_AVX2, _mm256_cmpeq_epi32)
+DEFINE_MASK_SET_AVX2(64, SET1_64_AVX2, _mm256_cmpeq_epi64)
+#endif
+
+uint32_t crc32cTable[8][256];
+uint32_t crc32cPowers[32];
+uint32_t crc32cBlockShift;
+
+/* Carry-less a*b modulo the reflected CRC32C polynomial (zlib's multmodp). */
+uint32_t crc32cMultiply(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31;
+    uint32_t p = 0;
+
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+/* x^(8*bytes) modulo the polynomial, used to move a register past that many zero bytes. */
+uint32_t crc32cShiftFor(unsigned long long bytes) {
+    uint32_t p = 1u << 31;
+    int k = 3;
+
+    while (bytes) {
+        if (bytes & 1)
+            p = crc32cMultiply(crc32cPowers[k & 31], p);
+        bytes >>= 1;
+        k++;
+    }
+    return p;
+}
+
+uint32_t crc32cCombine(uint32_t reg, uint32_t next, unsigned long long nextLen) {
+    return crc32cMultiply(crc32cShiftFor(nextLen), reg) ^ next;
+}
+
+void crc32cInitTables(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc32cTable[0][n] = c;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        for (int t = 1; t < 8; t++)
+            crc32cTable[t][n] = (crc32cTable[t - 1][n] >> 8) ^ crc32cTable[0][crc32cTable[t - 1][n] & 0xFF];
+    }
+    crc32cPowers[0] = 1u << 30;
+    for (int k = 1; k < 32; k++)
+        crc32cPowers[k] = crc32cMultiply(crc32cPowers[k - 1], crc32cPowers[k - 1]);
+    crc32cBlockShift = crc32cShiftFor(CRC_BLOCK);
+}
+
+uint64_t readLe64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+uint32_t crc32cScalar(uint32_t reg, const unsigned char *data, size_t len) {
+    while (len >= 8) {
+        uint64_t v = readLe64(data) ^ reg;
+        reg = crc32cTable[7][v & 0xFF] ^ crc32cTable[6][(v >> 8) & 0xFF] ^ crc32cTable[5][(v >> 16) & 0xFF] ^
+              crc32cTable[4][(v >> 24) & 0xFF] ^ crc32cTable[3][(v >> 32) & 0xFF] ^
+              crc32cTable[2][(v >> 40) & 0xFF] ^ crc32cTable[1][(v >> 48) & 0xFF] ^ crc32cTable[0][v >> 56];
+        data += 8;
+        len -= 8;
+    }
+    while (len--)
+        reg = (reg >> 8) ^ crc32cTable[0][(reg ^ *data++) & 0xFF];
+    return reg;
+}
+
+#if defined(HAVE_X86_SIMD) && defined(__x86_64__)
+/*
+ * The crc32 instruction has a latency of three cycles but a throughput of
+ * one, so three independent streams are run side by side and stitched
+ * together with the block shift constant.
+ */
+__attribute__((target("sse4.2")))
+uint32_t crc32cSse42(uint32_t reg, const unsigned char *data, size_t len) {
+    uint64_t c0 = reg;
+
+    while (len >= 3 * CRC_BLOCK) {
+        uint64_t c1 = 0;
+        uint64_t c2 = 0;
+        for (size_t i = 0; i < CRC_BLOCK; i += 8) {
+            c0 = _mm_crc32_u64(c0, readLe64(data + i));
+            c1 = _mm_crc32_u64(c1, readLe64(data + CRC_BLOCK + i));
+            c2 = _mm_crc32_u64(c2, readLe64(data + 2 * CRC_BLOCK + i));
+        }
+        c0 = crc32cMultiply(crc32cBlockShift, (uint32_t)c0) ^ (uint32_t)c1;
+        c0 = crc32cMultiply(crc32cBlockShift, (uint32_t)c0) ^ (uint32_t)c2;
+        data += 3 * CRC_BLOCK;
+        len -= 3 * CRC_BLOCK;
+    }
+    for (; len >= 8; data += 8, len -= 8)
+        c0 = _mm_crc32_u64(c0, readLe64(data));
+    while (len--)
+        c0 = _mm_crc32_u8((uint32_t)c0, *data++);
+    return (uint32_t)c0;
+}
+#endif
+
+const uint64_t hashKey[8] = {
+    0xBE4BA423396CFEB8ULL, 0x1CAD21F72C81017CULL, 0xDB979083E96DD4DEULL, 0x1F67B3B7A4A44072ULL,
+    0x78E5C0CC4EE679CBULL, 0x2172FFCC7DD05A82ULL, 0x8E2443F7744608B8ULL, 0x4C263A81E69035E0ULL,
+};
+
+const uint64_t hashScramble[8] = {
+    0xCB00C391BB52283CULL, 0xA32E531B8B65D088ULL, 0x4EF90DA297486471ULL, 0xD8ACDEA946EF1938ULL,
+    0x3F349CE33F76FAA8ULL, 0x1D4F0BC7C7BBDCF9ULL, 0x3159B4CD4BE0518AULL, 0x647378D9C97E9FC8ULL,
+};
+
+/*
+ * XXH3-style accumulation: every 64-byte stripe feeds eight 64-bit lanes
+ * with a 32x32->64 multiply of the keyed input, plus the raw input of the
+ * neighbouring lane; the key moves with the stripe index so that stripes
+ * cannot be reordered, and the lanes are scrambled every HASH_BLOCK_STRIPES.
+ */
+void hashStripesScalar(uint64_t *acc, const unsigned char *data, size_t stripes, uint64_t firstStripe) {
+    for (size_t s = 0; s < stripes; s++, data += HASH_STRIPE) {
+        uint64_t stripe = firstStripe + s;
+        uint64_t stripeKey = stripe * HASH_STRIPE_KEY;
+        for (int i = 0; i < 8; i++) {
+            uint64_t v = readLe64(data + 8 * i);
+            uint64_t k = v ^ (hashKey[i] + stripeKey);
+            acc[i ^ 1] += v;
+            acc[i] += (k & 0xFFFFFFFF) * (k >> 32);
+        }
+        if ((stripe + 1) % HASH_BLOCK_STRIPES == 0) {
+            for (int i = 0; i < 8; i++) {
+                acc[i] ^= acc[i] >> 47;
+                acc[i] ^= hashScramble[i];
+                acc[i] *= HASH_PRIME32;
+            }
+        }
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("avx2")))
+static inline __m256i hashScrambleAvx2(__m256i acc, __m256i key) {
+    const __m256i prime = _mm256_set1_epi32((int)HASH_PRIME32);
+    acc = _mm256_xor_si256(_mm256_xor_si256(acc, _mm256_srli_epi64(acc, 47)), key);
+    __m256i lo = _mm256_mul_epu32(acc, prime);
+    __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(acc, 32), prime);
+    return _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+}
+
+__attribute__((target("avx2")))
+void hashStripesAvx2(uint64_t *acc, const unsigned char *data, size_t stripes, uint64_t firstStripe) {
+    const __m256i key0 = _mm256_loadu_si256((const __m256i *)hashKey);
+    const __m256i key1 = _mm256_loadu_si256((const __m256i *)(hashKey + 4));
+    const __m256i scramble0 = _mm256_loadu_si256((const __m256i *)hashScramble);
+    const __m256i scramble1 = _mm256_loadu_si256((const __m256i *)(hashScramble + 4));
+    __m256i acc0 = _mm256_loadu_si256((const __m256i *)acc);
+    __m256i acc1 = _mm256_loadu_si256((const __m256i *)(acc + 4));
+
+    for (size_t s = 0; s < stripes; s++, data += HASH_STRIPE) {
+        uint64_t stripe = firstStripe + s;
+        __m256i stripeKey = _mm256_set1_epi64x((long long)(stripe * HASH_STRIPE_KEY));
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)data);
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(data + 32));
+        __m256i k0 = _mm256_xor_si256(v0, _mm256_add_epi64(key0, stripeKey));
+        __m256i k1 = _mm256_xor_si256(v1, _mm256_add_epi64(key1, stripeKey));
+        __m256i p0 = _mm256_mul_epu32(k0, _mm256_srli_epi64(k0, 32));
+        __m256i p1 = _mm256_mul_epu32(k1, _mm256_srli_epi64(k1, 32));
+        acc0 = _mm256_add_epi64(acc0, _mm256_add_epi64(p0, _mm256_shuffle_epi32(v0, _MM_SHUFFLE(1, 0, 3, 2))));
+        acc1 = _mm256_add_epi64(acc1, _mm256_add_epi64(p1, _mm256_shuffle_epi32(v1, _MM_SHUFFLE(1, 0, 3, 2))));
+        if ((stripe + 1) % HASH_BLOCK_STRIPES == 0) {
+            acc0 = hashScrambleAvx2(acc0, scramble0);
+            acc1 = hashScrambleAvx2(acc1, scramble1);
+        }
+    }
+    _mm256_storeu_si256((__m256i *)acc, acc0);
+    _mm256_storeu_si256((__m256i *)(acc + 4), acc1);
+}
+#endif
+
+void compileSearchPattern(SearchPattern *p, const char *needle) {
+    const unsigned char *n = (const unsigned char *)needle;
+    size_t l = strlen(needle);
+    size_t ip, jp, k, period, p0, ms;
+
+    p->needle = n;
+    p->len = l;
+    if (l <= SEARCH_SHORT_MAX)
+        return;
+
+    memset(p->shift, 0, sizeof(p->shift));
+    for (size_t i = 0; i < l; i++)
+        p->shift[n[i]] = i + 1;
+
+    ip = (size_t)-1;
+    jp = 0;
+    k = period = 1;
+    while (jp + k < l) {
+        if (n[ip + k] == n[jp + k]) {
+            if (k == period) {
+                jp += period;
+                k = 1;
+            } else {
+                k++;
+            }
+        } else if (n[ip + k] > n[jp + k]) {
+            jp += k;
+            k = 1;
+            period = jp - ip;
+        } else {
+            ip = jp++;
+            k = period = 1;
+        }
+    }
+    ms = ip;
+    p0 = period;
+
+    ip = (size_t)-1;
+    jp = 0;
+    k = period = 1;
+    while (jp + k < l) {
+        if (n[ip + k] == n[jp + k]) {
+            if (k == period) {
+                jp += period;
+                k = 1;
+            } else {
+                k++;
+            }
+        } else if (n[ip + k] < n[jp + k]) {
+            jp += k;
+            k = 1;
+            period = jp - ip;
+        } else {
+            ip = jp++;
+            k = period = 1;
+        }
+    }
+    if (ip + 1 > ms + 1)
+        ms = ip;
+    else
+        period = p0;
+
+    if (memcmp(n, n + period, ms + 1) != 0) {
+        p->memory0 = 0;
+        period = (ms > l - ms - 1 ? ms : l - ms - 1) + 1;
+    } else {
+        p->memory0 = l - period;
+    }
+    p->critical = ms;
+    p->period = period;
+}
+
+const unsigned char *searchTwoWay(const SearchPattern *p, const unsigned char *h, size_t len) {
+    const unsigned char *n = p->needle;
+    const unsigned char *end = h + len;
+    size_t l = p->len;
+    size_t ms = p->critical;
+    size_t mem = 0;
+    size_t k;
+
+    while ((size_t)(end - h) >= l) {
+        k = p->shift[h[l - 1]];
+        if (k == 0) {
+            h += l;
+            mem = 0;
+            continue;
+        }
+        k = l - k;
+        if (k) {
+            if (k < mem)
+                k = mem;
+            h += k;
+            mem = 0;
+            continue;
+        }
+
+        for (k = ms + 1 > mem ? ms + 1 : mem; k < l && n[k] == h[k]; k++)
+            ;
+        if (k < l) {
+            h += k - ms;
+            mem = 0;
+            continue;
+        }
+        for (k = ms + 1; k > mem && n[k - 1] == h[k - 1]; k--)
+            ;
+        if (k <= mem)
+            return h;
+        h += p->period;
+        mem = p->memory0;
+    }
+    return NULL;
+}
+
+const unsigned char *searchShortScalar(const SearchPattern *p, const unsigned char *h, size_t len) {
+    const unsigned char *n = p->needle;
+    size_t l = p->len;
+
+    if (l == 0)
+        return h;
+    while (len >= l) {
+        const unsigned char *hit = memchr(h, n[0], len - l + 1);
+        if (!hit)
+            return NULL;
+        if (hit[l - 1] == n[l - 1] && memcmp(hit + 1, n + 1, l > 1 ? l - 2 : 0) == 0)
+            return hit;
+        len -= hit + 1 - h;
+        h = hit + 1;
+    }
+    return NULL;
+}
+
+const unsigned char *searchScalar(const SearchPattern *p, const unsigned char *h, size_t len) {
+    if (p->len > SEARCH_SHORT_MAX)
+        return searchTwoWay(p, h, len);
+    return searchShortScalar(p, h, len);
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+const unsigned char *searchSse2(const SearchPattern *p, const unsigned char *h, size_t len) {
+    size_t l = p->len;
+    size_t i = 0;
+
+    if (l < 2 || l > SEARCH_SHORT_MAX)
+        return searchScalar(p, h, len);
+
+    const __m128i first = _mm_set1_epi8((char)p->needle[0]);
+    const __m128i last = _mm_set1_epi8((char)p->needle[l - 1]);
+    for (; len >= l && i + l - 1 + 16 <= len; i += 16) {
+        __m128i bf = _mm_loadu_si128((const __m128i *)(h + i));
+        __m128i bl = _mm_loadu_si128((const __m128i *)(h + i + l - 1));
+        unsigned int bits = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(bf, first), _mm_cmpeq_epi8(bl, last)));
+        while (bits) {
+            int bit = __builtin_ctz(bits);
+            if (memcmp(h + i + bit + 1, p->needle + 1, l - 2) == 0)
+                return h + i + bit;
+            bits &= bits - 1;
+        }
+    }
+    return searchShortScalar(p, h + i, len - i);
+}
+
+__attribute__((target("avx2")))
+const unsigned char *searchAvx2(const SearchPattern *p, const unsigned char *h, size_t len) {
+    size_t l = p->len;
+    size_t i = 0;
+
+    if (l < 2 || l > SEARCH_SHORT_MAX)
+        return searchScalar(p, h, len);
+
+    const __m256i first = _mm256_set1_epi8((char)p->needle[0]);
+    const __m256i last = _mm256_set1_epi8((char)p->needle[l - 1]);
+    for (; len >= l && i + l - 1 + 32 <= len; i += 32) {
+        __m256i bf = _mm256_loadu_si256((const __m256i *)(h + i));
+        __m256i bl = _mm256_loadu_si256((const __m256i *)(h + i + l - 1));
+        unsigned int bits = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(bf, first), _mm256_cmpeq_epi8(bl, last)));
+        while (bits) {
+            int bit = __builtin_ctz(bits);
+            if (memcmp(h + i + bit + 1, p->needle + 1, l - 2) == 0)
+                return h + i + bit;
+            bits &= bits - 1;
+        }
+    }
+    return searchShortScalar(p, h + i, len - i);
+}
+#endif
+
+unsigned long long countNewlines(const unsigned char *data, size_t len) {
+    unsigned long long count = 0;
+    for (size_t i = 0; i < len; i++)
+        count += data[i] == '\n';
+    return count;
+}
+
+int cpuSupports(int isa) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    switch (isa) {
+    case ISA_SCALAR:
+        return 1;
+    case ISA_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case ISA_SSE42:
+        return __builtin_cpu_supports("sse4.2");
+    case ISA_AVX2:
+        return __builtin_cpu_supports("avx2");
+    case ISA_AVX512:
+        return __builtin_cpu_supports("avx512f");
+    }
+    return 0;
+#else
+    return isa == ISA_SCALAR;
+#endif
+}
+
+XorKernel xorKernels[] = {
+    {"scalar", ISA_SCALAR, xorFoldScalar},
+#ifdef HAVE_X86_SIMD
+    {"sse2", ISA_SSE2, xorFoldSse2},
+    {"avx2", ISA_AVX2, xorFoldAvx2},
+#endif
+};
+
+MaskKernel maskKernels[] = {
+    {"scalar", ISA_SCALAR, countMaskedScalar},
+#ifdef HAVE_X86_SIMD
+    {"sse2", ISA_SSE2, countMaskedSse2},
+    {"avx2", ISA_AVX2, countMaskedAvx2},
+    {"avx512", ISA_AVX512, countMaskedAvx512},
+#endif
+};
+
+MaskSetKernel maskSetKernels[] = {
+    {"scalar", ISA_SCALAR, {countMaskSet8Scalar, countMaskSet16Scalar, countMaskSet32Scalar, countMaskSet64Scalar}},
+#ifdef HAVE_X86_SIMD
+    {"sse2", ISA_SSE2, {countMaskSet8Sse2, countMaskSet16Sse2, countMaskSet32Sse2, countMaskSet64Sse2}},
+    {"avx2", ISA_AVX2, {countMaskSet8Avx2, countMaskSet16Avx2, countMaskSet32Avx2, countMaskSet64Avx2}},
+#endif
+};
+
+CrcKernel crcKernels[] = {
+    {"scalar", ISA_SCALAR, crc32cScalar},
+#if defined(HAVE_X86_SIMD) && defined(__x86_64__)
+    {"sse4.2", ISA_SSE42, crc32cSse42},
+#endif
+};
+
+HashKernel hashKernels[] = {
+    {"scalar", ISA_SCALAR, hashStripesScalar},
+#ifdef HAVE_X86_SIMD
+    {"avx2", ISA_AVX2, hashStripesAvx2},
+#endif
+};
+
+SearchKernel searchKernels[] = {
+    {"scalar", ISA_SCALAR, searchScalar},
+#ifdef HAVE_X86_SIMD
+    {"sse2", ISA_SSE2, searchSse2},
+    {"avx2", ISA_AVX2, searchAvx2},
+#endif
+};
+
+XorFoldFn xorFold = xorFoldScalar;
+MaskCountFn countMaskedWords = countMaskedScalar;
+const MaskSetKernel *maskSetKernel = &maskSetKernels[0];
+CrcUpdateFn crc32cUpdate = crc32cScalar;
+HashStripeFn hashStripes = hashStripesScalar;
+SearchFn searchNext = searchScalar;
+
+void selectKernels(void) {
+    crc32cInitTables();
+    for (size_t k = 0; k < sizeof(xorKernels) / sizeof(xorKernels[0]); k++) {
+        if (cpuSupports(xorKernels[k].isa))
+            xorFold = xorKernels[k].fn;
+    }
+    for (size_t k = 0; k < sizeof(maskKernels) / sizeof(maskKernels[0]); k++) {
+        if (cpuSupports(maskKernels[k].isa))
+            countMaskedWords = maskKernels[k].fn;
+    }
+    for (size_t k = 0; k < sizeof(maskSetKernels) / sizeof(maskSetKernels[0]); k++) {
+        if (cpuSupports(maskSetKernels[k].isa))
+            maskSetKernel = &maskSetKernels[k];
+    }
+    for (size_t k = 0; k < sizeof(crcKernels) / sizeof(crcKernels[0]); k++) {
+        if (cpuSupports(crcKernels[k].isa))
+            crc32cUpdate = crcKernels[k].fn;
+    }
+    for (size_t k = 0; k < sizeof(hashKernels) / sizeof(hashKernels[0]); k++) {
+        if (cpuSupports(hashKernels[k].isa))
+            hashStripes = hashKernels[k].fn;
+    }
+    for (size_t k = 0; k < sizeof(searchKernels) / sizeof(searchKernels[0]); k++) {
+        if (cpuSupports(searchKernels[k].isa))
+            searchNext = searchKernels[k].fn;
+    }
+}
+
+int maskWidthIndex(int width) {
+    return width == 8 ? 0 : width == 16 ? 1 : width == 32 ? 2 : 3;
+}
+
+uint32_t selfTestRandom(uint32_t *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+int runSelfTest(void) {
+    unsigned char *data = statsMalloc(SELFTEST_WORDS * sizeof(unsigned int) + 1);
+    unsigned int masks[] = {0, 0xFFFFFFFF, 1, 0x80000001, 0x00FF00FF, 0x12345678};
+    uint32_t seed = 0x2545F491;
+    int failures = 0;
+
+    if (!data) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+
+    for (size_t m = 0; m < sizeof(masks) / sizeof(masks[0]); m++) {
+        for (size_t i = 0; i < SELFTEST_WORDS * sizeof(unsigned int) + 1; i++) {
+            uint32_t r = selfTestRandom(&seed);
+            unsigned char byte = (unsigned char)r;
+            if (r & 0x100)
+                byte |= (unsigned char)(masks[m] >> (8 * (i % 4)));
+            data[i] = byte;
+        }
+        for (size_t k = 1; k < sizeof(maskKernels) / sizeof(maskKernels[0]); k++) {
+            if (!cpuSupports(maskKernels[k].isa))
+                continue;
+            for (size_t offset = 0; offset <= 1; offset++) {
+                for (size_t words = 0; words <= SELFTEST_WORDS; words += (words < 80 ? 1 : 997)) {
+                    unsigned long long want = countMaskedScalar(data + offset, words, masks[m]);
+                    unsigned long long got = maskKernels[k].fn(data + offset, words, masks[m]);
+                    if (want != got) {
+                        fprintf(stderr, "mask/%s: mask %X, %zu words: got %llu, want %llu\n",
+                                maskKernels[k].name, masks[m], words, got, want);
+                        failures++;
+                    }
+                }
+            }
+        }
+    }
+
+    uint64_t setMasks[] = {0, ~0ULL, 1, 0x8000000000000001ULL, 0x00FF00FF00FF00FFULL, 0x0102040810204080ULL,
+                           0x1234567812345678ULL};
+    int setCount = sizeof(setMasks) / sizeof(setMasks[0]);
+    for (size_t k = 1; k < sizeof(maskSetKernels) / sizeof(maskSetKernels[0]); k++) {
+        if (!cpuSupports(maskSetKernels[k].isa))
+            continue;
+        for (int w = 0; w < 4; w++) {
+            int bytes = 1 << w;
+            for (size_t words = 0; words * bytes <= SELFTEST_WORDS * sizeof(unsigned int);
+                 words += (words < 300 ? 1 : 2011)) {
+                unsigned long long want[sizeof(setMasks) / sizeof(setMasks[0])] = {0};
+                unsigned long long got[sizeof(setMasks) / sizeof(setMasks[0])] = {0};
+                maskSetKernels[0].fn[w](data + 1, words, setMasks, setCount, want);
+                maskSetKernels[k].fn[w](data + 1, words, setMasks, setCount, got);
+                if (memcmp(want, got, sizeof(want)) != 0) {
+                    fprintf(stderr, "maskset/%s: %d-bit words, %zu words: mismatch\n", maskSetKernels[k].name,
+                            8 * bytes, words);
+                    failures++;
+                }
+            }
+        }
+    }
+
+    if (crc32cScalar(~0u, (const unsigned char *)"123456789", 9) != ~0xE3069283u) {
+        fprintf(stderr, "crc32c/scalar: check value mismatch\n");
+        failures++;
+    }
+    for (size_t k = 1; k < sizeof(crcKernels) / sizeof(crcKernels[0]); k++) {
+        if (!cpuSupports(crcKernels[k].isa))
+            continue;
+        for (size_t len = 0; len <= SELFTEST_WORDS * sizeof(unsigned int); len += (len < 100 ? 1 : 1021)) {
+            uint32_t want = crc32cScalar(~0u, data + 1, len);
+            uint32_t got = crcKernels[k].fn(~0u, data + 1, len);
+            if (want != got) {
+                fprintf(stderr, "crc32c/%s: mismatch at %zu bytes\n", crcKernels[k].name, len);
+                failures++;
+            }
+        }
+    }
+    for (size_t split = 0; split <= SELFTEST_WORDS; split += 997) {
+        uint32_t whole = crc32cScalar(~0u, data, SELFTEST_WORDS);
+        uint32_t head = crc32cScalar(~0u, data, split);
+        uint32_t tail = crc32cScalar(0, data + split, SELFTEST_WORDS - split);
+        if (crc32cCombine(head, tail, SELFTEST_WORDS - split) != whole) {
+            fprintf(stderr, "crc32c: combine mismatch at split %zu\n", split);
+            failures++;
+        }
+    }
+    for (size_t k = 1; k < sizeof(hashKernels) / sizeof(hashKernels[0]); k++) {
+        if (!cpuSupports(hashKernels[k].isa))
+            continue;
+        for (size_t stripes = 0; stripes * HASH_STRIPE <= SELFTEST_WORDS * sizeof(unsigned int); stripes += 7) {
+            uint64_t want[8];
+            uint64_t got[8];
+            memcpy(want, hashScramble, sizeof(want));
+            memcpy(got, hashScramble, sizeof(got));
+            hashStripesScalar(want, data + 1, stripes, 3);
+            hashKernels[k].fn(got, data + 1, stripes, 3);
+            if (memcmp(want, got, sizeof(want)) != 0) {
+                fprintf(stderr, "hash/%s: mismatch at %zu stripes\n", hashKernels[k].name, stripes);
+                failures++;
+            }
+        }
+    }
+
+    for (size_t k = 1; k < sizeof(xorKernels) / sizeof(xorKernels[0]); k++) {
+        if (!cpuSupports(xorKernels[k].isa))
+            continue;
+        for (size_t len = 0; len <= SELFTEST_WORDS * sizeof(unsigned int); len += (len < 1024 ? XOR_WORD_SIZE : 4096)) {
+            unsigned char want[XOR_WORD_SIZE] = {0};
+            unsigned char got[XOR_WORD_SIZE] = {0};
+            xorFoldScalar(want, data + 1, len);
+            xorKernels[k].fn(got, data + 1, len);
+            if (memcmp(want, got, XOR_WORD_SIZE) != 0) {
+                fprintf(stderr, "xor/%s: mismatch at %zu bytes\n", xorKernels[k].name, len);
+                failures++;
+            }
+        }
+    }
+    for (size_t i = 0; i < SELFTEST_WORDS; i++)
+        data[i] = "ab\nc"[selfTestRandom(&seed) % 4];
+    for (size_t l = 1; l <= 2 * SEARCH_SHORT_MAX + 3; l += (l < 8 ? 1 : 7)) {
+        char needle[2 * SEARCH_SHORT_MAX + 4];
+        SearchPattern pattern;
+        memcpy(needle, data + selfTestRandom(&seed) % (SELFTEST_WORDS - l), l);
+        needle[l] = '\0';
+        compileSearchPattern(&pattern, needle);
+        for (size_t k = 0; k < sizeof(searchKernels) / sizeof(searchKernels[0]); k++) {
+            if (!cpuSupports(searchKernels[k].isa))
+                continue;
+            for (size_t len = 0; len <= SELFTEST_WORDS; len += (len < 100 ? 1 : 499)) {
+                const unsigned char *want = memmem(data, len, needle, l);
+                const unsigned char *got = searchKernels[k].fn(&pattern, data, len);
+                if (want != got) {
+                    fprintf(stderr, "search/%s: needle length %zu, %zu bytes: got %td, want %td\n",
+                            searchKernels[k].name, l, len, got ? got - data : -1, want ? want - data : -1);
+                    failures++;
+                }
+            }
+        }
+    }
+    free(data);
+
+    for (size_t k = 0; k < sizeof(maskKernels) / sizeof(maskKernels[0]); k++)
+        printf("mask/%s: %s\n", maskKernels[k].name, cpuSupports(maskKernels[k].isa) ? "checked" : "unsupported");
+    for (size_t k = 0; k < sizeof(maskSetKernels) / sizeof(maskSetKernels[0]); k++)
+        printf("maskset/%s: %s\n", maskSetKernels[k].name, cpuSupports(maskSetKernels[k].isa) ? "checked" : "unsupported");
+    for (size_t k = 0; k < sizeof(crcKernels) / sizeof(crcKernels[0]); k++)
+        printf("crc32c/%s: %s\n", crcKernels[k].name, cpuSupports(crcKernels[k].isa) ? "checked" : "unsupported");
+    for (size_t k = 0; k < sizeof(hashKernels) / sizeof(hashKernels[0]); k++)
+        printf("hash/%s: %s\n", hashKernels[k].name, cpuSupports(hashKernels[k].isa) ? "checked" : "unsupported");
+    for (size_t k = 0; k < sizeof(xorKernels) / sizeof(xorKernels[0]); k++)
+        printf("xor/%s: %s\n", xorKernels[k].name, cpuSupports(xorKernels[k].isa) ? "checked" : "unsupported");
+    for (size_t k = 0; k < sizeof(searchKernels) / sizeof(searchKernels[0]); k++)
+        printf("search/%s: %s\n", searchKernels[k].name, cpuSupports(searchKernels[k].isa) ? "checked" : "unsupported");
+    printf("Self-test %s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
+
+int defaultJobs(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+int takeJob(WorkPool *pool, int id) {
+    WorkDeque *own = &pool->deques[id];
+    int job = -1;
+
+    pthread_mutex_lock(&own->lock);
+    if (own->begin < own->end)
+        job = own->begin++;
+    pthread_mutex_unlock(&own->lock);
+    if (job >= 0)
+        return job;
+
+    for (int k = 1; k < pool->workerCount; k++) {
+        WorkDeque *victim = &pool->deques[(id + k) % pool->workerCount];
+        int begin = 0;
+        int end = 0;
+
+        pthread_mutex_lock(&victim->lock);
+        int left = victim->end - victim->begin;
+        if (left > 0) {
+            int stolen = (left + 1) / 2;
+            end = victim->end;
+            begin = end - stolen;
+            victim->end = begin;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (begin < end) {
+            pthread_mutex_lock(&own->lock);
+            own->begin = begin + 1;
+            own->end = end;
+            pthread_mutex_unlock(&own->lock);
+            return begin;
+        }
+    }
+    return -1;
+}
+
+void finishJob(WorkPool *pool, int job, char *output, size_t len) {
+    int phase = statsPhase(PHASE_OUTPUT);
+    pthread_mutex_lock(&pool->printLock);
+    pool->outputs[job] = output;
+    pool->outputLens[job] = len;
+    pool->ready[job] = 1;
+    while (pool->nextToPrint < pool->jobCount && pool->ready[pool->nextToPrint]) {
+        int next = pool->nextToPrint++;
+        if (pool->outputs[next]) {
+            fwrite(pool->outputs[next], 1, pool->outputLens[next], stdout);
+            free(pool->outputs[next]);
+            pool->outputs[next] = NULL;
+        }
+    }
+    fflush(stdout);
+    pthread_mutex_unlock(&pool->printLock);
+    statsPhase(phase);
+}
+
+void *poolWorker(void *arg) {
+    Worker *worker = arg;
+    WorkPool *pool = worker->pool;
+    uint64_t started = stats.mode ? statsClock() : 0;
+    int phase = statsPhase(PHASE_WAIT);
+    int job;
+
+    while ((job = takeJob(pool, worker->id)) >= 0) {
+        char *output = NULL;
+        size_t len = 0;
+        FILE *out = open_memstream(&output, &len);
+        if (!out) {
+            fprintf(stderr, "Memory allocation failed\n");
+            finishJob(pool, job, NULL, 0);
+            continue;
+        }
+        uint64_t busy = stats.mode ? statsClock() : 0;
+        statsPhase(PHASE_OTHER);
+        pool->fn(job, out, pool->ctx);
+        fclose(out);
+        statsAllocated(len + 1);
+        statsPhase(PHASE_WAIT);
+        if (stats.mode) {
+            worker->stats.busyNs += statsClock() - busy;
+            worker->stats.jobs++;
+        }
+        finishJob(pool, job, output, len);
+    }
+    if (stats.mode)
+        worker->stats.idleNs = statsClock() - started - worker->stats.busyNs;
+    statsPhase(phase);
+    statsFlushThread();
+    return NULL;
+}
+
+void runPool(int jobCount, int workerCount, JobFn fn, void *ctx) {
+    WorkPool pool;
+
+    if (workerCount > jobCount)
+        workerCount = jobCount;
+    if (workerCount <= 1) {
+        WorkerStats single = {0, 0, 0};
+        uint64_t started = stats.mode ? statsClock() : 0;
+        for (int i = 0; i < jobCount; i++) {
+            fn(i, stdout, ctx);
+            fflush(stdout);
+        }
+        if (stats.mode) {
+            single.jobs = jobCount;
+            single.busyNs = statsClock() - started;
+        }
+        statsWorker(0, &single);
+        return;
+    }
+
+    pool.fn = fn;
+    pool.ctx = ctx;
+    pool.jobCount = jobCount;
+    pool.workerCount = workerCount;
+    pool.nextToPrint = 0;
+    pool.deques = statsCalloc(workerCount, sizeof(WorkDeque));
+    pool.outputs = statsCalloc(jobCount, sizeof(char *));
+    pool.outputLens = statsCalloc(jobCount, sizeof(size_t));
+    pool.ready = statsCalloc(jobCount, 1);
+    pthread_t *threads = statsCalloc(workerCount, sizeof(pthread_t));
+    Worker *workers = statsCalloc(workerCount, sizeof(Worker));
+    if (!pool.deques || !pool.outputs || !pool.outputLens || !pool.ready || !threads || !workers) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(pool.deques);
+        free(pool.outputs);
+        free(pool.outputLens);
+        free(pool.ready);
+        free(threads);
+        free(workers);
+        return;
+    }
+    pthread_mutex_init(&pool.printLock, NULL);
+
+    for (int w = 0; w < workerCount; w++) {
+        pool.deques[w].begin = (int)((long long)jobCount * w / workerCount);
+        pool.deques[w].end = (int)((long long)jobCount * (w + 1) / workerCount);
+        pthread_mutex_init(&pool.deques[w].lock, NULL);
+        workers[w].pool = &pool;
+        workers[w].id = w;
+    }
+
+    int started = 0;
+    for (int w = 0; w < workerCount; w++) {
+        if (pthread_create(&threads[w], NULL, poolWorker, &workers[w]) != 0) {
+            fprintf(stderr, "Error creating thread\n");
+            break;
+        }
+        started++;
+    }
+    if (started == 0)
+        poolWorker(&workers[0]);
+    int phase = statsPhase(PHASE_WAIT);
+    for (int w = 0; w < started; w++)
+        pthread_join(threads[w], NULL);
+    statsPhase(phase);
+    for (int w = 0; w < workerCount; w++)
+        statsWorker(w, &workers[w].stats);
+
+    for (int w = 0; w < workerCount; w++)
+        pthread_mutex_destroy(&pool.deques[w].lock);
+    pthread_mutex_destroy(&pool.printLock);
+    free(pool.deques);
+    free(pool.outputs);
+    free(pool.outputLens);
+    free(pool.ready);
+    free(threads);
+    free(workers);
+}
+
+void *runRangeTask(void *arg) {
+    RangeTask *task = arg;
+    int phase = statsPhase(PHASE_COMPUTE);
+    task->fn(task->state, task->data, task->len);
+    statsPhase(phase);
+    statsFlushThread();
+    return NULL;
+}
+
+int parallelParts(const InputFile *in, int jobs) {
+    if (!in->mapped || jobs <= 1)
+        return 1;
+    unsigned long long parts = in->size / PARALLEL_MIN_CHUNK;
+    if (parts > (unsigned long long)jobs)
+        parts = jobs;
+    return parts > 1 ? (int)parts : 1;
+}
+
+void parallelRanges(const unsigned char *data, size_t len, int parts, RangeFn fn, void *states, size_t stateSize) {
+    RangeTask *tasks = statsCalloc(parts, sizeof(RangeTask));
+    pthread_t *threads = statsCalloc(parts, sizeof(pthread_t));
+    char *started = statsCalloc(parts, 1);
+    size_t step = (len / parts + PARALLEL_ALIGN - 1) / PARALLEL_ALIGN * PARALLEL_ALIGN;
+
+    if (!tasks || !threads || !started) {
+        free(tasks);
+        free(threads);
+        free(started);
+        fn(states, data, len);
+        return;
+    }
+
+    for (int k = 0; k < parts; k++) {
+        size_t begin = step * k < len ? step * k : len;
+        size_t end = k == parts - 1 || step * (k + 1) > len ? len : step * (k + 1);
+        tasks[k].fn = fn;
+        tasks[k].state = (char *)states + stateSize * k;
+        tasks[k].data = data + begin;
+        tasks[k].len = end - begin;
+        if (k > 0 && pthread_create(&threads[k], NULL, runRangeTask, &tasks[k]) == 0)
+            started[k] = 1;
+    }
+    runRangeTask(&tasks[0]);
+    for (int k = 1; k < parts; k++) {
+        if (started[k]) {
+            int phase = statsPhase(PHASE_WAIT);
+            pthread_join(threads[k], NULL);
+            statsPhase(phase);
+        } else {
+            runRangeTask(&tasks[k]);
+        }
+    }
+    free(tasks);
+    free(threads);
+    free(started);
+}
+
+void xorInit(XorState *st) {
+    memset(st->acc, 0, sizeof(st->acc));
+    st->length = 0;
+}
+
+void xorUpdate(XorState *st, const unsigned char *data, size_t len) {
+    size_t phase = st->length % XOR_WORD_SIZE;
+    size_t i = 0;
+    st->length += len;
+
+    if (phase != 0) {
+        for (; i < len && phase < XOR_WORD_SIZE; i++, phase++)
+            st->acc[phase] ^= data[i];
+    }
+
+    size_t bulk = (len - i) & ~(size_t)(XOR_WORD_SIZE - 1);
+    if (bulk > 0) {
+        xorFold(st->acc, data + i, bulk);
+        i += bulk;
+    }
+
+    for (phase = 0; i < len; i++, phase++)
+        st->acc[phase] ^= data[i];
+}
+
+void xorRange(void *state, const unsigned char *data, size_t len) {
+    xorUpdate(state, data, len);
+}
+
+void xorMerge(XorState *st, const XorState *part) {
+    for (int j = 0; j < XOR_WORD_SIZE; j++)
+        st->acc[j] ^= part->acc[j];
+    st->length += part->length;
+}
+
+void xorFinish(const XorState *st, int blockSize, unsigned char *result) {
+    memset(result, 0, blockSize);
+    for (int j = 0; j < XOR_WORD_SIZE; j++)
+        result[j % blockSize] ^= st->acc[j];
+
+    int tail = st->length % blockSize;
+    if (tail != 0) {
+        for (int j = tail; j < blockSize; j++)
+            result[j] ^= XOR_PAD_BYTE;
+    }
+}
+
+void printXorResult(FILE *out, const char *fileName, const XorState *st, int N) {
+    if (N == 2) {
+        unsigned char folded;
+        xorFinish(st, 1, &folded);
+        fprintf(out, "File: %s, XOR result (4 bits): %X\n", fileName, (folded ^ (folded >> 4)) & 0x0F);
+        return;
+    }
+
+    int blockSize = (1 << N) / 8;
+    unsigned char result[XOR_WORD_SIZE];
+    xorFinish(st, blockSize, result);
+
+    fprintf(out, "File: %s, XOR result: ", fileName);
+    for (int j = 0; j < blockSize; j++) {
+        fprintf(out, "%02X", result[j]);
+    }
+    fprintf(out, "\n");
+}
+
+int xorInput(InputFile *in, XorState *st, int jobs) {
+    int parts = parallelParts(in, jobs);
+    const unsigned char *data;
+    ssize_t got;
+
+    xorInit(st);
+    if (parts > 1) {
+        XorState *partial = statsMalloc(parts * sizeof(XorState));
+        if (partial) {
+            for (int k = 0; k < parts; k++)
+                xorInit(&partial[k]);
+            parallelRanges(in->map, in->size, parts, xorRange, partial, sizeof(XorState));
+            for (int k = 0; k < parts; k++)
+                xorMerge(st, &partial[k]);
+            free(partial);
+            return 0;
+        }
+    }
+
+    while ((got = inputNext(in, &data)) > 0)
+        xorUpdate(st, data, got);
+    return got < 0 ? -1 : 0;
+}
+
+void maskInit(MaskState *st, unsigned int mask) {
+    st->mask = mask;
+    st->count = 0;
+    st->carryLen = 0;
+}
+
+void maskUpdate(MaskState *st, const unsigned char *data, size_t len) {
+    size_t i = 0;
+
+    if (st->carryLen > 0) {
+        while (i < len && st->carryLen < sizeof(unsigned int))
+            st->carry[st->carryLen++] = data[i++];
+        if (st->carryLen < sizeof(unsigned int))
+            return;
+        st->count += countMaskedWords(st->carry, 1, st->mask);
+        st->carryLen = 0;
+    }
+
+    size_t words = (len - i) / sizeof(unsigned int);
+    st->count += countMaskedWords(data + i, words, st->mask);
+    i += words * sizeof(unsigned int);
+
+    while (i < len)
+        st->carry[st->carryLen++] = data[i++];
+}
+
+void maskRange(void *state, const unsigned char *data, size_t len) {
+    maskUpdate(state, data, len);
+}
+
+int maskInput(InputFile *in, MaskState *st, unsigned int mask, int jobs) {
+    int parts = parallelParts(in, jobs);
+    const unsigned char *data;
+    ssize_t got;
+
+    maskInit(st, mask);
+    if (parts > 1) {
+        MaskState *partial = statsMalloc(parts * sizeof(MaskState));
+        if (partial) {
+            for (int k = 0; k < parts; k++)
+                maskInit(&partial[k], mask);
+            parallelRanges(in->map, in->size, parts, maskRange, partial, sizeof(MaskState));
+            for (int k = 0; k < parts; k++)
+                st->count += partial[k].count;
+            free(partial);
+            return 0;
+        }
+    }
+
+    while ((got = inputNext(in, &data)) > 0)
+        maskUpdate(st, data, got);
+    return got < 0 ? -1 : 0;
+}
+
+void maskSetInit(MaskSetState *st, const Operation *op) {
+    st->op = op;
+    memset(st->counts, 0, op->maskCount * sizeof(st->counts[0]));
+    st->carryLen = 0;
+}
+
+void maskSetUpdate(MaskSetState *st, const unsigned char *data, size_t len) {
+    const Operation *op = st->op;
+    MaskSetFn count = maskSetKernel->fn[maskWidthIndex(op->width)];
+    size_t wordSize = op->width / 8;
+    size_t i = 0;
+
+    if (st->carryLen > 0) {
+        while (i < len && st->carryLen < wordSize)
+            st->carry[st->carryLen++] = data[i++];
+        if (st->carryLen < wordSize)
+            return;
+        count(st->carry, 1, op->matchMasks, op->maskCount, st->counts);
+        st->carryLen = 0;
+    }
+
+    size_t words = (len - i) / wordSize;
+    count(data + i, words, op->matchMasks, op->maskCount, st->counts);
+    i += words * wordSize;
+
+    while (i < len)
+        st->carry[st->carryLen++] = data[i++];
+}
+
+void maskSetRange(void *state, const unsigned char *data, size_t len) {
+    maskSetUpdate(state, data, len);
+}
+
+int maskSetInput(InputFile *in, MaskSetState *st, const Operation *op, int jobs) {
+    int parts = parallelParts(in, jobs);
+    const unsigned char *data;
+    ssize_t got;
+
+    maskSetInit(st, op);
+    if (parts > 1) {
+        MaskSetState *partial = statsMalloc(parts * sizeof(MaskSetState));
+        if (partial) {
+            for (int k = 0; k < parts; k++)
+                maskSetInit(&partial[k], op);
+            parallelRanges(in->map, in->size, parts, maskSetRange, partial, sizeof(MaskSetState));
+            for (int k = 0; k < parts; k++) {
+                for (int m = 0; m < op->maskCount; m++)
+                    st->counts[m] += partial[k].counts[m];
+            }
+            free(partial);
+            return 0;
+        }
+    }
+
+    while ((got = inputNext(in, &data)) > 0)
+        maskSetUpdate(st, data, got);
+    return got < 0 ? -1 : 0;
+}
+
+void printMaskSetResult(FILE *out, const char *fileName, const MaskSetState *st) {
+    const Operation *op = st->op;
+    if (op->maskCount == 1) {
+        fprintf(out, "File: %s, Count: %llu\n", fileName, st->counts[0]);
+        return;
+    }
+    for (int m = 0; m < op->maskCount; m++)
+        fprintf(out, "File: %s, Mask: %0*llX, Count: %llu\n", fileName, op->width / 4,
+                (unsigned long long)op->masks[m], st->counts[m]);
+}
+
+void crcInit(CrcState *st, uint32_t reg) {
+    st->reg = reg;
+    st->length = 0;
+}
+
+void crcUpdate(CrcState *st, const unsigned char *data, size_t len) {
+    st->reg = crc32cUpdate(st->reg, data, len);
+    st->length += len;
+}
+
+void crcRange(void *state, const unsigned char *data, size_t len) {
+    crcUpdate(state, data, len);
+}
+
+/* Parts start from a zero register and are folded in order with crc32cCombine. */
+int crcInput(InputFile *in, CrcState *st, int jobs) {
+    int parts = parallelParts(in, jobs);
+    const unsigned char *data;
+    ssize_t got;
+
+    crcInit(st, ~0u);
+    if (parts > 1) {
+        CrcState *partial = statsMalloc(parts * sizeof(CrcState));
+        if (partial) {
+            for (int k = 0; k < parts; k++)
+                crcInit(&partial[k], 0);
+            parallelRanges(in->map, in->size, parts, crcRange, partial, sizeof(CrcState));
+            for (int k = 0; k < parts; k++) {
+                st->reg = crc32cCombine(st->reg, partial[k].reg, partial[k].length);
+                st->length += partial[k].length;
+            }
+            free(partial);
+            return 0;
+        }
+    }
+
+    while ((got = inputNext(in, &data)) > 0)
+        crcUpdate(st, data, got);
+    return got < 0 ? -1 : 0;
+}
+
+uint64_t hashAvalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    return h ^ (h >> 32);
+}
+
+uint64_t hashMultiplyFold(uint64_t a, uint64_t b) {
+    uint64_t loLo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+    uint64_t hiLo = (a >> 32) * (b & 0xFFFFFFFF);
+    uint64_t loHi = (a & 0xFFFFFFFF) * (b >> 32);
+    uint64_t hiHi = (a >> 32) * (b >> 32);
+    uint64_t cross = (loLo >> 32) + (hiLo & 0xFFFFFFFF) + loHi;
+    uint64_t upper = (hiLo >> 32) + (cross >> 32) + hiHi;
+    uint64_t lower = (cross << 32) | (loLo & 0xFFFFFFFF);
+    return lower ^ upper;
+}
+
+void hashInit(HashState *st, const unsigned char *base) {
+    memset(st, 0, sizeof(*st));
+    memcpy(st->acc, hashKey, sizeof(st->acc));
+    st->base = base;
+}
+
+/*
+ * Input is hashed in independent HASH_LEAF leaves.  Each leaf digest is
+ * bound to its index and the digests are summed, so leaves can be hashed
+ * in any order or on any thread and merged by addition.
+ */
+void hashLeafDone(HashState *st) {
+    uint64_t len = st->leafFill;
+    uint64_t lo = len * HASH_PRIME64_1;
+    uint64_t hi = ~len * HASH_PRIME64_2;
+
+    for (int i = 0; i < 8; i += 2) {
+        lo += hashMultiplyFold(st->acc[i] ^ hashKey[i + 1], st->acc[i + 1] ^ hashScramble[i]);
+        hi += hashMultiplyFold(st->acc[i] ^ hashScramble[i + 1], st->acc[i + 1] ^ hashKey[i]);
+    }
+    st->sumLo += hashAvalanche(hashAvalanche(lo) ^ (st->leafIndex + 1) * HASH_PRIME64_1);
+    st->sumHi += hashAvalanche(hashAvalanche(hi) ^ (st->leafIndex + 1) * HASH_PRIME64_2);
+    st->leafIndex++;
+    st->leafFill = 0;
+    memcpy(st->acc, hashKey, sizeof(st->acc));
+}
+
+void hashUpdate(HashState *st, const unsigned char *data, size_t len) {
+    st->length += len;
+    while (len > 0) {
+        if (st->stripeLen > 0 || len < HASH_STRIPE) {
+            size_t take = HASH_STRIPE - st->stripeLen < len ? HASH_STRIPE - st->stripeLen : len;
+            memcpy(st->stripe + st->stripeLen, data, take);
+            st->stripeLen += take;
+            data += take;
+            len -= take;
+            if (st->stripeLen < HASH_STRIPE)
+                continue;
+            hashStripes(st->acc, st->stripe, 1, st->leafFill / HASH_STRIPE);
+            st->stripeLen = 0;
+            st->leafFill += HASH_STRIPE;
+        } else {
+            size_t stripes = len / HASH_STRIPE;
+            size_t room = (HASH_LEAF - st->leafFill) / HASH_STRIPE;
+            if (stripes > room)
+                stripes = room;
+            hashStripes(st->acc, data, stripes, st->leafFill / HASH_STRIPE);
+            st->leafFill += stripes * HASH_STRIPE;
+            data += stripes * HASH_STRIPE;
+            len -= stripes * HASH_STRIPE;
+        }
+        if (st->leafFill == HASH_LEAF)
+            hashLeafDone(st);
+    }
+}
+
+void hashFlush(HashState *st) {
+    if (st->stripeLen > 0) {
+        memset(st->stripe + st->stripeLen, 0, HASH_STRIPE - st->stripeLen);
+        hashStripes(st->acc, st->stripe, 1, st->leafFill / HASH_STRIPE);
+        st->leafFill += st->stripeLen;
+        st->stripeLen = 0;
+    }
+    if (st->leafFill > 0)
+        hashLeafDone(st);
+}
+
+void hashRange(void *state, const unsigned char *data, size_t len) {
+    HashState *st = state;
+    st->leafIndex = (data - st->base) / HASH_LEAF;
+    hashUpdate(st, data, len);
+    hashFlush(st);
+}
+
+int hashInput(InputFile *in, HashState *st, int jobs) {
+    int parts = parallelParts(in, jobs);
+    const unsigned char *data;
+    ssize_t got;
+
+    hashInit(st, NULL);
+    if (parts > 1) {
+        HashState *partial = statsMalloc(parts * sizeof(HashState));
+        if (partial) {
+            for (int k = 0; k < parts; k++)
+                hashInit(&partial[k], in->map);
+            parallelRanges(in->map, in->size, parts, hashRange, partial, sizeof(HashState));
+            for (int k = 0; k < parts; k++) {
+                st->sumLo += partial[k].sumLo;
+                st->sumHi += partial[k].sumHi;
+                st->length += partial[k].length;
+            }
+            free(partial);
+            return 0;
+        }
+    }
+
+    while ((got = inputNext(in, &data)) > 0)
+        hashUpdate(st, data, got);
+    return got < 0 ? -1 : 0;
+}
+
+void printHashResult(FILE *out, const char *fileName, HashState *st, int bits) {
+    hashFlush(st);
+    uint64_t lo = hashAvalanche(st->sumLo ^ st->length * HASH_PRIME64_2 ^ HASH_PRIME64_1);
+    uint64_t hi = hashAvalanche((st->sumHi ^ HASH_PRIME64_2) + st->length * HASH_PRIME64_1);
+    if (bits == 64)
+        fprintf(out, "File: %s, Hash64: %016llX\n", fileName, (unsigned long long)lo);
+    else
+        fprintf(out, "File: %s, Hash128: %016llX%016llX\n", fileName, (unsigned long long)hi, (unsigned long long)lo);
+}
+
+int writeAll(int fd, const unsigned char *data, size_t len) {
+    while (len > 0) {
+        ssize_t put = write(fd, data, len);
+        statsCount(COUNTER_SYSCALLS, 1);
+        if (put < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        statsCount(COUNTER_BYTES_WRITTEN, put);
+        data += put;
+        len -= put;
+    }
+    return 0;
+}
+
+int copyInit(CopyState *st, const char *fileName, int N) {
+    st->fds = statsMalloc(N * sizeof(int));
+    if (!st->fds)
+        return -1;
+    st->count = 0;
+    st->failed = 0;
+
+    for (int copy = 1; copy <= N; copy++) {
+        char newName[512];
+        snprintf(newName, sizeof(newName), "%s_copy%d", fileName, copy);
+        int fd = open(newName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        statsCount(COUNTER_SYSCALLS, 1);
+        if (fd < 0) {
+            fprintf(stderr, "Failed to create file: %s\n", newName);
+            continue;
+        }
+        st->fds[st->count++] = fd;
+    }
+    return 0;
+}
+
+void copyUpdate(CopyState *st, const unsigned char *data, size_t len) {
+    for (int k = 0; k < st->count; k++) {
+        if (writeAll(st->fds[k], data, len) != 0)
+            st->failed = 1;
+    }
+}
+
+void copyFinish(CopyState *st) {
+    statsCount(COUNTER_SYSCALLS, st->count);
+    for (int k = 0; k < st->count; k++)
+        close(st->fds[k]);
+    free(st->fds);
+}
+
+int copyFileData(int srcFd, int dstFd, unsigned long long size, unsigned char **buffer) {
+    unsigned long long done = 0;
+
+#ifdef __linux__
+#ifdef FICLONE
+    statsCount(COUNTER_SYSCALLS, 1);
+    if (ioctl(dstFd, FICLONE, srcFd) == 0) {
+        statsCount(COUNTER_BYTES_WRITTEN, size);
+        return 0;
+    }
+#endif
+    if (size > 0) {
+        fallocate(dstFd, 0, 0, size);
+        statsCount(COUNTER_SYSCALLS, 1);
+    }
+
+    while (done < size) {
+        loff_t inOffset = done;
+        loff_t outOffset = done;
+        ssize_t n = copy_file_range(srcFd, &inOffset, dstFd, &outOffset, size - done, 0);
+        statsCount(COUNTER_SYSCALLS, 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+
+    if (done < size && lseek(dstFd, done, SEEK_SET) >= 0) {
+        while (done < size) {
+            off_t offset = done;
+            ssize_t n = sendfile(dstFd, srcFd, &offset, size - done);
+            statsCount(COUNTER_SYSCALLS, 1);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            done += n;
+        }
+    }
+    statsCount(COUNTER_SYSCALLS, done < size);
+#endif
+    statsCount(COUNTER_BYTES_READ, done);
+    statsCount(COUNTER_BYTES_WRITTEN, done);
+
+    while (done < size) {
+        if (!*buffer) {
+            *buffer = statsMalloc(INPUT_BUFFER_SIZE);
+            if (!*buffer)
+                return -1;
+        }
+        size_t want = size - done < INPUT_BUFFER_SIZE ? size - done : INPUT_BUFFER_SIZE;
+        ssize_t got = pread(srcFd, *buffer, want, done);
+        statsCount(COUNTER_SYSCALLS, 1);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+        statsCount(COUNTER_BYTES_READ, got);
+        statsCount(COUNTER_SYSCALLS, 1);
+        if (lseek(dstFd, done, SEEK_SET) < 0 || writeAll(dstFd, *buffer, got) != 0)
+            return -1;
+        done += got;
+    }
+
+    if (done != size) {
+        statsCount(COUNTER_SYSCALLS, 1);
+        if (ftruncate(dstFd, done) != 0)
+            return -1;
+        return done < size ? -1 : 0;
+    }
+    return 0;
+}
+
+void copyRegular(const char *fileName, int srcFd, unsigned long long size, int N) {
+    CopyState st;
+    unsigned char *buffer = NULL;
+
+    if (copyInit(&st, fileName, N) != 0) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return;
+    }
+    for (int k = 0; k < st.count; k++) {
+        if (copyFileData(srcFd, st.fds[k], size, &buffer) != 0)
+            st.failed = 1;
+    }
+    if (st.failed)
+        fprintf(stderr, "Failed to copy file: %s\n", fileName);
+    free(buffer);
+    copyFinish(&st);
+}
+
+#ifdef __linux__
+ssize_t spliceAll(int srcFd, int dstFd, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = splice(srcFd, NULL, dstFd, NULL, len - done, SPLICE_F_MOVE);
+        statsCount(COUNTER_SYSCALLS, 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return done > 0 ? (ssize_t)done : n;
+        statsCount(COUNTER_BYTES_WRITTEN, n);
+        done += n;
+    }
+    return done;
+}
+
+/*
+ * Fans a pipe out without copying it through user space: each chunk is
+ * tee'd into a relay pipe once per extra destination and finally spliced
+ * straight into the last one.  Returns 1 when the kernel refuses the very
+ * first transfer so that the caller can fall back to read/write.
+ */
+int copyPipe(int srcFd, CopyState *st) {
+    int relay[2];
+    int started = 0;
+
+    if (st->count == 0 || pipe(relay) != 0)
+        return 1;
+    for (;;) {
+        ssize_t n;
+        if (st->count > 1) {
+            do {
+                n = tee(srcFd, relay[1], INPUT_BUFFER_SIZE, 0);
+                statsCount(COUNTER_SYSCALLS, 1);
+            } while (n < 0 && errno == EINTR);
+        } else {
+            do {
+                n = splice(srcFd, NULL, st->fds[0], NULL, INPUT_BUFFER_SIZE, SPLICE_F_MOVE);
+                statsCount(COUNTER_SYSCALLS, 1);
+            } while (n < 0 && errno == EINTR);
+            statsCount(COUNTER_BYTES_WRITTEN, n > 0 ? n : 0);
+        }
+        statsCount(COUNTER_BYTES_READ, n > 0 ? n : 0);
+        if (n < 0 && !started)
+            break;
+        if (n <= 0) {
+            st->failed |= n < 0;
+            started = 1;
+            break;
+        }
+        started = 1;
+        if (st->count == 1)
+            continue;
+
+        for (int k = 0; k < st->count - 1; k++) {
+            statsCount(COUNTER_SYSCALLS, k > 0);
+            if (k > 0 && tee(srcFd, relay[1], n, 0) != n) {
+                st->failed = 1;
+                break;
+            }
+            if (spliceAll(relay[0], st->fds[k], n) != n) {
+                st->failed = 1;
+                break;
+            }
+        }
+        if (st->failed || spliceAll(srcFd, st->fds[st->count - 1], n) != n) {
+            st->failed = 1;
+            break;
+        }
+    }
+    close(relay[0]);
+    close(relay[1]);
+    return started ? 0 : 1;
+}
+#endif
+
+void copyStream(const char *fileName, int srcFd, int N) {
+    InputFile in;
+    CopyState st;
+    if (copyInit(&st, fileName, N) != 0) {
+        close(srcFd);
+        fprintf(stderr, "Memory allocation failed\n");
+        return;
+    }
+
+#ifdef __linux__
+    struct stat info;
+    statsCount(COUNTER_SYSCALLS, 1);
+    if (fstat(srcFd, &info) == 0 && S_ISFIFO(info.st_mode) && copyPipe(srcFd, &st) == 0) {
+        if (st.failed)
+            fprintf(stderr, "Failed to copy file: %s\n", fileName);
+        copyFinish(&st);
+        close(srcFd);
+        return;
+    }
+#endif
+
+    if (inputOpenFd(&in, fileName, srcFd) != 0) {
+        copyFinish(&st);
+        fprintf(stderr, "Memory allocation failed\n");
+        return;
+    }
+    const unsigned char *data;
+    ssize_t got;
+    while ((got = inputNext(&in, &data)) > 0)
+        copyUpdate(&st, data, got);
+    if (got < 0 || st.failed)
+        fprintf(stderr, "Failed to copy file: %s\n", fileName);
+    copyFinish(&st);
+    inputClose(&in);
+}
+
+void copySource(const char *fileName, int N) {
+    struct stat st;
+    int phase = statsPhase(PHASE_OPEN);
+    int srcFd = isStdin(fileName) ? dup(STDIN_FILENO) : open(fileName, O_RDONLY);
+    statsCount(COUNTER_SYSCALLS, 1);
+    statsCount(COUNTER_FILES, 1);
+    if (isStdin(fileName))
+        fileName = "stdin";
+    if (srcFd < 0) {
+        fprintf(stderr, "Failed to open file: %s\n", fileName);
+        statsPhase(phase);
+        return;
+    }
+
+    statsCount(COUNTER_SYSCALLS, 1);
+    if (fstat(srcFd, &st) == 0 && S_ISREG(st.st_mode)) {
+        statsPhase(PHASE_COPY);
+        copyRegular(fileName, srcFd, st.st_size, N);
+        statsCount(COUNTER_SYSCALLS, 1);
+        close(srcFd);
+    } else {
+        statsPhase(PHASE_COPY);
+        copyStream(fileName, srcFd, N);
+    }
+    statsPhase(phase);
+}
+
+void copyFile(int index, FILE *out, void *ctx) {
+    CopyJob *job = ctx;
+    (void)out;
+    copySource(job->fileNames[index], job->N);
+}
+
+void doCopy(char **fileNames, int fileCount, int N, const Options *options) {
+    if (N <= 0) {
+        fprintf(stderr, "Invalid copy number.\n");
+        return;
+    }
+
+    CopyJob job = {fileNames, N};
+    runPool(fileCount, options->jobs, copyFile, &job);
+}
+
+int findInit(FindState *st, const SearchPattern *pattern, const Options *options, const char *fileName, FILE *out) {
+    st->pattern = pattern;
+    st->options = options;
+    st->fileName = fileName;
+    st->out = out;
+    st->stopAtFirst = !options->findAll && !options->findCount && !options->findLines;
+    st->matches = 0;
+    st->offset = 0;
+    st->lines = 0;
+    st->carryLen = 0;
+    st->carry = NULL;
+    if (pattern->len > 1) {
+        st->carry = statsMalloc(2 * (pattern->len - 1));
+        if (!st->carry)
+            return -1;
+    }
+    return 0;
+}
+
+void findReport(FindState *st, unsigned long long position, unsigned long long line) {
+    st->matches++;
+    if (st->options->findLines)
+        fprintf(st->out, "File: %s, Line: %llu, Offset: %llu\n", st->fileName, line + 1, position);
+    else if (st->options->findAll)
+        fprintf(st->out, "File: %s, Offset: %llu\n", st->fileName, position);
+}
+
+int findDone(const FindState *st) {
+    return st->stopAtFirst && st->matches > 0;
+}
+
+void findUpdate(FindState *st, const unsigned char *data, size_t len) {
+    const SearchPattern *p = st->pattern;
+    size_t keep = p->len > 0 ? p->len - 1 : 0;
+    size_t take = len < keep ? len : keep;
+
+    if (findDone(st) || len == 0)
+        return;
+
+    if (keep > 0)
+        memcpy(st->carry + st->carryLen, data, take);
+    if (st->carryLen > 0) {
+        const unsigned char *joined = st->carry;
+        size_t joinedLen = st->carryLen + take;
+        while (joinedLen >= p->len) {
+            const unsigned char *hit = searchNext(p, joined, joinedLen);
+            if (!hit)
+                break;
+            unsigned long long line = st->lines;
+            if (st->options->findLines)
+                line -= countNewlines(hit, st->carry + st->carryLen - hit);
+            findReport(st, st->offset - st->carryLen + (hit - st->carry), line);
+            if (findDone(st))
+                return;
+            joinedLen -= hit + 1 - joined;
+            joined = hit + 1;
+        }
+    }
+
+    const unsigned char *cursor = data;
+    const unsigned char *counted = data;
+    unsigned long long line = st->lines;
+    while ((size_t)(data + len - cursor) >= p->len) {
+        const unsigned char *hit = searchNext(p, cursor, data + len - cursor);
+        if (!hit)
+            break;
+        if (st->options->findLines) {
+            line += countNewlines(counted, hit - counted);
+            counted = hit;
+        }
+        findReport(st, st->offset + (hit - data), line);
+        if (findDone(st))
+            return;
+        cursor = hit + 1;
+    }
+    if (st->options->findLines)
+        st->lines = line + countNewlines(counted, data + len - counted);
+
+    if (keep > 0) {
+        if (len >= keep) {
+            memcpy(st->carry, data + len - keep, keep);
+            st->carryLen = keep;
+        } else {
+            size_t total = st->carryLen + take;
+            size_t drop = total > keep ? total - keep : 0;
+            memmove(st->carry, st->carry + drop, total - drop);
+            st->carryLen = total - drop;
+        }
+    }
+    st->offset += len;
+}
+
+void findFinish(FindState *st) {
+    free(st->carry);
+}
+
+void printFindResult(FILE *out, const char *fileName, const FindState *st) {
+    if (st->options->findCount)
+        fprintf(out, "File: %s, Matches: %llu\n", fileName, st->matches);
+    else if (st->matches == 0)
+        fprintf(out, "String not found in: %s\n", fileName);
+    else if (st->stopAtFirst)
+        fprintf(out, "Found in: %s\n", fileName);
+}
+
+int nfaAdd(Nfa *nfa, int kind, int out, int out1) {
+    if (nfa->count == nfa->capacity) {
+        if (nfa->capacity >= REGEX_MAX_NODES)
+            return -1;
+        int grown = nfa->capacity ? nfa->capacity * 2 : 64;
+        NfaNode *nodes = statsRealloc(nfa->nodes, grown * sizeof(NfaNode));
+        if (!nodes)
+            return -1;
+        nfa->nodes = nodes;
+        nfa->capacity = grown;
+    }
+    NfaNode *node = &nfa->nodes[nfa->count];
+    memset(node, 0, sizeof(*node));
+    node->kind = kind;
+    node->out = out;
+    node->out1 = out1;
+    return nfa->count++;
+}
+
+void byteSetAdd(uint32_t *set, int c) {
+    set[c >> 5] |= 1u << (c & 31);
+}
+
+int byteSetHas(const uint32_t *set, int c) {
+    return (set[c >> 5] >> (c & 31)) & 1;
+}
+
+void byteSetAddClass(uint32_t *set, int cls) {
+    for (int c = 0; c < 256; c++) {
+        int in = 0;
+        switch (cls | 0x20) {
+        case 'd':
+            in = c >= '0' && c <= '9';
+            break;
+        case 'w':
+            in = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+            break;
+        case 's':
+            in = c == ' ' || (c >= '\t' && c <= '\r');
+            break;
+        }
+        if (in != (cls >= 'A' && cls <= 'Z'))
+            byteSetAdd(set, c);
+    }
+}
+
+int regexEscape(int c) {
+    switch (c) {
+    case 'n':
+        return '\n';
+    case 't':
+        return '\t';
+    case 'r':
+        return '\r';
+    }
+    return c;
+}
+
+int regexFail(RegexParser *p, const char *error) {
+    if (!p->error)
+        p->error = error;
+    return -1;
+}
+
+NfaFragment regexSet(RegexParser *p, const uint32_t *set) {
+    NfaFragment f = {-1, -1};
+    f.end = nfaAdd(p->nfa, NFA_EMPTY, -1, -1);
+    f.start = nfaAdd(p->nfa, NFA_SET, f.end, -1);
+    if (f.start < 0 || f.end < 0) {
+        regexFail(p, "pattern too large");
+        return f;
+    }
+    memcpy(p->nfa->nodes[f.start].set, set, sizeof(p->nfa->nodes[f.start].set));
+    p->nfa->nodes[f.start].set['\n' >> 5] &= ~(1u << ('\n' & 31));
+    return f;
+}
+
+NfaFragment regexEmpty(RegexParser *p, int kind) {
+    NfaFragment f = {-1, -1};
+    f.end = nfaAdd(p->nfa, NFA_EMPTY, -1, -1);
+    f.start = kind == NFA_EMPTY ? f.end : nfaAdd(p->nfa, kind, f.end, -1);
+    if (f.start < 0 || f.end < 0)
+        regexFail(p, "pattern too large");
+    return f;
+}
+
+NfaFragment regexAlternation(RegexParser *p);
+
+NfaFragment regexClass(RegexParser *p) {
+    uint32_t set[8] = {0};
+    const char *s = p->pattern;
+    int negate = 0;
+    int first = 1;
+    NfaFragment bad = {-1, -1};
+
+    if (s[p->pos] == '^') {
+        negate = 1;
+        p->pos++;
+    }
+    while (s[p->pos] && (s[p->pos] != ']' || first)) {
+        int lo = (unsigned char)s[p->pos++];
+        first = 0;
+        if (lo == '\\') {
+            if (!s[p->pos]) {
+                regexFail(p, "trailing backslash");
+                return bad;
+            }
+            lo = (unsigned char)s[p->pos++];
+            if (strchr("dDwWsS", lo)) {
+                byteSetAddClass(set, lo);
+                continue;
+            }
+            lo = regexEscape(lo);
+        }
+        int hi = lo;
+        if (s[p->pos] == '-' && s[p->pos + 1] && s[p->pos + 1] != ']') {
+            p->pos++;
+            hi = (unsigned char)s[p->pos++];
+            if (hi == '\\' && s[p->pos])
+                hi = regexEscape((unsigned char)s[p->pos++]);
+            if (hi < lo) {
+                regexFail(p, "invalid range in character class");
+                return bad;
+            }
+        }
+        for (int c = lo; c <= hi; c++)
+            byteSetAdd(set, c);
+    }
+    if (s[p->pos] != ']') {
+        regexFail(p, "unterminated character class");
+        return bad;
+    }
+    p->pos++;
+    if (negate) {
+        for (int k = 0; k < 8; k++)
+            set[k] = ~set[k];
+    }
+    return regexSet(p, set);
+}
+
+NfaFragment regexAtom(RegexParser *p) {
+    const char *s = p->pattern;
+    uint32_t set[8] = {0};
+    NfaFragment bad = {-1, -1};
+    int c = (unsigned char)s[p->pos++];
+
+    switch (c) {
+    case '(': {
+        NfaFragment f = regexAlternation(p);
+        if (p->error)
+            return bad;
+        if (s[p->pos] != ')') {
+            regexFail(p, "missing )");
+            return bad;
+        }
+        p->pos++;
+        return f;
+    }
+    case '[':
+        return regexClass(p);
+    case '.':
+        memset(set, 0xFF, sizeof(set));
+        return regexSet(p, set);
+    case '^':
+        return regexEmpty(p, p->reverse ? NFA_EOL : NFA_BOL);
+    case '$':
+        return regexEmpty(p, p->reverse ? NFA_BOL : NFA_EOL);
+    case '*':
+    case '+':
+    case '?':
+    case '{':
+        regexFail(p, "nothing to repeat");
+        return bad;
+    case '\\':
+        c = (unsigned char)s[p->pos];
+        if (!c) {
+            regexFail(p, "trailing backslash");
+            return bad;
+        }
+        p->pos++;
+        if (strchr("dDwWsS", c)) {
+            byteSetAddClass(set, c);
+            return regexSet(p, set);
+        }
+        c = regexEscape(c);
+        break;
+    }
+    byteSetAdd(set, c);
+    return regexSet(p, set);
+}
+
+NfaFragment regexConcat(RegexParser *p, NfaFragment a, NfaFragment b) {
+    NfaFragment f;
+    if (p->reverse) {
+        NfaFragment t = a;
+        a = b;
+        b = t;
+    }
+    p->nfa->nodes[a.end].out = b.start;
+    f.start = a.start;
+    f.end = b.end;
+    return f;
+}
+
+NfaFragment regexRepeatOnce(RegexParser *p, NfaFragment a, int kind) {
+    NfaFragment f = {-1, -1};
+    int end = nfaAdd(p->nfa, NFA_EMPTY, -1, -1);
+    int split = nfaAdd(p->nfa, NFA_SPLIT, a.start, end);
+    if (end < 0 || split < 0) {
+        regexFail(p, "pattern too large");
+        return f;
+    }
+    f.end = end;
+    if (kind == '*') {
+        p->nfa->nodes[a.end].out = split;
+        f.start = split;
+    } else if (kind == '+') {
+        p->nfa->nodes[a.end].out = split;
+        f.start = a.start;
+    } else {
+        p->nfa->nodes[a.end].out = end;
+        f.start = split;
+    }
+    return f;
+}
+
+NfaFragment regexRepeat(RegexParser *p) {
+    const char *s = p->pattern;
+    size_t atomStart = p->pos;
+    NfaFragment f = regexAtom(p);
+    int repeated = 0;
+
+    while (!p->error && s[p->pos] && strchr("*+?{", s[p->pos])) {
+        int kind = s[p->pos++];
+        if (kind != '{') {
+            f = regexRepeatOnce(p, f, kind);
+            repeated = 1;
+            continue;
+        }
+        if (repeated) {
+            regexFail(p, "nested repetition");
+            break;
+        }
+        repeated = 1;
+
+        char *end;
+        long min = strtol(s + p->pos, &end, 10);
+        long max = min;
+        if (end == s + p->pos) {
+            regexFail(p, "invalid repetition count");
+            break;
+        }
+        if (*end == ',') {
+            const char *n = end + 1;
+            max = *n == '}' ? -1 : strtol(n, &end, 10);
+            if (max >= 0 && end == n) {
+                regexFail(p, "invalid repetition count");
+                break;
+            }
+            if (max < 0)
+                end = (char *)n;
+        }
+        if (*end != '}' || min < 0 || min > REGEX_MAX_REPEAT || max > REGEX_MAX_REPEAT ||
+            (max >= 0 && max < min)) {
+            regexFail(p, "invalid repetition count");
+            break;
+        }
+        size_t after = end + 1 - s;
+
+        /* x{m,n} is m copies of x followed by n-m optional copies (or x* when unbounded). */
+        NfaFragment result = regexEmpty(p, NFA_EMPTY);
+        long copies = max < 0 ? min + 1 : max;
+        for (long k = 0; k < copies && !p->error; k++) {
+            NfaFragment copy = f;
+            if (k > 0) {
+                p->pos = atomStart;
+                copy = regexAtom(p);
+            }
+            if (p->error)
+                break;
+            if (k >= min)
+                copy = regexRepeatOnce(p, copy, max < 0 ? '*' : '?');
+            if (!p->error)
+                result = regexConcat(p, result, copy);
+        }
+        p->pos = after;
+        f = result;
+    }
+    return f;
+}
+
+NfaFragment regexSequence(RegexParser *p) {
+    const char *s = p->pattern;
+    NfaFragment f = regexEmpty(p, NFA_EMPTY);
+
+    while (!p->error && s[p->pos] && s[p->pos] != '|' && s[p->pos] != ')') {
+        NfaFragment next = regexRepeat(p);
+        if (!p->error)
+            f = regexConcat(p, f, next);
+    }
+    return f;
+}
+
+NfaFragment regexAlternation(RegexParser *p) {
+    NfaFragment f = regexSequence(p);
+
+    while (!p->error && p->pattern[p->pos] == '|') {
+        p->pos++;
+        NfaFragment next = regexSequence(p);
+        if (p->error)
+            break;
+        int end = nfaAdd(p->nfa, NFA_EMPTY, -1, -1);
+        int split = nfaAdd(p->nfa, NFA_SPLIT, f.start, next.start);
+        if (end < 0 || split < 0) {
+            regexFail(p, "pattern too large");
+            break;
+        }
+        p->nfa->nodes[f.end].out = end;
+        p->nfa->nodes[next.end].out = end;
+        f.start = split;
+        f.end = end;
+    }
+    return f;
+}
+
+const char *compileNfa(Nfa *nfa, const char *pattern, int reverse) {
+    RegexParser p = {pattern, 0, reverse, nfa, NULL};
+
+    memset(nfa, 0, sizeof(*nfa));
+    NfaFragment f = regexAlternation(&p);
+    if (!p.error && pattern[p.pos] == ')')
+        regexFail(&p, "unmatched )");
+    if (!p.error) {
+        int match = nfaAdd(nfa, NFA_MATCH, -1, -1);
+        if (match < 0)
+            regexFail(&p, "pattern too large");
+        else
+            nfa->nodes[f.end].out = match;
+        nfa->start = f.start;
+    }
+    return p.error;
+}
+
+/*
+ * The longest run of bytes that every match must contain, taken from the
+ * top-level sequence; it feeds the substring kernels as a prefilter.
+ */
+void regexRequiredLiteral(const char *s, char *best, size_t cap) {
+    char run[REGEX_MAX_LITERAL + 1];
+    size_t runLen = 0;
+    size_t bestLen = 0;
+    size_t i = 0;
+
+    best[0] = '\0';
+    for (;;) {
+        int literal = -1;
+        char c = s[i];
+
+        if (c == '\0' || c == '|' || c == ')') {
+            if (c == '|')
+                bestLen = runLen = 0;
+        } else if (c == '(') {
+            int depth = 0;
+            do {
+                if (s[i] == '\\' && s[i + 1])
+                    i++;
+                else if (s[i] == '[') {
+                    i++;
+                    if (s[i] == '^')
+                        i++;
+                    if (s[i] == ']')
+                        i++;
+                    while (s[i] && s[i] != ']')
+                        i += s[i] == '\\' && s[i + 1] ? 2 : 1;
+                } else if (s[i] == '(')
+                    depth++;
+                else if (s[i] == ')')
+                    depth--;
+                if (s[i])
+                    i++;
+            } while (s[i] && depth > 0);
+        } else if (c == '[') {
+            i++;
+            if (s[i] == '^')
+                i++;
+            if (s[i] == ']')
+                i++;
+            while (s[i] && s[i] != ']')
+                i += s[i] == '\\' && s[i + 1] ? 2 : 1;
+            if (s[i])
+                i++;
+        } else if (c == '\\' && s[i + 1]) {
+            if (!strchr("dDwWsS", s[i + 1]))
+                literal = regexEscape((unsigned char)s[i + 1]);
+            i += 2;
+        } else {
+            if (c != '.' && c != '^' && c != '$')
+                literal = (unsigned char)c;
+            i++;
+        }
+
+        char q = s[i];
+        int optional = q == '*' || q == '?' || q == '{';
+        if (literal >= 0 && literal != '\n' && !optional && runLen < REGEX_MAX_LITERAL)
+            run[runLen++] = (char)literal;
+        if (literal < 0 || optional || q == '+' || c == '\0' || c == '|' || c == ')') {
+            if (runLen > bestLen && runLen < cap) {
+                memcpy(best, run, runLen);
+                best[runLen] = '\0';
+                bestLen = runLen;
+            }
+            runLen = 0;
+        }
+        if (c == '|' || c == ')' || c == '\0') {
+            if (c == '|' || c == ')')
+                best[0] = '\0';
+            return;
+        }
+        while (s[i] && strchr("*+?", s[i]))
+            i++;
+        if (s[i] == '{') {
+            while (s[i] && s[i] != '}')
+                i++;
+            if (s[i])
+                i++;
+        }
+    }
+}
+
+Regex *compileRegex(const char *pattern, const char **error) {
+    Regex *re = statsCalloc(1, sizeof(Regex));
+    char literal[REGEX_MAX_LITERAL + 1];
+
+    if (!re) {
+        *error = "out of memory";
+        return NULL;
+    }
+    *error = compileNfa(&re->forward, pattern, 0);
+    if (!*error)
+        *error = compileNfa(&re->reverse, pattern, 1);
+    if (!*error) {
+        regexRequiredLiteral(pattern, literal, sizeof(literal));
+        re->literal = strdup(literal);
+        if (!re->literal)
+            *error = "out of memory";
+        else
+            statsAllocated(strlen(literal) + 1);
+    }
+    if (*error) {
+        free(re->forward.nodes);
+        free(re->reverse.nodes);
+        free(re);
+        return NULL;
+    }
+    return re;
+}
+
+int dfaInit(Dfa *dfa, const Nfa *nfa, int unanchored) {
+    memset(dfa, 0, sizeof(*dfa));
+    dfa->nfa = nfa;
+    dfa->unanchored = unanchored;
+    dfa->startLine = dfa->startMid = -1;
+    dfa->table = statsMalloc(DFA_TABLE_SIZE * sizeof(int));
+    dfa->mark = statsCalloc(nfa->count, sizeof(unsigned));
+    dfa->stack = statsMalloc(nfa->count * sizeof(int));
+    dfa->scratch = statsMalloc(nfa->count * sizeof(int));
+    if (!dfa->table || !dfa->mark || !dfa->stack || !dfa->scratch)
+        return -1;
+    for (int k = 0; k < DFA_TABLE_SIZE; k++)
+        dfa->table[k] = -1;
+    return 0;
+}
+
+void dfaReset(Dfa *dfa) {
+    for (int k = 0; k < dfa->count; k++)
+        free(dfa->states[k].set);
+    dfa->count = 0;
+    dfa->startLine = dfa->startMid = -1;
+    dfa->resets++;
+    for (int k = 0; k < DFA_TABLE_SIZE; k++)
+        dfa->table[k] = -1;
+}
+
+void dfaFree(Dfa *dfa) {
+    if (dfa->table)
+        dfaReset(dfa);
+    free(dfa->states);
+    free(dfa->table);
+    free(dfa->mark);
+    free(dfa->stack);
+    free(dfa->scratch);
+}
+
+/* Adds the epsilon closure of one NFA node to the set under construction. */
+int dfaClosure(Dfa *dfa, int id, int atLineStart, int *set, int count) {
+    const NfaNode *nodes = dfa->nfa->nodes;
+    int depth = 0;
+
+    if (id < 0 || dfa->mark[id] == dfa->generation)
+        return count;
+    dfa->mark[id] = dfa->generation;
+    dfa->stack[depth++] = id;
+    while (depth > 0) {
+        const NfaNode *node = &nodes[dfa->stack[--depth]];
+        int next[2] = {-1, -1};
+        switch (node->kind) {
+        case NFA_SET:
+        case NFA_EOL:
+        case NFA_MATCH:
+            set[count++] = node - nodes;
+            break;
+        case NFA_BOL:
+            if (atLineStart)
+                next[0] = node->out;
+            break;
+        case NFA_SPLIT:
+            next[1] = node->out1;
+            /* fall through */
+        case NFA_EMPTY:
+            next[0] = node->out;
+            break;
+        }
+        for (int k = 1; k >= 0; k--) {
+            if (next[k] >= 0 && dfa->mark[next[k]] != dfa->generation) {
+                dfa->mark[next[k]] = dfa->generation;
+                dfa->stack[depth++] = next[k];
+            }
+        }
+    }
+    return count;
+}
+
+int compareInts(const void *a, const void *b) {
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/* Whether a set can reach MATCH by passing its pending $ assertions at a line end. */
+int dfaAcceptsAtEol(Dfa *dfa, const int *set, int count) {
+    const NfaNode *nodes = dfa->nfa->nodes;
+    int *stack = dfa->stack;
+    int depth = 0;
+
+    dfa->generation++;
+    for (int k = 0; k < count; k++) {
+        if (nodes[set[k]].kind == NFA_EOL) {
+            dfa->mark[set[k]] = dfa->generation;
+            stack[depth++] = set[k];
+        }
+    }
+    while (depth > 0) {
+        const NfaNode *node = &nodes[stack[--depth]];
+        int next[2] = {-1, -1};
+        if (node->kind == NFA_MATCH)
+            return 1;
+        if (node->kind == NFA_EOL || node->kind == NFA_EMPTY || node->kind == NFA_SPLIT)
+            next[0] = node->out;
+        if (node->kind == NFA_SPLIT)
+            next[1] = node->out1;
+        for (int k = 0; k < 2; k++) {
+            if (next[k] >= 0 && dfa->mark[next[k]] != dfa->generation) {
+                dfa->mark[next[k]] = dfa->generation;
+                stack[depth++] = next[k];
+            }
+        }
+    }
+    return 0;
+}
+
+int dfaIntern(Dfa *dfa, int *set, int count) {
+    unsigned hash = 2166136261u;
+
+    qsort(set, count, sizeof(int), compareInts);
+    for (int k = 0; k < count; k++)
+        hash = (hash ^ (unsigned)set[k]) * 16777619u;
+    unsigned slot = hash & (DFA_TABLE_SIZE - 1);
+    for (; dfa->table[slot] >= 0; slot = (slot + 1) & (DFA_TABLE_SIZE - 1)) {
+        DfaState *st = &dfa->states[dfa->table[slot]];
+        if (st->hash == hash && st->count == count && memcmp(st->set, set, count * sizeof(int)) == 0)
+            return dfa->table[slot];
+    }
+
+    if (dfa->count == DFA_MAX_STATES) {
+        dfaReset(dfa);
+        slot = hash & (DFA_TABLE_SIZE - 1);
+    }
+    if (dfa->count == dfa->capacity) {
+        int grown = dfa->capacity ? dfa->capacity * 2 : 16;
+        DfaState *states = statsRealloc(dfa->states, grown * sizeof(DfaState));
+        if (!states)
+            return -1;
+        dfa->states = states;
+        dfa->capacity = grown;
+    }
+
+    DfaState *st = &dfa->states[dfa->count];
+    st->set = statsMalloc(count * sizeof(int) + 1);
+    if (!st->set)
+        return -1;
+    memcpy(st->set, set, count * sizeof(int));
+    st->count = count;
+    st->hash = hash;
+    st->flags = count == 0 ? DFA_DEAD : 0;
+    for (int k = 0; k < count; k++) {
+        if (dfa->nfa->nodes[set[k]].kind == NFA_MATCH)
+            st->flags |= DFA_ACCEPT | DFA_EOL_ACCEPT;
+    }
+    if (!(st->flags & DFA_EOL_ACCEPT) && dfaAcceptsAtEol(dfa, set, count))
+        st->flags |= DFA_EOL_ACCEPT;
+    for (int c = 0; c < 256; c++)
+        st->next[c] = -1;
+    dfa->table[slot] = dfa->count;
+    return dfa->count++;
+}
+
+int dfaStart(Dfa *dfa, int atLineStart) {
+    int *cached = atLineStart ? &dfa->startLine : &dfa->startMid;
+    if (*cached < 0) {
+        dfa->generation++;
+        int count = dfaClosure(dfa, dfa->nfa->start, atLineStart, dfa->scratch, 0);
+        int state = dfaIntern(dfa, dfa->scratch, count);
+        cached = atLineStart ? &dfa->startLine : &dfa->startMid;
+        *cached = state;
+    }
+    return *cached;
+}
+
+int dfaStep(Dfa *dfa, int state, unsigned char c) {
+    if (dfa->states[state].next[c] >= 0)
+        return dfa->states[state].next[c];
+
+    const NfaNode *nodes = dfa->nfa->nodes;
+    const DfaState *from = &dfa->states[state];
+    int count = 0;
+    dfa->generation++;
+    for (int k = 0; k < from->count; k++) {
+        const NfaNode *node = &nodes[from->set[k]];
+        if (node->kind == NFA_SET && byteSetHas(node->set, c))
+            count = dfaClosure(dfa, node->out, 0, dfa->scratch, count);
+    }
+    if (dfa->unanchored)
+        count = dfaClosure(dfa, dfa->nfa->start, 0, dfa->scratch, count);
+
+    unsigned resets = dfa->resets;
+    int next = dfaIntern(dfa, dfa->scratch, count);
+    if (next >= 0 && dfa->resets == resets)
+        dfa->states[state].next[c] = next;
+    return next;
+}
+
+const unsigned char *findLastNewline(const unsigned char *data, size_t len) {
+    while (len > 0) {
+        if (data[--len] == '\n')
+            return data + len;
+    }
+    return NULL;
+}
+
+void regexFinish(RegexState *st);
+
+int regexInit(RegexState *st, const Operation *op, const Options *options, const char *fileName, FILE *out) {
+    memset(st, 0, sizeof(*st));
+    st->regex = op->regex;
+    if (findInit(&st->find, &op->pattern, options, fileName, out) != 0)
+        return -1;
+    if (dfaInit(&st->dfa[0], &op->regex->forward, 1) != 0 || dfaInit(&st->dfa[1], &op->regex->forward, 0) != 0 ||
+        dfaInit(&st->dfa[2], &op->regex->reverse, 0) != 0) {
+        regexFinish(st);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Finds the leftmost-longest matches in one line.  The unanchored DFA finds
+ * the earliest match end, the reversed DFA walks back from there to the
+ * leftmost start, and the anchored DFA extends that start to the longest end.
+ * A plain "found" query stops after the first pass.
+ */
+int regexScanLine(RegexState *st, const unsigned char *text, size_t lineStart, size_t lineEnd,
+                  unsigned long long baseOffset, unsigned long long line) {
+    size_t p = lineStart;
+
+    while (p <= lineEnd) {
+        size_t q = p;
+        long end = -1;
+        int s = dfaStart(&st->dfa[0], p == lineStart);
+        for (;;) {
+            if (s < 0)
+                return -1;
+            int flags = st->dfa[0].states[s].flags;
+            if ((flags & DFA_ACCEPT) || (q == lineEnd && (flags & DFA_EOL_ACCEPT))) {
+                end = q;
+                break;
+            }
+            if (q == lineEnd || (flags & DFA_DEAD))
+                break;
+            s = dfaStep(&st->dfa[0], s, text[q++]);
+        }
+        if (end < 0)
+            return 0;
+        if (st->find.stopAtFirst) {
+            findReport(&st->find, baseOffset + p, line);
+            return 0;
+        }
+
+        size_t start = end;
+        q = end;
+        s = dfaStart(&st->dfa[2], (size_t)end == lineEnd);
+        for (;;) {
+            if (s < 0)
+                return -1;
+            int flags = st->dfa[2].states[s].flags;
+            if ((flags & DFA_ACCEPT) || (q == lineStart && (flags & DFA_EOL_ACCEPT)))
+                start = q;
+            if (q == p || (flags & DFA_DEAD))
+                break;
+            s = dfaStep(&st->dfa[2], s, text[--q]);
+        }
+
+        size_t longest = start;
+        q = start;
+        s = dfaStart(&st->dfa[1], start == lineStart);
+        for (;;) {
+            if (s < 0)
+                return -1;
+            int flags = st->dfa[1].states[s].flags;
+            if ((flags & DFA_ACCEPT) || (q == lineEnd && (flags & DFA_EOL_ACCEPT)))
+                longest = q;
+            if (q == lineEnd || (flags & DFA_DEAD))
+                break;
+            s = dfaStep(&st->dfa[1], s, text[q++]);
+        }
+
+        findReport(&st->find, baseOffset + start, line);
+        if (findDone(&st->find))
+            return 0;
+        p = longest > start ? longest : start + 1;
+    }
+    return 0;
+}
+
+/* Scans complete lines; text either ends with a newline or is the last line of the input. */
+void regexScanText(RegexState *st, const unsigned char *text, size_t len, unsigned long long baseOffset) {
+    const SearchPattern *literal = st->find.pattern;
+    const unsigned char *counted = text;
+    unsigned long long line = st->find.lines;
+    size_t pos = 0;
+
+    while (pos < len && !findDone(&st->find)) {
+        if (literal->len > 0) {
+            const unsigned char *hit = searchNext(literal, text + pos, len - pos);
+            if (!hit)
+                break;
+            const unsigned char *newline = hit > text + pos ? findLastNewline(text + pos, hit - (text + pos)) : NULL;
+            if (newline)
+                pos = newline + 1 - text;
+        }
+        const unsigned char *newline = memchr(text + pos, '\n', len - pos);
+        size_t lineEnd = newline ? (size_t)(newline - text) : len;
+        if (st->find.options->findLines) {
+            line += countNewlines(counted, text + pos - counted);
+            counted = text + pos;
+        }
+        if (regexScanLine(st, text, pos, lineEnd, baseOffset, line) != 0) {
+            fprintf(stderr, "%s: regular expression state allocation failed\n", st->find.fileName);
+            st->failed = 1;
+            break;
+        }
+        pos = lineEnd + 1;
+    }
+    if (st->find.options->findLines)
+        st->find.lines = line + countNewlines(counted, text + len - counted);
+}
+
+int regexKeepLine(RegexState *st, const unsigned char *data, size_t len) {
+    if (st->lineLen + len > st->lineCap) {
+        size_t grown = st->lineCap ? st->lineCap : INPUT_BUFFER_SIZE / 16;
+        while (grown < st->lineLen + len)
+            grown *= 2;
+        unsigned char *line = statsRealloc(st->line, grown);
+        if (!line)
+            return -1;
+        st->line = line;
+        st->lineCap = grown;
+    }
+    memcpy(st->line + st->lineLen, data, len);
+    st->lineLen += len;
+    return 0;
+}
+
+int regexDone(const RegexState *st) {
+    return st->failed || findDone(&st->find);
+}
+
+void regexUpdate(RegexState *st, const unsigned char *data, size_t len) {
+    if (regexDone(st) || len == 0)
+        return;
+
+    unsigned long long offset = st->find.offset;
+    const unsigned char *last = findLastNewline(data, len);
+    st->find.offset += len;
+    if (!last) {
+        if (regexKeepLine(st, data, len) != 0)
+            st->failed = 1;
+        return;
+    }
+
+    size_t done = 0;
+    if (st->lineLen > 0) {
+        const unsigned char *first = memchr(data, '\n', len);
+        done = first + 1 - data;
+        if (regexKeepLine(st, data, done) != 0) {
+            st->failed = 1;
+            return;
+        }
+        regexScanText(st, st->line, st->lineLen, offset - (st->lineLen - done));
+        st->lineLen = 0;
+    }
+    if (data + done <= last)
+        regexScanText(st, data + done, last + 1 - (data + done), offset + done);
+    if (!regexDone(st) && regexKeepLine(st, last + 1, data + len - (last + 1)) != 0)
+        st->failed = 1;
+}
+
+void regexFinish(RegexState *st) {
+    if (st->lineLen > 0 && !regexDone(st))
+        regexScanText(st, st->line, st->lineLen, st->find.offset - st->lineLen);
+    st->lineLen = 0;
+    free(st->line);
+    st->line = NULL;
+    for (int k = 0; k < 3; k++)
+        dfaFree(&st->dfa[k]);
+    findFinish(&st->find);
+    st->find.carry = NULL;
+}
+
+int opBegin(OpState *st, const Operation *op, const char *fileName, const Options *options, FILE *out) {
+    st->op = op;
+    switch (op->kind) {
+    case OP_XOR:
+        xorInit(&st->u.xor);
+        return 0;
+    case OP_MASK:
+        maskInit(&st->u.mask, op->mask);
+        return 0;
+    case OP_MASK_SET:
+        maskSetInit(&st->u.maskSet, op);
+        return 0;
+    case OP_CRC32C:
+        crcInit(&st->u.crc, ~0u);
+        return 0;
+    case OP_HASH:
+        hashInit(&st->u.hash, NULL);
+        return 0;
+    case OP_FIND:
+        return findInit(&st->u.find, &op->pattern, options, fileName, out);
+    case OP_FIND_REGEX:
+        return regexInit(&st->u.regex, op, options, fileName, out);
+    }
+    return -1;
+}
+
+void opUpdate(OpState *st, const unsigned char *data, size_t len) {
+    switch (st->op->kind) {
+    case OP_XOR:
+        xorUpdate(&st->u.xor, data, len);
+        break;
+    case OP_MASK:
+        maskUpdate(&st->u.mask, data, len);
+        break;
+    case OP_MASK_SET:
+        maskSetUpdate(&st->u.maskSet, data, len);
+        break;
+    case OP_CRC32C:
+        crcUpdate(&st->u.crc, data, len);
+        break;
+    case OP_HASH:
+        hashUpdate(&st->u.hash, data, len);
+        break;
+    case OP_FIND:
+        findUpdate(&st->u.find, data, len);
+        break;
+    case OP_FIND_REGEX:
+        regexUpdate(&st->u.regex, data, len);
+        break;
+    }
+}
+
+int opDone(const OpState *st) {
+    return (st->op->kind == OP_FIND && findDone(&st->u.find)) ||
+           (st->op->kind == OP_FIND_REGEX && regexDone(&st->u.regex));
+}
+
+void opFinish(OpState *st, const char *fileName, FILE *out) {
+    switch (st->op->kind) {
+    case OP_XOR:
+        printXorResult(out, fileName, &st->u.xor, st->op->N);
+        break;
+    case OP_MASK:
+        fprintf(out, "File: %s, Count: %llu\n", fileName, st->u.mask.count);
+        break;
+    case OP_MASK_SET:
+        printMaskSetResult(out, fileName, &st->u.maskSet);
+        break;
+    case OP_CRC32C:
+        fprintf(out, "File: %s, CRC32C: %08X\n", fileName, ~st->u.crc.reg);
+        break;
+    case OP_HASH:
+        printHashResult(out, fileName, &st->u.hash, st->op->N);
+        break;
+    case OP_FIND:
+        findFinish(&st->u.find);
+        printFindResult(out, fileName, &st->u.find);
+        break;
+    case OP_FIND_REGEX:
+        regexFinish(&st->u.regex);
+        printFindResult(out, fileName, &st->u.regex.find);
+        break;
+    }
+}
+
+int beginOperations(OpState *states, const Operation *ops, int opCount, const char *fileName,
+                    const Options *options, FILE *out) {
+    for (int k = 0; k < opCount; k++) {
+        if (opBegin(&states[k], &ops[k], fileName, options, out) != 0) {
+            for (int j = 0; j < k; j++) {
+                if (ops[j].kind == OP_FIND)
+                    findFinish(&states[j].u.find);
+                else if (ops[j].kind == OP_FIND_REGEX)
+                    regexFinish(&states[j].u.regex);
+            }
+            fprintf(stderr, "Memory allocation failed\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int updateOperations(OpState *states, int opCount, const unsigned char *data, size_t len) {
+    int active = 0;
+
+    for (size_t offset = 0; offset < len; offset += FUSED_SLICE) {
+        size_t slice = len - offset < FUSED_SLICE ? len - offset : FUSED_SLICE;
+        active = 0;
+        for (int k = 0; k < opCount; k++) {
+            if (opDone(&states[k]))
+                continue;
+            opUpdate(&states[k], data + offset, slice);
+            active += !opDone(&states[k]);
+        }
+        if (active == 0)
+            break;
+    }
+    return active;
+}
+
+void finishOperations(OpState *states, int opCount, const char *fileName, FILE *out) {
+    int phase = statsPhase(PHASE_OUTPUT);
+    for (int k = 0; k < opCount; k++)
+        opFinish(&states[k], fileName, out);
+    statsPhase(phase);
+}
+
+void processBuffer(const Operation *ops, int opCount, const char *fileName, const unsigned char *data, size_t len,
+                   const Options *options, FILE *out) {
+    OpState states[MAX_OPERATIONS];
+    statsCount(COUNTER_FILES, 1);
+    int phase = statsPhase(PHASE_COMPUTE);
+    if (beginOperations(states, ops, opCount, fileName, options, out) == 0) {
+        updateOperations(states, opCount, data, len);
+        finishOperations(states, opCount, fileName, out);
+    }
+    statsPhase(phase);
+}
+
+int cacheMap(ResultCache *cache, uint64_t capacity) {
+    size_t mapSize = sizeof(CacheHeader) + capacity * sizeof(CacheRecord);
+    if (ftruncate(cache->fd, mapSize) != 0)
+        return -1;
+    void *map = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    if (cache->header)
+        munmap(cache->header, cache->mapSize);
+    cache->header = map;
+    cache->records = (CacheRecord *)((char *)map + sizeof(CacheHeader));
+    cache->mapSize = mapSize;
+    return 0;
+}
+
+int cacheOpen(ResultCache *cache, const char *path) {
+    struct stat st;
+
+    memset(cache, 0, sizeof(*cache));
+    cache->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (cache->fd < 0)
+        return -1;
+    if (flock(cache->fd, LOCK_EX) != 0 || fstat(cache->fd, &st) != 0) {
+        close(cache->fd);
+        return -1;
+    }
+
+    /* Only a new file or one carrying our magic is ours to (re)format; anything else is left alone. */
+    int valid = 0;
+    if (st.st_size != 0) {
+        CacheHeader header;
+        memset(&header, 0, sizeof(header));
+        if (pread(cache->fd, &header, sizeof(header), 0) < 8 || memcmp(header.magic, CACHE_MAGIC, 8) != 0) {
+            close(cache->fd);
+            return CACHE_FOREIGN;
+        }
+        if ((size_t)st.st_size >= sizeof(CacheHeader) && header.version == CACHE_VERSION && header.capacity > 0 && (header.capacity & (header.capacity - 1)) == 0 &&
+            sizeof(CacheHeader) + header.capacity * sizeof(CacheRecord) == (uint64_t)st.st_size)
+            valid = cacheMap(cache, header.capacity) == 0;
+    }
+    if (!valid) {
+        if (ftruncate(cache->fd, 0) != 0 || cacheMap(cache, CACHE_INITIAL_SLOTS) != 0) {
+            close(cache->fd);
+            return -1;
+        }
+        memcpy(cache->header->magic, CACHE_MAGIC, 8);
+        cache->header->version = CACHE_VERSION;
+        cache->header->capacity = CACHE_INITIAL_SLOTS;
+        cache->header->used = 0;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    return 0;
+}
+
+void cacheClose(ResultCache *cache) {
+    munmap(cache->header, cache->mapSize);
+    flock(cache->fd, LOCK_UN);
+    close(cache->fd);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+uint64_t cacheHash(uint64_t dev, uint64_t ino, uint32_t kind, uint32_t param) {
+    uint64_t h = dev * 0x9E3779B97F4A7C15ULL ^ ino;
+    h ^= ((uint64_t)kind << 32 | param) * 0xC2B2AE3D27D4EB4FULL;
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    return h ^ (h >> 32);
+}
+
+CacheRecord *cacheSlot(ResultCache *cache, uint64_t dev, uint64_t ino, uint32_t kind, uint32_t param) {
+    uint64_t mask = cache->header->capacity - 1;
+    uint64_t k = cacheHash(dev, ino, kind, param) & mask;
+    for (;;) {
+        CacheRecord *record = &cache->records[k];
+        if (record->kind == 0 ||
+            (record->dev == dev && record->ino == ino && record->kind == kind && record->param == param))
+            return record;
+        k = (k + 1) & mask;
+    }
+}
+
+int cacheGrow(ResultCache *cache) {
+    uint64_t oldCapacity = cache->header->capacity;
+    CacheRecord *old = statsMalloc(oldCapacity * sizeof(CacheRecord));
+    if (!old)
+        return -1;
+    memcpy(old, cache->records, oldCapacity * sizeof(CacheRecord));
+
+    /* On failure the old map stays in place; cacheOpen resets a file whose size disagrees. */
+    if (cacheMap(cache, oldCapacity * 2) != 0) {
+        free(old);
+        return -1;
+    }
+    memset(cache->records, 0, oldCapacity * 2 * sizeof(CacheRecord));
+    cache->header->capacity = oldCapacity * 2;
+    for (uint64_t k = 0; k < oldCapacity; k++) {
+        if (old[k].kind != 0)
+            *cacheSlot(cache, old[k].dev, old[k].ino, old[k].kind, old[k].param) = old[k];
+    }
+    free(old);
+    return 0;
+}
+
+int cacheableOperations(const Operation *ops, int opCount) {
+    for (int k = 0; k < opCount; k++) {
+        if (ops[k].kind != OP_XOR && ops[k].kind != OP_MASK)
+            return 0;
+    }
+    return 1;
+}
+
+/* The xor accumulator does not depend on N, so one record serves every xorN. */
+uint32_t cacheParam(const Operation *op) {
+    return op->kind == OP_MASK ? op->mask : 0;
+}
+
+int cacheLoad(ResultCache *cache, const struct stat *st, const Operation *ops, int opCount, OpState *states) {
+    int hits = 0;
+
+    pthread_mutex_lock(&cache->lock);
+    for (int k = 0; k < opCount; k++) {
+        const CacheRecord *record = cacheSlot(cache, st->st_dev, st->st_ino, ops[k].kind + 1, cacheParam(&ops[k]));
+        if (record->kind == 0 || record->size != (uint64_t)st->st_size || record->mtimeSec != st->st_mtim.tv_sec ||
+            record->mtimeNsec != st->st_mtim.tv_nsec)
+            break;
+        states[k].op = &ops[k];
+        if (ops[k].kind == OP_XOR) {
+            memcpy(states[k].u.xor.acc, record->acc, XOR_WORD_SIZE);
+            states[k].u.xor.length = record->value;
+        } else {
+            maskInit(&states[k].u.mask, ops[k].mask);
+            states[k].u.mask.count = record->value;
+        }
+        hits++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return hits == opCount;
+}
+
+/*
+ * A write in the same timestamp tick as the read would leave size and
+ * mtime unchanged, so results for recently changed files are not saved.
+ */
+int statIsRecent(const struct stat *st) {
+    time_t limit = time(NULL) - CACHE_RACY_SECONDS;
+    return st->st_mtim.tv_sec >= limit || st->st_ctim.tv_sec >= limit;
+}
+
+void cacheSave(ResultCache *cache, const struct stat *st, const OpState *states, int opCount) {
+    pthread_mutex_lock(&cache->lock);
+    for (int k = 0; k < opCount; k++) {
+        if ((cache->header->used + 1) * 10 > cache->header->capacity * 7 && cacheGrow(cache) != 0)
+            break;
+        const Operation *op = states[k].op;
+        CacheRecord *record = cacheSlot(cache, st->st_dev, st->st_ino, op->kind + 1, cacheParam(op));
+        if (record->kind == 0)
+            cache->header->used++;
+        record->dev = st->st_dev;
+        record->ino = st->st_ino;
+        record->size = st->st_size;
+        record->mtimeSec = st->st_mtim.tv_sec;
+        record->mtimeNsec = st->st_mtim.tv_nsec;
+        record->kind = op->kind + 1;
+        record->param = cacheParam(op);
+        if (op->kind == OP_XOR) {
+            memcpy(record->acc, states[k].u.xor.acc, XOR_WORD_SIZE);
+            record->value = states[k].u.xor.length;
+        } else {
+            memset(record->acc, 0, sizeof(record->acc));
+            record->value = states[k].u.mask.count;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void processFile(const Operation *ops, int opCount, const char *fileName, const Options *options, FILE *out) {
+    InputFile in;
+    OpState states[MAX_OPERATIONS];
+    struct stat st;
+    int phase = statsPhase(PHASE_OPEN);
+    int cacheable = options->cache && !isStdin(fileName) && cacheableOperations(ops, opCount);
+    int cached = cacheable && stat(fileName, &st) == 0 && S_ISREG(st.st_mode);
+
+    statsCount(COUNTER_FILES, 1);
+    statsCount(COUNTER_SYSCALLS, cacheable);
+    statsPhase(PHASE_COMPUTE);
+    if (cached && cacheLoad(options->cache, &st, ops, opCount, states)) {
+        finishOperations(states, opCount, fileName, out);
+        statsPhase(phase);
+        return;
+    }
+    if (inputOpen(&in, fileName) != 0) {
+        perror(fileName);
+        statsPhase(phase);
+        return;
+    }
+    /* The name may have been replaced since the lookup; only save under the key of the file actually read. */
+    struct stat opened;
+    if (cached && (fstat(in.fd, &opened) != 0 || opened.st_dev != st.st_dev || opened.st_ino != st.st_ino ||
+                   opened.st_size != st.st_size || opened.st_mtim.tv_sec != st.st_mtim.tv_sec ||
+                   opened.st_mtim.tv_nsec != st.st_mtim.tv_nsec))
+        cached = 0;
+
+    int failed = 0;
+    if (opCount == 1 && ops[0].kind == OP_XOR) {
+        states[0].op = &ops[0];
+        failed = xorInput(&in, &states[0].u.xor, options->jobs) != 0;
+    } else if (opCount == 1 && ops[0].kind == OP_MASK) {
+        states[0].op = &ops[0];
+        failed = maskInput(&in, &states[0].u.mask, ops[0].mask, options->jobs) != 0;
+    } else if (opCount == 1 && ops[0].kind == OP_MASK_SET) {
+        states[0].op = &ops[0];
+        failed = maskSetInput(&in, &states[0].u.maskSet, &ops[0], options->jobs) != 0;
+    } else if (opCount == 1 && ops[0].kind == OP_CRC32C) {
+        states[0].op = &ops[0];
+        failed = crcInput(&in, &states[0].u.crc, options->jobs) != 0;
+    } else if (opCount == 1 && ops[0].kind == OP_HASH) {
+        states[0].op = &ops[0];
+        failed = hashInput(&in, &states[0].u.hash, options->jobs) != 0;
+    } else {
+        if (beginOperations(states, ops, opCount, fileName, options, out) != 0) {
+            inputClose(&in);
+            statsPhase(phase);
+            return;
+        }
+        const unsigned char *data;
+        ssize_t got;
+        while ((got = inputNext(&in, &data)) > 0) {
+            if (updateOperations(states, opCount, data, got) == 0)
+                break;
+        }
+        failed = got < 0;
+    }
+    if (failed)
+        perror(fileName);
+    inputClose(&in);
+
+    if (!(failed && opCount == 1 && ops[0].kind == OP_XOR)) {
+        if (cached && !failed && !statIsRecent(&opened))
+            cacheSave(options->cache, &opened, states, opCount);
+        finishOperations(states, opCount, fileName, out);
+    }
+    statsPhase(phase);
+}
+
+void processFileJob(int index, FILE *out, void *ctx) {
+    FileJob *job = ctx;
+    if (job->skip && job->skip[index])
+        processBuffer(job->ops, job->opCount, job->fileNames[index], NULL, 0, job->options, out);
+    else
+        processFile(job->ops, job->opCount, job->fileNames[index], job->options, out);
+}
+
+void runFiles(char **fileNames, int fileCount, const Operation *ops, int opCount, const Options *options,
+              const char *skip) {
+    FileJob job = {fileNames, ops, opCount, options, skip};
+    runPool(fileCount, options->jobs, processFileJob, &job);
+}
+
+#ifdef HAVE_IO_URING
+int ringInit(Ring *r, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return -1;
+
+    r->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cqRingSize > r->sqRingSize)
+            r->sqRingSize = r->cqRingSize;
+        r->cqRingSize = r->sqRingSize;
+    }
+    r->sqRing = mmap(NULL, r->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sqRing == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cqRing = r->sqRing;
+    } else {
+        r->cqRing = mmap(NULL, r->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cqRing == MAP_FAILED) {
+            munmap(r->sqRing, r->sqRingSize);
+            close(r->fd);
+            return -1;
+        }
+    }
+    r->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        if (r->cqRing != r->sqRing)
+            munmap(r->cqRing, r->cqRingSize);
+        munmap(r->sqRing, r->sqRingSize);
+        close(r->fd);
+        return -1;
+    }
+
+    char *sq = r->sqRing;
+    char *cq = r->cqRing;
+    r->sqHead = (unsigned *)(sq + p.sq_off.head);
+    r->sqTail = (unsigned *)(sq + p.sq_off.tail);
+    r->sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sqArray = (unsigned *)(sq + p.sq_off.array);
+    r->cqHead = (unsigned *)(cq + p.cq_off.head);
+    r->cqTail = (unsigned *)(cq + p.cq_off.tail);
+    r->cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+void ringClose(Ring *r) {
+    munmap(r->sqes, r->sqesSize);
+    if (r->cqRing != r->sqRing)
+        munmap(r->cqRing, r->cqRingSize);
+    munmap(r->sqRing, r->sqRingSize);
+    close(r->fd);
+}
+
+struct io_uring_sqe *ringGetSqe(Ring *r, int opcode, int fd, const void *addr, unsigned len,
+                                unsigned long long offset, unsigned long long userData) {
+    unsigned tail = *r->sqTail;
+    unsigned index = tail & *r->sqMask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = userData;
+    r->sqArray[index] = index;
+    __atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+    r->queued++;
+    return sqe;
+}
+
+int ringSubmitAndWait(Ring *r, unsigned waitFor) {
+    int phase = statsPhase(PHASE_READ);
+    while (r->queued > 0 || waitFor > 0) {
+        long ret = syscall(__NR_io_uring_enter, r->fd, r->queued, waitFor, IORING_ENTER_GETEVENTS, NULL, 0);
+        statsCount(COUNTER_SYSCALLS, 1);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            statsPhase(phase);
+            return -1;
+        }
+        r->queued -= ret;
+        break;
+    }
+    statsPhase(phase);
+    return 0;
+}
+
+int ringNextCqe(Ring *r, struct io_uring_cqe *cqe) {
+    unsigned head = *r->cqHead;
+    if (head == __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE))
+        return 0;
+    *cqe = r->cqes[head & *r->cqMask];
+    __atomic_store_n(r->cqHead, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+ * Reaps expected completions into the slots.  Returns -1 if waiting
+ * fails, 1 if the kernel rejected an opcode (kernels before 5.6 set up
+ * rings but refuse OPENAT and STATX with EINVAL) and 0 otherwise.
+ */
+int ringCollect(Ring *r, unsigned expected, UringSlot *slots) {
+    unsigned seen = 0;
+    int rejected = 0;
+
+    while (seen < expected) {
+        struct io_uring_cqe cqe;
+        if (!ringNextCqe(r, &cqe)) {
+            if (ringSubmitAndWait(r, expected - seen) != 0)
+                return -1;
+            continue;
+        }
+        seen++;
+        if (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP)
+            rejected = 1;
+        UringSlot *slot = &slots[cqe.user_data >> 2];
+        switch (cqe.user_data & 3) {
+        case 0:
+            slot->fd = cqe.res >= 0 ? cqe.res : -1;
+            slot->openError = cqe.res < 0 ? -cqe.res : 0;
+            break;
+        case 1:
+            slot->statError = cqe.res < 0 ? -cqe.res : 0;
+            break;
+        case 2:
+            slot->readResult = cqe.res;
+            break;
+        default:
+            slot->fd = -1;
+            break;
+        }
+    }
+    return rejected;
+}
+
+/* Checks that the kernel knows every opcode uringRun submits. */
+int ringProbe(Ring *r) {
+    static const int opcodes[] = {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_CLOSE};
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = statsCalloc(1, size);
+    int supported = probe && syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+
+    for (size_t k = 0; supported && k < sizeof(opcodes) / sizeof(opcodes[0]); k++)
+        supported = opcodes[k] <= probe->last_op && (probe->ops[opcodes[k]].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported ? 0 : -1;
+}
+
+/* Closes the files a failed batch left open, reaping whatever has completed. */
+void uringAbandon(Ring *r, UringSlot *slots, int count) {
+    struct io_uring_cqe cqe;
+    while (ringNextCqe(r, &cqe)) {
+        if ((cqe.user_data & 3) == 0 && cqe.res >= 0)
+            slots[cqe.user_data >> 2].fd = cqe.res;
+        else if ((cqe.user_data & 3) == 3)
+            slots[cqe.user_data >> 2].fd = -1;
+    }
+    for (int k = 0; k < count; k++) {
+        if (slots[k].fd >= 0)
+            close(slots[k].fd);
+        slots[k].fd = -1;
+    }
 }
 
-void doXor(char **fileNames, int fileCount, int N) {
-    if (N == 2) {
-        for (int i = 0; i < fileCount; i++) {
-            FILE *fp = fopen(fileNames[i], "rb");
-            if (!fp) {
-                perror(fileNames[i]);
+/*
+ * Opens, stats and reads files in batches through the ring.  Returns how
+ * many files from the start of the list were handled; the caller runs the
+ * usual path for the rest.  -1 means the ring could not be used and
+ * nothing was printed.
+ */
+
+int uringRun(char **fileNames, int fileCount, const Operation *ops, int opCount, const Options *options,
+             const char *skip) {
+    Ring ring;
+    UringSlot *slots;
+
+    if (ringInit(&ring, 4 * URING_BATCH) != 0)
+        return -1;
+    slots = statsCalloc(URING_BATCH, sizeof(UringSlot));
+    if (!slots || ringProbe(&ring) != 0) {
+        free(slots);
+        ringClose(&ring);
+        return -1;
+    }
+
+    int base = 0;
+    for (; base < fileCount; base += URING_BATCH) {
+        int count = fileCount - base < URING_BATCH ? fileCount - base : URING_BATCH;
+        unsigned reads = 0;
+        unsigned opens = 0;
+        for (int k = 0; k < count; k++) {
+            UringSlot *slot = &slots[k];
+            slot->fd = -1;
+            slot->openError = slot->statError = 0;
+            slot->readResult = -1;
+            memset(&slot->stx, 0, sizeof(slot->stx));
+            if (skip && skip[base + k])
                 continue;
-            }
-            int result = 0;
-            int byteRead;
-            while ((byteRead = fgetc(fp)) != EOF) {
-                unsigned char byte = (unsigned char)byteRead;
-                unsigned char highNibble = (byte >> 4) & 0x0F;
-                unsigned char lowNibble  = byte & 0x0F;
-                result ^= highNibble;
-                result ^= lowNibble;
-            }
-            fclose(fp);
-            printf("File: %s, XOR result (4 bits): %X\n", fileNames[i], result & 0x0F);
+            opens += 2;
+            ringGetSqe(&ring, IORING_OP_OPENAT, AT_FDCWD, fileNames[base + k], 0, 0, (unsigned long long)k << 2)
+                ->open_flags = O_RDONLY | O_CLOEXEC;
+            ringGetSqe(&ring, IORING_OP_STATX, AT_FDCWD, fileNames[base + k], STATX_TYPE | STATX_SIZE,
+                       (unsigned long)&slot->stx, ((unsigned long long)k << 2) | 1);
         }
-    } else {
-        int blockSize = (1 << N) / 8;
-        for (int i = 0; i < fileCount; i++) {
-            FILE *fp = fopen(fileNames[i], "rb");
-            if (!fp) {
-                perror(fileNames[i]);
+        if (ringCollect(&ring, opens, slots) != 0) {
+            uringAbandon(&ring, slots, count);
+            break;
+        }
+
+        for (int k = 0; k < count; k++) {
+            UringSlot *slot = &slots[k];
+            size_t size = slot->stx.stx_size;
+            if (slot->fd < 0 || slot->statError || !S_ISREG(slot->stx.stx_mode) || size > URING_MAX_FILE)
                 continue;
+            if (slot->capacity < size + 1) {
+                unsigned char *grown = statsRealloc(slot->buffer, size + 1);
+                if (!grown)
+                    continue;
+                slot->buffer = grown;
+                slot->capacity = size + 1;
             }
-            fseek(fp, 0, SEEK_END);
-            long fsize = ftell(fp);
-            fseek(fp, 0, SEEK_SET);
-            unsigned char *buffer = malloc(fsize);
-            if (!buffer) {
-                fclose(fp);
-                fprintf(stderr, "Memory allocation failed\n");
+            ringGetSqe(&ring, IORING_OP_READ, slot->fd, slot->buffer, size + 1, 0, ((unsigned long long)k << 2) | 2)
+                ->flags = IOSQE_IO_HARDLINK;
+            ringGetSqe(&ring, IORING_OP_CLOSE, slot->fd, NULL, 0, 0, ((unsigned long long)k << 2) | 3);
+            reads += 2;
+        }
+        if (ringCollect(&ring, reads, slots) != 0) {
+            uringAbandon(&ring, slots, count);
+            break;
+        }
+
+        for (int k = 0; k < count; k++) {
+            UringSlot *slot = &slots[k];
+            const char *fileName = fileNames[base + k];
+            if (skip && skip[base + k]) {
+                processBuffer(ops, opCount, fileName, NULL, 0, options, stdout);
                 continue;
             }
-            fread(buffer, 1, fsize, fp);
-            fclose(fp);
-
-            int numBlocks = (fsize + blockSize - 1) / blockSize;
-            unsigned char *result = malloc(blockSize);
-            if (!result) {
-                free(buffer);
-                fprintf(stderr, "Memory allocation failed\n");
+            if (slot->openError) {
+                errno = slot->openError;
+                perror(fileName);
                 continue;
             }
-            memset(result, 0, blockSize);
-
-            for (int b = 0; b < numBlocks; b++) {
-                for (int j = 0; j < blockSize; j++) {
-                    unsigned char byte = 0x16;
-                    int pos = b * blockSize + j;
-                    if (pos < fsize)
-                        byte = buffer[pos];
-                    result[j] ^= byte;
-                }
+            if (slot->fd >= 0) {
+                statsCount(COUNTER_SYSCALLS, 1);
+                close(slot->fd);
             }
+            if (slot->readResult >= 0 && (size_t)slot->readResult <= slot->stx.stx_size) {
+                statsCount(COUNTER_BYTES_READ, slot->readResult);
+                processBuffer(ops, opCount, fileName, slot->buffer, slot->readResult, options, stdout);
+            } else {
+                processFile(ops, opCount, fileName, options, stdout);
+            }
+        }
+    }
+
+    for (int k = 0; k < URING_BATCH; k++)
+        free(slots[k].buffer);
+    free(slots);
+    ringClose(&ring);
+    if (base >= fileCount)
+        return fileCount;
+    return base > 0 ? base : -1;
+}
+#else
+int uringRun(char **fileNames, int fileCount, const Operation *ops, int opCount, const Options *options,
+             const char *skip) {
+    (void)skip;
+    (void)fileNames;
+    (void)fileCount;
+    (void)ops;
+    (void)opCount;
+    (void)options;
+    return -1;
+}
+#endif
+
+int indexOpen(TrigramIndex *index, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    memset(index, 0, sizeof(*index));
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(IndexHeader)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    const IndexHeader *header = map;
+    uint64_t filesBytes = (uint64_t)header->fileCount * sizeof(IndexFile);
+    uint64_t trigramBytes = header->trigramCount * sizeof(IndexTrigram);
+    uint64_t postingBytes = (header->postingCount * sizeof(uint32_t) + 7) & ~(uint64_t)7;
+    if (memcmp(header->magic, INDEX_MAGIC, 8) != 0 || header->version != INDEX_VERSION ||
+        header->trigramCount > TRIGRAM_SPACE || header->postingCount > (uint64_t)st.st_size ||
+        sizeof(IndexHeader) + filesBytes + trigramBytes + postingBytes + header->namesSize != (uint64_t)st.st_size) {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    const char *base = map;
+    index->map = map;
+    index->mapSize = st.st_size;
+    index->header = header;
+    index->files = (const IndexFile *)(base + sizeof(IndexHeader));
+    index->trigrams = (const IndexTrigram *)(base + sizeof(IndexHeader) + filesBytes);
+    index->postings = (const uint32_t *)(base + sizeof(IndexHeader) + filesBytes + trigramBytes);
+    index->names = base + sizeof(IndexHeader) + filesBytes + trigramBytes + postingBytes;
+    return 0;
+}
+
+void indexClose(TrigramIndex *index) {
+    if (index->map)
+        munmap(index->map, index->mapSize);
+    index->map = NULL;
+}
+
+int indexFindFile(const TrigramIndex *index, const char *path) {
+    int lo = 0;
+    int hi = (int)index->header->fileCount - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        const IndexFile *file = &index->files[mid];
+        if (file->nameOffset >= index->header->namesSize)
+            return -1;
+        int cmp = strcmp(index->names + file->nameOffset, path);
+        if (cmp == 0)
+            return mid;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1;
+}
+
+const IndexTrigram *indexFindTrigram(const TrigramIndex *index, uint32_t trigram) {
+    uint64_t lo = 0;
+    uint64_t hi = index->header->trigramCount;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (index->trigrams[mid].trigram < trigram)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < index->header->trigramCount && index->trigrams[lo].trigram == trigram &&
+        index->trigrams[lo].offset + index->trigrams[lo].count <= index->header->postingCount)
+        return &index->trigrams[lo];
+    return NULL;
+}
+
+int compareUint32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int compareUint64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int compareIndexEntries(const void *a, const void *b) {
+    return strcmp(((const IndexEntry *)a)->path, ((const IndexEntry *)b)->path);
+}
 
-            printf("File: %s, XOR result: ", fileNames[i]);
-            for (int j = 0; j < blockSize; j++) {
-                printf("%02X", result[j]);
+int appendTrigram(IndexEntry *entry, size_t *capacity, uint32_t trigram) {
+    if (entry->count == *capacity) {
+        size_t grown = *capacity ? *capacity * 2 : 1024;
+        uint32_t *list = statsRealloc(entry->trigrams, grown * sizeof(uint32_t));
+        if (!list)
+            return -1;
+        entry->trigrams = list;
+        *capacity = grown;
+    }
+    entry->trigrams[entry->count++] = trigram;
+    return 0;
+}
+
+int scanTrigrams(IndexEntry *entry, unsigned char *seen) {
+    InputFile in;
+    const unsigned char *data;
+    ssize_t got;
+    size_t capacity = 0;
+    uint32_t window = 0;
+    unsigned long long position = 0;
+    int failed = 0;
+
+    if (inputOpen(&in, entry->path) != 0)
+        return -1;
+    while (!failed && (got = inputNext(&in, &data)) > 0) {
+        for (ssize_t i = 0; i < got; i++, position++) {
+            window = ((window << 8) | data[i]) & (TRIGRAM_SPACE - 1);
+            if (position < 2 || (seen[window >> 3] & (1 << (window & 7))))
+                continue;
+            seen[window >> 3] |= 1 << (window & 7);
+            if (appendTrigram(entry, &capacity, window) != 0) {
+                failed = 1;
+                break;
             }
-            printf("\n");
-            free(buffer);
-            free(result);
         }
     }
+    if (got < 0)
+        failed = 1;
+    inputClose(&in);
+
+    for (size_t k = 0; k < entry->count; k++)
+        seen[entry->trigrams[k] >> 3] &= ~(1 << (entry->trigrams[k] & 7));
+    if (!failed)
+        qsort(entry->trigrams, entry->count, sizeof(uint32_t), compareUint32);
+    return failed ? -1 : 0;
 }
 
-void doMask(char **fileNames, int fileCount, unsigned int mask) {
-    for (int i = 0; i < fileCount; i++) {
-        FILE *fp = fopen(fileNames[i], "rb");
-        if (!fp) {
-            perror(fileNames[i]);
+int reuseTrigrams(const TrigramIndex *old, IndexEntry *entries, int entryCount) {
+    int oldCount = old->header->fileCount;
+    int *owner = statsMalloc(oldCount * sizeof(int) + 1);
+    size_t *sizes = statsCalloc(oldCount + 1, sizeof(size_t));
+    if (!owner || !sizes) {
+        free(owner);
+        free(sizes);
+        return -1;
+    }
+    for (int k = 0; k < oldCount; k++)
+        owner[k] = -1;
+    for (int k = 0; k < entryCount; k++) {
+        if (entries[k].oldId >= 0)
+            owner[entries[k].oldId] = k;
+    }
+
+    for (uint64_t p = 0; p < old->header->postingCount; p++) {
+        if (old->postings[p] < (uint32_t)oldCount)
+            sizes[old->postings[p]]++;
+    }
+    for (int k = 0; k < entryCount; k++) {
+        if (entries[k].oldId < 0)
             continue;
+        entries[k].trigrams = statsMalloc(sizes[entries[k].oldId] * sizeof(uint32_t) + 1);
+        if (!entries[k].trigrams) {
+            free(owner);
+            free(sizes);
+            return -1;
         }
-        unsigned int count = 0;
-        unsigned int value;
-        while (fread(&value, sizeof(unsigned int), 1, fp) == 1) {
-            if ((value & mask) == mask)
-                count++;
+    }
+    for (uint64_t t = 0; t < old->header->trigramCount; t++) {
+        const IndexTrigram *trigram = &old->trigrams[t];
+        for (uint32_t p = 0; p < trigram->count && trigram->offset + p < old->header->postingCount; p++) {
+            uint32_t id = old->postings[trigram->offset + p];
+            if (id < (uint32_t)oldCount && owner[id] >= 0)
+                entries[owner[id]].trigrams[entries[owner[id]].count++] = trigram->trigram;
+        }
+    }
+    free(owner);
+    free(sizes);
+    return 0;
+}
+
+int writeIndex(const char *indexPath, IndexEntry *entries, int entryCount) {
+    uint64_t postingCount = 0;
+    uint64_t namesSize = 0;
+    for (int k = 0; k < entryCount; k++) {
+        postingCount += entries[k].count;
+        namesSize += strlen(entries[k].path) + 1;
+    }
+
+    uint64_t *pairs = statsMalloc(postingCount * sizeof(uint64_t) + 1);
+    if (!pairs)
+        return -1;
+    uint64_t n = 0;
+    for (int k = 0; k < entryCount; k++) {
+        for (size_t t = 0; t < entries[k].count; t++)
+            pairs[n++] = ((uint64_t)entries[k].trigrams[t] << 32) | (uint32_t)k;
+    }
+    qsort(pairs, postingCount, sizeof(uint64_t), compareUint64);
+
+    uint64_t trigramCount = 0;
+    for (uint64_t p = 0; p < postingCount; p++) {
+        if (p == 0 || (pairs[p] >> 32) != (pairs[p - 1] >> 32))
+            trigramCount++;
+    }
+
+    char tmpPath[4096];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp.%d", indexPath, (int)getpid());
+    FILE *fp = fopen(tmpPath, "wb");
+    if (!fp) {
+        free(pairs);
+        return -1;
+    }
+
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, 8);
+    header.version = INDEX_VERSION;
+    header.fileCount = entryCount;
+    header.trigramCount = trigramCount;
+    header.postingCount = postingCount;
+    header.namesSize = namesSize;
+    fwrite(&header, sizeof(header), 1, fp);
+
+    uint64_t nameOffset = 0;
+    for (int k = 0; k < entryCount; k++) {
+        IndexFile file = {entries[k].size, entries[k].mtimeSec, entries[k].mtimeNsec, nameOffset};
+        fwrite(&file, sizeof(file), 1, fp);
+        nameOffset += strlen(entries[k].path) + 1;
+    }
+
+    for (uint64_t p = 0; p < postingCount; ) {
+        IndexTrigram trigram = {(uint32_t)(pairs[p] >> 32), 0, p};
+        while (p < postingCount && (uint32_t)(pairs[p] >> 32) == trigram.trigram) {
+            trigram.count++;
+            p++;
         }
-        fclose(fp);
-        printf("File: %s, Count: %u\n", fileNames[i], count);
+        fwrite(&trigram, sizeof(trigram), 1, fp);
+    }
+    for (uint64_t p = 0; p < postingCount; p++) {
+        uint32_t id = (uint32_t)pairs[p];
+        fwrite(&id, sizeof(id), 1, fp);
     }
+    if (postingCount % 2) {
+        uint32_t pad = 0;
+        fwrite(&pad, sizeof(pad), 1, fp);
+    }
+    for (int k = 0; k < entryCount; k++)
+        fwrite(entries[k].path, 1, strlen(entries[k].path) + 1, fp);
+    free(pairs);
+
+    /* A short write must not replace a good index with a truncated one. */
+    int failed = ferror(fp);
+    if (fclose(fp) != 0 || failed || rename(tmpPath, indexPath) != 0) {
+        unlink(tmpPath);
+        return -1;
+    }
+    return 0;
 }
 
-void doCopy(char **fileNames, int fileCount, int N) {
-    if (N <= 0) {
-        fprintf(stderr, "Invalid copy number.\n");
-        return;
+int doIndex(char **fileNames, int fileCount, const char *indexPath) {
+    IndexEntry *entries = statsCalloc(fileCount + 1, sizeof(IndexEntry));
+    unsigned char *seen = statsCalloc(TRIGRAM_SPACE / 8, 1);
+    int entryCount = 0;
+    int reused = 0;
+    int scanned = 0;
+    int status = 0;
+    TrigramIndex old;
+
+    if (!entries || !seen) {
+        free(entries);
+        free(seen);
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
     }
+
     for (int i = 0; i < fileCount; i++) {
-        pid_t pid = fork();
-        if (pid < 0) {
-            fprintf(stderr, "Error creating process: fork\n");
+        struct stat st;
+        char *path = realpath(fileNames[i], NULL);
+        if (!path) {
+            perror(fileNames[i]);
             continue;
         }
-        if (pid == 0) {
-            FILE *src = fopen(fileNames[i], "rb");
-            if (!src) {
-                fprintf(stderr, "Failed to open file: %s\n", fileNames[i]);
-                return;
-            }
-            fseek(src, 0, SEEK_END);
-            long fsize = ftell(src);
-            fseek(src, 0, SEEK_SET);
-            unsigned char *buffer = malloc(fsize);
-            if (!buffer) {
-                fclose(src);
-                fprintf(stderr, "Memory allocation failed\n");
-                return;
-            }
-            fread(buffer, 1, fsize, src);
-            fclose(src);
+        statsAllocated(strlen(path) + 1);
+        if (stat(path, &st) != 0) {
+            perror(fileNames[i]);
+            free(path);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            fprintf(stderr, "%s: not a regular file\n", fileNames[i]);
+            free(path);
+            continue;
+        }
+        entries[entryCount].path = path;
+        entries[entryCount].size = st.st_size;
+        entries[entryCount].mtimeSec = st.st_mtim.tv_sec;
+        entries[entryCount].mtimeNsec = st.st_mtim.tv_nsec;
+        entries[entryCount].oldId = -1;
+        entryCount++;
+    }
+    qsort(entries, entryCount, sizeof(IndexEntry), compareIndexEntries);
+    int unique = 0;
+    for (int k = 0; k < entryCount; k++) {
+        if (unique > 0 && strcmp(entries[unique - 1].path, entries[k].path) == 0)
+            free(entries[k].path);
+        else
+            entries[unique++] = entries[k];
+    }
+    entryCount = unique;
 
-            for (int copy = 1; copy <= N; copy++) {
-                char newName[512];
-                snprintf(newName, sizeof(newName), "%s_copy%d", fileNames[i], copy);
-                FILE *dest = fopen(newName, "wb");
-                if (!dest) {
-                    fprintf(stderr, "Failed to create file: %s\n", newName);
-                    continue;
-                }
-                fwrite(buffer, 1, fsize, dest);
-                fclose(dest);
-            }
+    int haveOld = indexOpen(&old, indexPath) == 0;
+    if (haveOld) {
+        for (int k = 0; k < entryCount; k++) {
+            int id = indexFindFile(&old, entries[k].path);
+            if (id >= 0 && old.files[id].size == entries[k].size && old.files[id].mtimeSec == entries[k].mtimeSec &&
+                old.files[id].mtimeNsec == entries[k].mtimeNsec)
+                entries[k].oldId = id;
+        }
+        if (reuseTrigrams(&old, entries, entryCount) != 0) {
+            fprintf(stderr, "Memory allocation failed\n");
+            status = 1;
+        }
+        indexClose(&old);
+    }
 
-            free(buffer);
-            return;
+    /* A file that cannot be scanned is dropped rather than indexed as empty, so find -I still reads it. */
+    int kept = 0;
+    for (int k = 0; k < entryCount; k++) {
+        if (status == 0 && entries[k].oldId >= 0) {
+            reused++;
+        } else if (status == 0 && scanTrigrams(&entries[k], seen) == 0) {
+            scanned++;
+        } else {
+            if (status == 0)
+                perror(entries[k].path);
+            free(entries[k].path);
+            free(entries[k].trigrams);
+            continue;
         }
+        entries[kept++] = entries[k];
     }
-    for (int i = 0; i < fileCount; i++)
-        wait(NULL);
+    entryCount = kept;
+
+    if (status == 0 && writeIndex(indexPath, entries, entryCount) != 0) {
+        perror(indexPath);
+        status = 1;
+    }
+    if (status == 0)
+        printf("Indexed %d files into %s (%d reused, %d scanned)\n", entryCount, indexPath, reused, scanned);
+
+    for (int k = 0; k < entryCount; k++) {
+        free(entries[k].path);
+        free(entries[k].trigrams);
+    }
+    free(entries);
+    free(seen);
+    return status;
 }
 
-void doFind(char **fileNames, int fileCount, const char *searchString) {
+char *indexSkipList(const char *indexPath, char **fileNames, int fileCount, const SearchPattern *pattern) {
+    TrigramIndex index;
+    uint32_t needleTrigrams[64];
+    int distinct = 0;
+    int limit = 0;
+
+    if (pattern->len < 3)
+        return NULL;
+    if (indexOpen(&index, indexPath) != 0) {
+        perror(indexPath);
+        return NULL;
+    }
+
+    for (size_t i = 0; i + 3 <= pattern->len && distinct < (int)(sizeof(needleTrigrams) / sizeof(needleTrigrams[0])); i++) {
+        const unsigned char *n = pattern->needle + i;
+        uint32_t trigram = ((uint32_t)n[0] << 16) | ((uint32_t)n[1] << 8) | n[2];
+        int k = 0;
+        while (k < distinct && needleTrigrams[k] != trigram)
+            k++;
+        if (k == distinct)
+            needleTrigrams[distinct++] = trigram;
+    }
+
+    uint32_t *hits = statsCalloc(index.header->fileCount + 1, sizeof(uint32_t));
+    char *skip = statsCalloc(fileCount, 1);
+    if (!hits || !skip) {
+        free(hits);
+        free(skip);
+        indexClose(&index);
+        return NULL;
+    }
+    for (int k = 0; k < distinct; k++) {
+        const IndexTrigram *trigram = indexFindTrigram(&index, needleTrigrams[k]);
+        if (!trigram)
+            break;
+        for (uint32_t p = 0; p < trigram->count; p++) {
+            uint32_t id = index.postings[trigram->offset + p];
+            if (id < index.header->fileCount && hits[id] == (uint32_t)k)
+                hits[id]++;
+        }
+        limit++;
+    }
+
     for (int i = 0; i < fileCount; i++) {
-        pid_t pid = fork();
-        if (pid < 0) {
-            fprintf(stderr, "Error creating process: fork\n");
+        struct stat st;
+        char *path = realpath(fileNames[i], NULL);
+        if (!path)
+            continue;
+        statsAllocated(strlen(path) + 1);
+        int id = indexFindFile(&index, path);
+        if (id >= 0 && stat(path, &st) == 0 && index.files[id].size == (uint64_t)st.st_size &&
+            index.files[id].mtimeSec == st.st_mtim.tv_sec && index.files[id].mtimeNsec == st.st_mtim.tv_nsec)
+            skip[i] = limit < distinct || hits[id] < (uint32_t)distinct;
+        free(path);
+    }
+
+    free(hits);
+    indexClose(&index);
+    return skip;
+}
+
+int parseMaskSpec(const char *spec, Operation *op) {
+    const char *p = spec;
+    char *end;
+    unsigned long long limit = op->width == 64 ? ~0ULL : (1ULL << op->width) - 1;
+
+    while (*p) {
+        if (*p == ',' || *p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+            p++;
             continue;
         }
-        if (pid == 0) {
-            FILE *fp = fopen(fileNames[i], "r");
-            if (!fp) {
-                perror(fileNames[i]);
-                return;
-            }
-            int found = 0;
-            char *line = NULL;
-            size_t len = 0;
-            ssize_t read;
-            while ((read = getline(&line, &len, fp)) != -1) {
-                if (strstr(line, searchString) != NULL) {
-                    found = 1;
-                    break;
-                }
-            }
-            free(line);
-            fclose(fp);
+        if (*p == '#') {
+            while (*p && *p != '\n')
+                p++;
+            continue;
+        }
+        errno = 0;
+        unsigned long long value = strtoull(p, &end, 16);
+        if (end == p || errno != 0 || value > limit ||
+            (*end && *end != ',' && *end != ' ' && *end != '\t' && *end != '\n' && *end != '\r' && *end != '#')) {
+            size_t len = strcspn(p, ", \t\r\n#");
+            fprintf(stderr, "Invalid %d-bit hex mask: %.*s\n", op->width, (int)len, p);
+            return 1;
+        }
+        if (op->maskCount == MASK_SET_MAX) {
+            fprintf(stderr, "Too many masks (at most %d).\n", MASK_SET_MAX);
+            return 1;
+        }
+        op->masks[op->maskCount++] = value;
+        p = end;
+    }
+    if (op->maskCount == 0) {
+        fprintf(stderr, "No masks given.\n");
+        return 1;
+    }
+    return 0;
+}
 
-            if (found)
-                printf("Found in: %s\n", fileNames[i]);
-            else
-                printf("String not found in: %s\n", fileNames[i]);
-            return;
+char *readMaskFile(const char *path) {
+    InputFile in;
+    const unsigned char *data;
+    ssize_t got;
+    size_t len = 0;
+    char *text = NULL;
+
+    if (inputOpen(&in, path) != 0) {
+        perror(path);
+        return NULL;
+    }
+    while ((got = inputNext(&in, &data)) > 0) {
+        char *grown = statsRealloc(text, len + got + 1);
+        if (!grown) {
+            got = -1;
+            break;
         }
+        text = grown;
+        memcpy(text + len, data, got);
+        len += got;
     }
-    for (int i = 0; i < fileCount; i++)
-        wait(NULL);
+    inputClose(&in);
+    if (got < 0) {
+        perror(path);
+        free(text);
+        return NULL;
+    }
+    if (!text)
+        text = statsCalloc(1, 1);
+    else
+        text[len] = '\0';
+    return text;
+}
+
+/*
+ * Recognizes mask, maskW, maskle/maskbe and maskWle/maskWbe exactly, with
+ * W one of 8, 16, 32 or 64.  Returns -1 for anything else, so that file
+ * names which merely start with "mask" are not taken for the operation.
+ */
+int parseMaskFlag(const char *flag, int *width, int *swap) {
+    const char *suffix = flag + 4;
+
+    if (strncmp(flag, "mask", 4) != 0)
+        return -1;
+    *width = 32;
+    *swap = 0;
+    if (*suffix >= '1' && *suffix <= '9') {
+        *width = (int)strtol(suffix, (char **)&suffix, 10);
+        if (*width != 8 && *width != 16 && *width != 32 && *width != 64)
+            return -1;
+    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (strcmp(suffix, "be") == 0)
+        *swap = 1;
+    else if (strcmp(suffix, "le") != 0 && *suffix)
+#else
+    if (strcmp(suffix, "le") == 0)
+        *swap = 1;
+    else if (strcmp(suffix, "be") != 0 && *suffix)
+#endif
+        return -1;
+    return 0;
+}
+
+int isMaskFlag(const char *flag) {
+    int width;
+    int swap;
+    return parseMaskFlag(flag, &width, &swap) == 0;
+}
+
+/*
+ * maskW[le|be] tests W-bit words.  Instead of swapping every loaded word,
+ * the masks are byte-swapped once when the requested byte order is not
+ * the host's: (swap(w) & m) == m holds exactly when (w & swap(m)) == swap(m).
+ */
+int parseMaskSet(const char *flag, const char *spec, Operation *op) {
+    int swap;
+
+    if (parseMaskFlag(flag, &op->width, &swap) != 0) {
+        fprintf(stderr, "Unknown flag: %s\n", flag);
+        return -1;
+    }
+
+    op->masks = statsMalloc(2 * MASK_SET_MAX * sizeof(uint64_t));
+    if (!op->masks) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    op->matchMasks = op->masks + MASK_SET_MAX;
+
+    int rc;
+    if (spec[0] == '@') {
+        char *text = readMaskFile(spec + 1);
+        if (!text)
+            return 1;
+        rc = parseMaskSpec(text, op);
+        free(text);
+    } else {
+        rc = parseMaskSpec(spec, op);
+    }
+    if (rc != 0)
+        return rc;
+
+    for (int m = 0; m < op->maskCount; m++) {
+        uint64_t value = op->masks[m];
+        if (swap && op->width == 16)
+            value = __builtin_bswap16((uint16_t)value);
+        else if (swap && op->width == 32)
+            value = __builtin_bswap32((uint32_t)value);
+        else if (swap && op->width == 64)
+            value = __builtin_bswap64(value);
+        op->matchMasks[m] = value;
+    }
+    return 0;
+}
+
+void freeOperation(Operation *op) {
+    free(op->masks);
+    if (op->regex) {
+        free(op->regex->forward.nodes);
+        free(op->regex->reverse.nodes);
+        free(op->regex->literal);
+        free(op->regex);
+    }
+}
+
+int parseOperation(int argc, char *argv[], int *index, Operation *op, const Options *options) {
+    const char *flag = argv[*index];
+    const char *extraParam = NULL;
+
+    memset(op, 0, sizeof(*op));
+    if (isMaskFlag(flag) || (strcmp(flag, "find") == 0) || (strcmp(flag, "findre") == 0)) {
+        if (*index + 1 >= argc)
+            return -1;
+        extraParam = argv[*index + 1];
+    }
+
+    if (strncmp(flag, "xor", 3) == 0) {
+        if (sscanf(&flag[3], "%d", &op->N) != 1 || op->N < 2 || op->N > 6) {
+            fprintf(stderr, "Invalid N for xor operation. N must be in [2,6].\n");
+            return 1;
+        }
+        op->kind = OP_XOR;
+        *index += 1;
+    }
+    else if (isMaskFlag(flag) && (flag[4] != '\0' || strpbrk(extraParam, ", @") != NULL)) {
+        int rc = parseMaskSet(flag, extraParam, op);
+        if (rc != 0)
+            return rc;
+        op->kind = OP_MASK_SET;
+        *index += 2;
+    }
+    else if (strcmp(flag, "mask") == 0) {
+        char *endptr;
+        op->mask = strtol(extraParam, &endptr, 16);
+        if (*endptr != '\0') {
+            fprintf(stderr, "Invalid hex mask: %s\n", extraParam);
+            return 1;
+        }
+        op->kind = OP_MASK;
+        *index += 2;
+    }
+    else if (strcmp(flag, "crc32c") == 0) {
+        op->kind = OP_CRC32C;
+        *index += 1;
+    }
+    else if (strcmp(flag, "hash64") == 0 || strcmp(flag, "hash128") == 0) {
+        op->kind = OP_HASH;
+        op->N = atoi(&flag[4]);
+        *index += 1;
+    }
+    else if (strcmp(flag, "findre") == 0) {
+        const char *error;
+        op->regex = compileRegex(extraParam, &error);
+        if (!op->regex) {
+            fprintf(stderr, "Invalid regular expression: %s (%s)\n", extraParam, error);
+            return 1;
+        }
+        op->kind = OP_FIND_REGEX;
+        compileSearchPattern(&op->pattern, op->regex->literal);
+        *index += 2;
+    }
+    else if (strcmp(flag, "find") == 0) {
+        if ((options->findAll || options->findCount || options->findLines) && extraParam[0] == '\0') {
+            fprintf(stderr, "Search string must not be empty with -a, -c or -n.\n");
+            return 1;
+        }
+        op->kind = OP_FIND;
+        compileSearchPattern(&op->pattern, extraParam);
+        *index += 2;
+    }
+    else {
+        fprintf(stderr, "Unknown flag: %s\n", flag);
+        return -1;
+    }
+    return 0;
 }
 
 int processCommand(int argc, char *argv[]) {
-    if (argc < 3) {
+    selectKernels();
+
+    if (argc == 2 && strcmp(argv[1], "selftest") == 0)
+        return runSelfTest();
+
+    Options options;
+    ResultCache cache;
+    const char *cachePath = NULL;
+    memset(&options, 0, sizeof(options));
+    options.jobs = defaultJobs();
+
+    int firstFile = 1;
+    while (firstFile < argc && argv[firstFile][0] == '-' && argv[firstFile][1] != '\0') {
+        const char *opt = argv[firstFile++];
+        if (strcmp(opt, "--") == 0)
+            break;
+        else if (strcmp(opt, "-a") == 0)
+            options.findAll = 1;
+        else if (strcmp(opt, "-c") == 0)
+            options.findCount = 1;
+        else if (strcmp(opt, "-n") == 0)
+            options.findLines = 1;
+        else if (strcmp(opt, "--uring") == 0)
+            options.uring = 1;
+        else if (strcmp(opt, "--stats") == 0 || strcmp(opt, "--stats=table") == 0)
+            statsBegin(STATS_TABLE);
+        else if (strcmp(opt, "--stats=json") == 0)
+            statsBegin(STATS_JSON);
+        else if (strcmp(opt, "-I") == 0) {
+            if (firstFile >= argc) {
+                usage(argv[0]);
+                return 1;
+            }
+            options.indexPath = argv[firstFile++];
+        }
+        else if (strcmp(opt, "-C") == 0) {
+            if (firstFile >= argc) {
+                usage(argv[0]);
+                return 1;
+            }
+            cachePath = argv[firstFile++];
+        }
+        else if (strcmp(opt, "-j") == 0) {
+            char *endptr;
+            if (firstFile >= argc) {
+                usage(argv[0]);
+                return 1;
+            }
+            long jobs = strtol(argv[firstFile++], &endptr, 10);
+            if (*endptr != '\0' || jobs < 1 || jobs > 4096) {
+                fprintf(stderr, "Invalid job count: %s\n", argv[firstFile - 1]);
+                return 1;
+            }
+            options.jobs = (int)jobs;
+        }
+        else {
+            fprintf(stderr, "Unknown option: %s\n", opt);
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - firstFile < 2) {
         usage(argv[0]);
         return 1;
     }
     
     int flagIndex = -1;
-    for (int i = 1; i < argc; i++) {
+    for (int i = firstFile; i < argc; i++) {
         if (strncmp(argv[i], "xor", 3) == 0 ||
-            strcmp(argv[i], "mask") == 0 ||
+            isMaskFlag(argv[i]) ||
+            strcmp(argv[i], "crc32c") == 0 ||
+            strcmp(argv[i], "hash64") == 0 ||
+            strcmp(argv[i], "hash128") == 0 ||
             strncmp(argv[i], "copy", 4) == 0 ||
-            strcmp(argv[i], "find") == 0) {
+            strcmp(argv[i], "find") == 0 ||
+            strcmp(argv[i], "findre") == 0 ||
+            strcmp(argv[i], "index") == 0) {
             flagIndex = i;
             break;
         }
@@ -209,63 +5003,99 @@ int processCommand(int argc, char *argv[]) {
         return 1;
     }
     
-    int fileCount = flagIndex - 1;
+    int fileCount = flagIndex - firstFile;
     if (fileCount < 1) {
         usage(argv[0]);
         return 1;
     }
     
-    char **fileNames = &argv[1];
-    char *flag = argv[flagIndex];
-    char *extraParam = NULL;
-    
-    if ((strcmp(flag, "mask") == 0) || (strcmp(flag, "find") == 0)) {
-        if (flagIndex + 1 >= argc) {
+    char **fileNames = &argv[firstFile];
+    int stdinCount = 0;
+    for (int i = 0; i < fileCount; i++)
+        stdinCount += isStdin(fileNames[i]);
+    if (stdinCount > 1) {
+        fprintf(stderr, "Standard input (-) may be given only once.\n");
+        return 1;
+    }
+
+    if (strcmp(argv[flagIndex], "index") == 0) {
+        if (flagIndex + 2 != argc) {
             usage(argv[0]);
             return 1;
         }
-        extraParam = argv[flagIndex + 1];
+        return doIndex(fileNames, fileCount, argv[flagIndex + 1]);
     }
-    
-    if (strncmp(flag, "xor", 3) == 0) {
+
+    if (strncmp(argv[flagIndex], "copy", 4) == 0) {
         int N;
-        if (sscanf(&flag[3], "%d", &N) != 1 || N < 2 || N > 6) {
-            fprintf(stderr, "Invalid N for xor operation. N must be in [2,6].\n");
+        char *flag = argv[flagIndex];
+        if (sscanf(&flag[4], "%d", &N) != 1 || N <= 0) {
+            fprintf(stderr, "Invalid copy number: %s\n", &flag[4]);
             return 1;
         }
-        doXor(fileNames, fileCount, N);
-    }
-    else if (strcmp(flag, "mask") == 0) {
-        unsigned int mask;
-        char *endptr;
-        mask = strtol(extraParam, &endptr, 16);
-        if (*endptr != '\0') {
-            fprintf(stderr, "Invalid hex mask: %s\n", extraParam);
+        if (flagIndex + 1 < argc) {
+            fprintf(stderr, "copyN cannot be combined with other operations.\n");
             return 1;
         }
-        
-        doMask(fileNames, fileCount, mask);
+        doCopy(fileNames, fileCount, N, &options);
+        return 0;
     }
-    else if (strncmp(flag, "copy", 4) == 0) {
-        int N;
-        if (sscanf(&flag[4], "%d", &N) != 1 || N <= 0) {
-            fprintf(stderr, "Invalid copy number: %s\n", &flag[4]);
+
+    Operation ops[MAX_OPERATIONS];
+    int opCount = 0;
+    for (int i = flagIndex; i < argc; ) {
+        if (opCount == MAX_OPERATIONS) {
+            fprintf(stderr, "Too many operations (at most %d).\n", MAX_OPERATIONS);
             return 1;
         }
-        doCopy(fileNames, fileCount, N);
+        int rc = parseOperation(argc, argv, &i, &ops[opCount], &options);
+        if (rc < 0)
+            usage(argv[0]);
+        if (rc != 0) {
+            for (int k = 0; k <= opCount; k++)
+                freeOperation(&ops[k]);
+            return 1;
+        }
+        opCount++;
     }
-    else if (strcmp(flag, "find") == 0) {
-        doFind(fileNames, fileCount, extraParam);
+
+    char *skip = NULL;
+    if (options.indexPath && opCount == 1 && ops[0].kind == OP_FIND)
+        skip = indexSkipList(options.indexPath, fileNames, fileCount, &ops[0].pattern);
+
+    if (cachePath && cacheableOperations(ops, opCount)) {
+        int status = cacheOpen(&cache, cachePath);
+        if (status == 0)
+            options.cache = &cache;
+        else if (status == CACHE_FOREIGN)
+            fprintf(stderr, "%s: not a result cache\n", cachePath);
+        else
+            perror(cachePath);
     }
-    else {
-        fprintf(stderr, "Unknown flag: %s\n", flag);
-        usage(argv[0]);
-        return 1;
+
+    int batched = 0;
+    if (!options.cache && !stdinCount && options.uring)
+        batched = uringRun(fileNames, fileCount, ops, opCount, &options, skip);
+    if (batched < 0)
+        batched = 0;
+
+    if (batched < fileCount && opCount == 1 && ops[0].kind != OP_FIND && ops[0].kind != OP_FIND_REGEX) {
+        for (int i = batched; i < fileCount; i++)
+            processFile(ops, opCount, fileNames[i], &options, stdout);
+    } else if (batched < fileCount) {
+        runFiles(fileNames + batched, fileCount - batched, ops, opCount, &options, skip ? skip + batched : NULL);
     }
+    free(skip);
+    if (options.cache)
+        cacheClose(options.cache);
+    for (int k = 0; k < opCount; k++)
+        freeOperation(&ops[k]);
     
     return 0;
 }
 
 int main(int argc, char *argv[]) {
-    return processCommand(argc, argv);
+    int rc = processCommand(argc, argv);
+    statsReport();
+    return rc;
 }
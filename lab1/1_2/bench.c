@@ -0,0 +1,521 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define DEFAULT_WORKDIR "/tmp/sysprog-bench"
+#define DEFAULT_SOURCE "2.c"
+#define GEN_BUFFER_SIZE (1 << 20)
+#define MAX_PRE_ARGS 4
+#define MAX_POST_ARGS 8
+#define NEEDLE "needle-7f3a"
+
+typedef struct {
+    const char *name;
+    int fileCount;
+    unsigned long long minSize;
+    unsigned long long maxSize;
+    int text;
+    unsigned long long lineLength;
+} Corpus;
+
+typedef struct {
+    const char *name;
+    const char *pre[MAX_PRE_ARGS];
+    const char *post[MAX_POST_ARGS];
+    int writesCopies;
+} Mode;
+
+typedef struct {
+    const char *workDir;
+    const char *source;
+    const char *label;
+    const char *cc;
+    const char *corpusFilter;
+    const char *modeFilter;
+    int repeats;
+    int scale;
+    int countSyscalls;
+} BenchConfig;
+
+typedef struct {
+    double seconds;
+    long peakRssKb;
+    long long syscalls;
+    int failed;
+} RunResult;
+
+Corpus corpora[] = {
+    {"huge", 1, 2ULL << 30, 2ULL << 30, 1, 80},
+    {"tiny", 20000, 4 << 10, 64 << 10, 0, 0},
+    {"binary", 64, 4 << 20, 4 << 20, 0, 0},
+    {"longlines", 1, 512ULL << 20, 512ULL << 20, 1, 8 << 20},
+};
+
+Mode modes[] = {
+    {"xor2", {NULL}, {"xor2", NULL}, 0},
+    {"xor6", {NULL}, {"xor6", NULL}, 0},
+    {"mask", {NULL}, {"mask", "80000001", NULL}, 0},
+    {"find", {NULL}, {"find", NEEDLE, NULL}, 0},
+    {"find-count", {"-c", NULL}, {"find", NEEDLE, NULL}, 0},
+    {"fused", {NULL}, {"xor6", "mask", "80000001", "find", NEEDLE, NULL}, 0},
+    {"uring-xor6", {"--uring", NULL}, {"xor6", NULL}, 0},
+    {"copy1", {NULL}, {"copy1", NULL}, 1},
+};
+
+void usage(const char *progName) {
+    fprintf(stderr, "Usage: %s [options]\n", progName);
+    fprintf(stderr, "  -d DIR    work directory for the tool and corpora (default %s)\n", DEFAULT_WORKDIR);
+    fprintf(stderr, "  -s FILE   tool source to build (default %s)\n", DEFAULT_SOURCE);
+    fprintf(stderr, "  -l LABEL  label written into every result, e.g. a git revision\n");
+    fprintf(stderr, "  -r N      timed repetitions per run, best time is reported (default 3)\n");
+    fprintf(stderr, "  -q N      divide every corpus size and file count by N (default 1)\n");
+    fprintf(stderr, "  -c NAME   only run the named corpus (huge, tiny, binary, longlines)\n");
+    fprintf(stderr, "  -m NAME   only run the named mode (xor2, xor6, mask, find, find-count, fused, uring-xor6, copy1)\n");
+    fprintf(stderr, "  -t        count syscalls in an extra ptrace-traced run\n");
+    fprintf(stderr, "Results are printed as one JSON object per line on stdout.\n");
+}
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint64_t nextRandom(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+int writeAll(int fd, const unsigned char *data, size_t len) {
+    while (len > 0) {
+        ssize_t put = write(fd, data, len);
+        if (put < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += put;
+        len -= put;
+    }
+    return 0;
+}
+
+void fillText(unsigned char *buffer, size_t len, uint64_t *seed, unsigned long long lineLength,
+              unsigned long long *column) {
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyz     ";
+    for (size_t i = 0; i < len; i++) {
+        if (++*column >= lineLength) {
+            buffer[i] = '\n';
+            *column = 0;
+        } else {
+            buffer[i] = letters[nextRandom(seed) % (sizeof(letters) - 1)];
+        }
+    }
+    if (len > 4 * sizeof(NEEDLE) && nextRandom(seed) % 4 == 0) {
+        size_t at = nextRandom(seed) % (len - sizeof(NEEDLE));
+        memcpy(buffer + at, NEEDLE, sizeof(NEEDLE) - 1);
+    }
+}
+
+void fillBinary(unsigned char *buffer, size_t len, uint64_t *seed) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t r = nextRandom(seed);
+        memcpy(buffer + i, &r, 8);
+    }
+    for (; i < len; i++)
+        buffer[i] = (unsigned char)nextRandom(seed);
+}
+
+int generateFile(const char *path, unsigned long long size, const Corpus *corpus, uint64_t *seed,
+                 unsigned char *buffer) {
+    unsigned long long column = 0;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    while (size > 0) {
+        size_t len = size < GEN_BUFFER_SIZE ? size : GEN_BUFFER_SIZE;
+        if (corpus->text)
+            fillText(buffer, len, seed, corpus->lineLength, &column);
+        else
+            fillBinary(buffer, len, seed);
+        if (writeAll(fd, buffer, len) != 0) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+        size -= len;
+    }
+    close(fd);
+    return 0;
+}
+
+unsigned long long corpusFileSize(const BenchConfig *config, const Corpus *corpus, uint64_t *sizeSeed) {
+    unsigned long long size = corpus->minSize / config->scale;
+    if (corpus->maxSize > corpus->minSize)
+        size += nextRandom(sizeSeed) % ((corpus->maxSize - corpus->minSize) / config->scale + 1);
+    return size;
+}
+
+int corpusFileCount(const BenchConfig *config, const Corpus *corpus) {
+    int files = corpus->fileCount / config->scale;
+    return files < 1 ? 1 : files;
+}
+
+char **corpusFiles(const BenchConfig *config, const Corpus *corpus, int *count, unsigned long long *bytes) {
+    int files = corpusFileCount(config, corpus);
+    char **names = calloc(files, sizeof(char *));
+    if (!names)
+        return NULL;
+
+    uint64_t sizeSeed = 0x9E3779B97F4A7C15ULL;
+    *bytes = 0;
+    for (int i = 0; i < files; i++) {
+        unsigned long long size = corpusFileSize(config, corpus, &sizeSeed);
+        if (asprintf(&names[i], "%s/%s/f%06d", config->workDir, corpus->name, i) < 0) {
+            names[i] = NULL;
+            break;
+        }
+        *bytes += size;
+    }
+    *count = files;
+    return names;
+}
+
+int prepareCorpus(const BenchConfig *config, const Corpus *corpus) {
+    char dir[4096];
+    char stamp[4200];
+    char expected[256];
+    char found[256] = "";
+
+    snprintf(dir, sizeof(dir), "%s/%s", config->workDir, corpus->name);
+    snprintf(stamp, sizeof(stamp), "%s/.complete", dir);
+    snprintf(expected, sizeof(expected), "v1 scale=%d\n", config->scale);
+
+    FILE *fp = fopen(stamp, "r");
+    if (fp) {
+        size_t got = fread(found, 1, sizeof(found) - 1, fp);
+        found[got] = '\0';
+        fclose(fp);
+        if (strcmp(found, expected) == 0)
+            return 0;
+    }
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+    fprintf(stderr, "generating corpus %s...\n", corpus->name);
+
+    unsigned char *buffer = malloc(GEN_BUFFER_SIZE);
+    if (!buffer) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+    uint64_t seed = 0x2545F4914F6CDD1DULL ^ (uint64_t)corpus->fileCount;
+    uint64_t sizeSeed = 0x9E3779B97F4A7C15ULL;
+    int files = corpusFileCount(config, corpus);
+    for (int i = 0; i < files; i++) {
+        char path[4200];
+        unsigned long long size = corpusFileSize(config, corpus, &sizeSeed);
+        snprintf(path, sizeof(path), "%s/f%06d", dir, i);
+        if (generateFile(path, size, corpus, &seed, buffer) != 0) {
+            free(buffer);
+            return -1;
+        }
+    }
+    free(buffer);
+
+    fp = fopen(stamp, "w");
+    if (!fp) {
+        perror(stamp);
+        return -1;
+    }
+    fputs(expected, fp);
+    fclose(fp);
+    return 0;
+}
+
+int buildTool(const BenchConfig *config, const char *toolPath) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        execlp(config->cc, config->cc, "-O2", "-pthread", "-o", toolPath, config->source, (char *)NULL);
+        perror(config->cc);
+        _exit(127);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Failed to build %s\n", config->source);
+        return -1;
+    }
+    return 0;
+}
+
+char **buildArgv(const char *toolPath, const Mode *mode, char **files, int fileCount) {
+    int pre = 0;
+    int post = 0;
+    while (pre < MAX_PRE_ARGS && mode->pre[pre])
+        pre++;
+    while (post < MAX_POST_ARGS && mode->post[post])
+        post++;
+
+    char **argv = calloc(1 + pre + fileCount + post + 1, sizeof(char *));
+    if (!argv)
+        return NULL;
+    int n = 0;
+    argv[n++] = (char *)toolPath;
+    for (int i = 0; i < pre; i++)
+        argv[n++] = (char *)mode->pre[i];
+    for (int i = 0; i < fileCount; i++)
+        argv[n++] = files[i];
+    for (int i = 0; i < post; i++)
+        argv[n++] = (char *)mode->post[i];
+    argv[n] = NULL;
+    return argv;
+}
+
+void redirectOutput(void) {
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) {
+        dup2(null, STDOUT_FILENO);
+        close(null);
+    }
+}
+
+RunResult runTimed(char **argv) {
+    RunResult result = {0, 0, -1, 0};
+    struct rusage usage;
+    int status;
+    double start = now();
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        result.failed = 1;
+        return result;
+    }
+    if (pid == 0) {
+        redirectOutput();
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    if (wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        result.failed = 1;
+    result.seconds = now() - start;
+    result.peakRssKb = usage.ru_maxrss;
+    return result;
+}
+
+long long countSyscalls(char **argv) {
+    long long stops = 0;
+    int status;
+
+    pid_t pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0) {
+        redirectOutput();
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0)
+            _exit(127);
+        raise(SIGSTOP);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status))
+        return -1;
+    ptrace(PTRACE_SETOPTIONS, pid, NULL,
+           (void *)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK |
+                          PTRACE_O_TRACEVFORK | PTRACE_O_EXITKILL));
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+    for (;;) {
+        pid_t child = waitpid(-1, &status, __WALL);
+        if (child < 0)
+            break;
+        if (WIFEXITED(status) || WIFSIGNALED(status))
+            continue;
+        int signal = 0;
+        if (WIFSTOPPED(status)) {
+            int stop = WSTOPSIG(status);
+            if (stop == (SIGTRAP | 0x80))
+                stops++;
+            else if (stop != SIGTRAP && stop != SIGSTOP)
+                signal = stop;
+        }
+        ptrace(PTRACE_SYSCALL, child, NULL, (void *)(long)signal);
+    }
+    return stops / 2;
+}
+
+void removeCopies(char **files, int fileCount) {
+    for (int i = 0; i < fileCount; i++) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s_copy1", files[i]);
+        unlink(path);
+    }
+}
+
+void jsonString(const char *text) {
+    putchar('"');
+    for (const char *c = text; *c; c++) {
+        if (*c == '"' || *c == '\\')
+            putchar('\\');
+        if ((unsigned char)*c < 0x20)
+            printf("\\u%04x", *c);
+        else
+            putchar(*c);
+    }
+    putchar('"');
+}
+
+void report(const BenchConfig *config, const Corpus *corpus, const Mode *mode, int fileCount,
+            unsigned long long bytes, const RunResult *result) {
+    double gbps = result->seconds > 0 ? bytes / result->seconds / 1e9 : 0;
+    double filesPerSecond = result->seconds > 0 ? fileCount / result->seconds : 0;
+
+    printf("{\"label\":");
+    jsonString(config->label);
+    printf(",\"corpus\":\"%s\",\"mode\":\"%s\",\"files\":%d,\"bytes\":%llu,"
+           "\"seconds\":%.6f,\"gb_per_s\":%.3f,\"files_per_s\":%.1f,\"peak_rss_kb\":%ld,",
+           corpus->name, mode->name, fileCount, bytes, result->seconds, gbps, filesPerSecond, result->peakRssKb);
+    if (result->syscalls >= 0)
+        printf("\"syscalls\":%lld,\"syscalls_per_file\":%.2f,", result->syscalls, (double)result->syscalls / fileCount);
+    else
+        printf("\"syscalls\":null,\"syscalls_per_file\":null,");
+    printf("\"ok\":%s}\n", result->failed ? "false" : "true");
+    fflush(stdout);
+
+    fprintf(stderr, "%-10s %-11s %8.3f s %8.3f GB/s %10.1f files/s %8ld KB", corpus->name, mode->name,
+            result->seconds, gbps, filesPerSecond, result->peakRssKb);
+    if (result->syscalls >= 0)
+        fprintf(stderr, " %10lld syscalls", result->syscalls);
+    fprintf(stderr, "%s\n", result->failed ? "  FAILED" : "");
+}
+
+int runCorpus(const BenchConfig *config, const Corpus *corpus, const char *toolPath) {
+    int fileCount;
+    unsigned long long bytes;
+
+    if (prepareCorpus(config, corpus) != 0)
+        return -1;
+    char **files = corpusFiles(config, corpus, &fileCount, &bytes);
+    if (!files) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        const Mode *mode = &modes[m];
+        if (config->modeFilter && strcmp(config->modeFilter, mode->name) != 0)
+            continue;
+        char **argv = buildArgv(toolPath, mode, files, fileCount);
+        if (!argv)
+            break;
+
+        RunResult best = runTimed(argv);
+        if (mode->writesCopies)
+            removeCopies(files, fileCount);
+        for (int r = 0; r < config->repeats; r++) {
+            RunResult run = runTimed(argv);
+            if (mode->writesCopies)
+                removeCopies(files, fileCount);
+            if (r == 0 || run.seconds < best.seconds)
+                best.seconds = run.seconds;
+            if (run.peakRssKb > best.peakRssKb)
+                best.peakRssKb = run.peakRssKb;
+            best.failed |= run.failed;
+        }
+        if (config->countSyscalls) {
+            best.syscalls = countSyscalls(argv);
+            if (mode->writesCopies)
+                removeCopies(files, fileCount);
+        }
+        report(config, corpus, mode, fileCount, bytes, &best);
+        free(argv);
+    }
+
+    for (int i = 0; i < fileCount; i++)
+        free(files[i]);
+    free(files);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    BenchConfig config = {DEFAULT_WORKDIR, DEFAULT_SOURCE, "", NULL, NULL, NULL, 3, 1, 0};
+    int opt;
+
+    config.cc = getenv("CC") ? getenv("CC") : "cc";
+    while ((opt = getopt(argc, argv, "d:s:l:r:q:c:m:th")) != -1) {
+        switch (opt) {
+        case 'd':
+            config.workDir = optarg;
+            break;
+        case 's':
+            config.source = optarg;
+            break;
+        case 'l':
+            config.label = optarg;
+            break;
+        case 'r':
+            config.repeats = atoi(optarg);
+            break;
+        case 'q':
+            config.scale = atoi(optarg);
+            break;
+        case 'c':
+            config.corpusFilter = optarg;
+            break;
+        case 'm':
+            config.modeFilter = optarg;
+            break;
+        case 't':
+            config.countSyscalls = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (config.repeats < 1 || config.scale < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (mkdir(config.workDir, 0755) != 0 && errno != EEXIST) {
+        perror(config.workDir);
+        return 1;
+    }
+    char toolPath[4096];
+    snprintf(toolPath, sizeof(toolPath), "%s/tool", config.workDir);
+    if (buildTool(&config, toolPath) != 0)
+        return 1;
+
+    int failures = 0;
+    for (size_t c = 0; c < sizeof(corpora) / sizeof(corpora[0]); c++) {
+        if (config.corpusFilter && strcmp(config.corpusFilter, corpora[c].name) != 0)
+            continue;
+        if (runCorpus(&config, &corpora[c], toolPath) != 0)
+            failures++;
+    }
+    return failures ? 1 : 0;
+}
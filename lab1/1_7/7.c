@@ -1,6 +1,9 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -9,10 +12,320 @@
 #include <time.h>
 #include <pwd.h>
 #include <grp.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
 
-#define MAX_FILES 1024
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#define st_ctim st_ctimespec
+#endif
 
-void printPermissions(mode_t mode) {
+#define DIRENT_BUFFER_SIZE (256 * 1024)
+#define OUTPUT_BUFFER_SIZE (256 * 1024)
+#define READDIR_BATCH 4096
+#define NAME_CACHE_INITIAL 64
+#define TIME_CACHE_SIZE 256
+#define MAX_JOBS 4096
+#define WALK_BUFFER_LIMIT (64 << 20)
+#define NSS_BUFFER_SIZE 4096
+#define NSS_BUFFER_MAX (1 << 20)
+#define URING_WINDOW 128
+#define URING_MIN_ENTRIES 32
+#define SORT_INSERTION_MAX 32
+#define SNAPSHOT_MAGIC "LSSNAP01"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_INITIAL_SLOTS 1024
+#define SNAPSHOT_INITIAL_DATA (1 << 20)
+#define SNAPSHOT_MIN_GARBAGE (4 << 20)
+#define SNAPSHOT_RACY_SECONDS 2
+#define SNAPSHOT_FOREIGN (-2)
+#define WATCH_SETTLE_MS 100
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_MODIFY | \
+                      IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+#define STATX_FIELDS (STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID | STATX_SIZE | \
+                      STATX_BLOCKS | STATX_MTIME)
+
+#ifdef __linux__
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+typedef struct {
+    uint64_t name;
+    uint64_t size;
+    uint64_t blocks;
+    int64_t mtime;
+    uint32_t mtimeNsec;
+    uint32_t mode;
+    uint32_t nlink;
+    uint32_t uid;
+    uint32_t gid;
+    int statError;
+} Entry;
+
+typedef struct {
+    uint32_t id;
+    int used;
+    char *name;
+} NameSlot;
+
+typedef struct {
+    NameSlot *slots;
+    size_t capacity;
+    size_t count;
+    int groups;
+} NameCache;
+
+typedef struct {
+    int64_t minute;
+    char text[20];
+} TimeSlot;
+
+typedef struct {
+    Entry *entries;
+    size_t count;
+    size_t capacity;
+    char *names;
+    size_t namesSize;
+    size_t namesCapacity;
+    long long totalBlocks;
+} Listing;
+
+typedef struct {
+    uint64_t key;
+    size_t index;
+} SortRecord;
+
+typedef struct {
+    FILE *out;
+    char *data;
+    size_t len;
+    size_t capacity;
+} OutBuffer;
+
+typedef struct {
+    int fd;
+    char *buffer;
+    DIR *dir;
+} DirReader;
+
+typedef struct {
+    char **paths;
+    int count;
+    int capacity;
+} Subdirs;
+
+typedef struct DirNode {
+    char *path;
+    char *output;
+    size_t outputLen;
+    struct DirNode **children;
+    int childCount;
+    int done;
+} DirNode;
+
+typedef struct {
+    DirNode **items;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+    pthread_mutex_t lock;
+} DirDeque;
+
+typedef struct {
+    DirDeque *deques;
+    int workerCount;
+    long queued;
+    long pending;
+    int idle;
+    DirNode *printing;
+    size_t buffered;
+    size_t bufferLimit;
+    int throttled;
+    pthread_mutex_t lock;
+    pthread_cond_t workCond;
+    pthread_cond_t readyCond;
+    pthread_cond_t drainCond;
+} Walker;
+
+typedef struct {
+    Walker *walker;
+    int id;
+} WalkWorker;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t entrySize;
+    uint64_t capacity;
+    uint64_t used;
+    uint64_t dataSize;
+    uint64_t garbage;
+} SnapshotHeader;
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtimeSec;
+    int64_t ctimeSec;
+    uint32_t mtimeNsec;
+    uint32_t ctimeNsec;
+    uint64_t offset;
+    uint64_t count;
+    uint64_t namesSize;
+    int64_t totalBlocks;
+} SnapshotSlot;
+
+typedef struct {
+    char *path;
+    int fd;
+    char *map;
+    size_t mapSize;
+    SnapshotHeader *header;
+    SnapshotSlot *slots;
+    pthread_mutex_t lock;
+} Snapshot;
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtimeSec;
+    int64_t ctimeSec;
+    uint32_t mtimeNsec;
+    uint32_t ctimeNsec;
+} DirStamp;
+
+#ifdef __linux__
+typedef struct {
+    int fd;
+    int recursive;
+    char **paths;
+    int *parents;
+    char *dirty;
+    int capacity;
+} Watcher;
+#endif
+
+#ifdef HAVE_IO_URING
+typedef struct {
+    int fd;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    size_t sqesSize;
+    unsigned queued;
+} Ring;
+#endif
+
+enum {
+    SORT_NAME,
+    SORT_SIZE,
+    SORT_TIME,
+    SORT_EXTENSION
+};
+
+int uringStat = 0;
+int sortMode = SORT_NAME;
+int streamMode = 0;
+Snapshot *snapshot = NULL;
+
+/*
+ * Lines are assembled in one large buffer and handed to stdio in big
+ * writes; if the buffer cannot be allocated every piece is written
+ * straight through instead.
+ */
+void outInit(OutBuffer *b, FILE *out) {
+    b->out = out;
+    b->len = 0;
+    b->data = malloc(OUTPUT_BUFFER_SIZE);
+    b->capacity = b->data ? OUTPUT_BUFFER_SIZE : 0;
+}
+
+void outFlush(OutBuffer *b) {
+    if (b->len > 0)
+        fwrite(b->data, 1, b->len, b->out);
+    b->len = 0;
+}
+
+void outFree(OutBuffer *b) {
+    outFlush(b);
+    free(b->data);
+    b->data = NULL;
+    b->capacity = 0;
+}
+
+void outBytes(OutBuffer *b, const char *s, size_t n) {
+    if (b->len + n > b->capacity) {
+        outFlush(b);
+        if (n > b->capacity) {
+            fwrite(s, 1, n, b->out);
+            return;
+        }
+    }
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+}
+
+void outString(OutBuffer *b, const char *s) {
+    outBytes(b, s, strlen(s));
+}
+
+void outSpaces(OutBuffer *b, size_t n) {
+    static const char spaces[] = "                ";
+    while (n > 0) {
+        size_t k = n < sizeof(spaces) - 1 ? n : sizeof(spaces) - 1;
+        outBytes(b, spaces, k);
+        n -= k;
+    }
+}
+
+/* Same as "%-*s": left aligned, never truncated. */
+void outPadded(OutBuffer *b, const char *s, size_t width) {
+    size_t len = strlen(s);
+    outBytes(b, s, len);
+    if (len < width)
+        outSpaces(b, width - len);
+}
+
+/* Same as "%*llu": right aligned. */
+void outNumber(OutBuffer *b, uint64_t value, size_t width) {
+    char digits[24];
+    size_t len = 0;
+    do {
+        digits[sizeof(digits) - 1 - len++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    if (len < width)
+        outSpaces(b, width - len);
+    outBytes(b, digits + sizeof(digits) - len, len);
+}
+
+void printPermissions(OutBuffer *out, mode_t mode) {
     char perms[11] = "----------";
     
     if (S_ISDIR(mode)) perms[0] = 'd';
@@ -31,95 +344,1712 @@ void printPermissions(mode_t mode) {
     perms[7] = (mode & S_IROTH) ? 'r' : '-';
     perms[8] = (mode & S_IWOTH) ? 'w' : '-';
     perms[9] = (mode & S_IXOTH) ? 'x' : '-';
-    
-    printf("%s ", perms);
+    perms[10] = ' ';
+
+    outBytes(out, perms, sizeof(perms));
+}
+
+__thread NameCache userNames = {NULL, 0, 0, 0};
+__thread NameCache groupNames = {NULL, 0, 0, 1};
+__thread TimeSlot timeCache[TIME_CACHE_SIZE];
+__thread int timeCacheReady = 0;
+
+size_t nameSlotIndex(const NameCache *cache, uint32_t id) {
+    size_t mask = cache->capacity - 1;
+    size_t i = (size_t)((id * 2654435761u) & mask);
+    while (cache->slots[i].used && cache->slots[i].id != id)
+        i = (i + 1) & mask;
+    return i;
+}
+
+int nameCacheGrow(NameCache *cache) {
+    size_t oldCapacity = cache->capacity;
+    NameSlot *old = cache->slots;
+    size_t capacity = oldCapacity ? oldCapacity * 2 : NAME_CACHE_INITIAL;
+    NameSlot *slots = calloc(capacity, sizeof(NameSlot));
+
+    if (!slots)
+        return -1;
+    cache->slots = slots;
+    cache->capacity = capacity;
+    for (size_t i = 0; i < oldCapacity; i++) {
+        if (old[i].used)
+            cache->slots[nameSlotIndex(cache, old[i].id)] = old[i];
+    }
+    free(old);
+    return 0;
 }
 
-void printMetadata(const struct stat *fileStat, const char *fileName) {
-    struct passwd *pw = getpwuid(fileStat->st_uid);
-    struct group *gr = getgrgid(fileStat->st_gid);
-    char timeStr[20];
+/*
+ * Resolves a uid or gid through getpwuid_r/getgrgid_r at most once per id.
+ * Ids without a name are cached too (as NULL) so that directories full of
+ * orphaned owners do not hit NSS for every entry.
+ */
+const char *cachedName(NameCache *cache, uint32_t id) {
+    if (cache->count * 2 >= cache->capacity && nameCacheGrow(cache) != 0)
+        return NULL;
 
-    printPermissions(fileStat->st_mode);
+    NameSlot *slot = &cache->slots[nameSlotIndex(cache, id)];
+    if (slot->used)
+        return slot->name;
 
-    printf("%2hu ", fileStat->st_nlink);
-    printf("%-8s %-8s ", pw ? pw->pw_name : "?", gr ? gr->gr_name : "?");
-    printf("%8lld ", fileStat->st_size);
+    char stackBuffer[NSS_BUFFER_SIZE];
+    char *buffer = stackBuffer;
+    size_t bufferSize = sizeof(stackBuffer);
+    const char *name = NULL;
+    int rc;
+    for (;;) {
+        if (cache->groups) {
+            struct group gr;
+            struct group *found = NULL;
+            rc = getgrgid_r(id, &gr, buffer, bufferSize, &found);
+            name = found ? found->gr_name : NULL;
+        } else {
+            struct passwd pw;
+            struct passwd *found = NULL;
+            rc = getpwuid_r(id, &pw, buffer, bufferSize, &found);
+            name = found ? found->pw_name : NULL;
+        }
+        if (rc != ERANGE || bufferSize >= NSS_BUFFER_MAX)
+            break;
+        if (buffer != stackBuffer)
+            free(buffer);
+        bufferSize *= 2;
+        buffer = malloc(bufferSize);
+        if (!buffer)
+            return NULL;
+    }
+    slot->id = id;
+    slot->used = 1;
+    slot->name = name ? strdup(name) : NULL;
+    cache->count++;
+    if (buffer != stackBuffer)
+        free(buffer);
+    return slot->name;
+}
+
+void nameCacheFree(NameCache *cache) {
+    for (size_t i = 0; i < cache->capacity; i++)
+        free(cache->slots[i].name);
+    free(cache->slots);
+    cache->slots = NULL;
+    cache->capacity = cache->count = 0;
+}
 
-    struct tm *tmInfo = localtime(&fileStat->st_mtime);
-    strftime(timeStr, sizeof(timeStr), "%b %d %H:%M", tmInfo);
-    printf("%s ", timeStr);
+/*
+ * The printed time has minute resolution, so localtime/strftime only run
+ * for a minute that is not already in the small direct-mapped cache.
+ */
+const char *formatTime(int64_t mtime) {
+    int64_t minute = mtime >= 0 ? mtime / 60 : (mtime - 59) / 60;
+    TimeSlot *slot = &timeCache[(uint64_t)minute % TIME_CACHE_SIZE];
 
-    printf("%s\n", fileName);
+    if (!timeCacheReady) {
+        for (int i = 0; i < TIME_CACHE_SIZE; i++)
+            timeCache[i].minute = INT64_MIN;
+        timeCacheReady = 1;
+    }
+    if (slot->minute != minute) {
+        time_t t = (time_t)mtime;
+        struct tm tmInfo;
+        slot->text[0] = '\0';
+        if (localtime_r(&t, &tmInfo))
+            strftime(slot->text, sizeof(slot->text), "%b %d %H:%M", &tmInfo);
+        slot->minute = minute;
+    }
+    return slot->text;
 }
 
-int compareFilenames(const void *a, const void *b) {
-    return strcmp(*(const char **)a, *(const char **)b);
+void printMetadata(OutBuffer *out, const Entry *entry, const char *fileName) {
+    const char *user = cachedName(&userNames, entry->uid);
+    const char *group = cachedName(&groupNames, entry->gid);
+
+    printPermissions(out, entry->mode);
+
+    outNumber(out, entry->nlink, 2);
+    outBytes(out, " ", 1);
+    outPadded(out, user ? user : "?", 8);
+    outBytes(out, " ", 1);
+    outPadded(out, group ? group : "?", 8);
+    outBytes(out, " ", 1);
+    outNumber(out, entry->size, 8);
+    outBytes(out, " ", 1);
+    outString(out, formatTime(entry->mtime));
+    outBytes(out, " ", 1);
+
+    outString(out, fileName);
+    outBytes(out, "\n", 1);
 }
 
-void listDirectory(const char *path) {
-    DIR *dir;
-    struct dirent *entry;
-    struct stat fileStat;
-    char fullPath[4096];
-    long totalBlocks = 0;
-    char *fileNames[MAX_FILES];
-    int count = 0;
-
-    if ((dir = opendir(path)) == NULL) {
-        fprintf(stderr, "Error opening directory");
+void listingInit(Listing *listing) {
+    memset(listing, 0, sizeof(*listing));
+}
+
+void listingFree(Listing *listing) {
+    free(listing->entries);
+    free(listing->names);
+    listingInit(listing);
+}
+
+/*
+ * Appends one name to the arena and reserves its record.  Names are kept
+ * as offsets so that the arena may move when it grows.
+ */
+int listingAdd(Listing *listing, const char *name, size_t len) {
+    if (listing->count == listing->capacity) {
+        size_t capacity = listing->capacity ? listing->capacity * 2 : 256;
+        Entry *grown = realloc(listing->entries, capacity * sizeof(Entry));
+        if (!grown)
+            return -1;
+        listing->entries = grown;
+        listing->capacity = capacity;
+    }
+    if (listing->namesSize + len + 1 > listing->namesCapacity) {
+        size_t capacity = listing->namesCapacity ? listing->namesCapacity : 16384;
+        while (listing->namesSize + len + 1 > capacity)
+            capacity *= 2;
+        char *grown = realloc(listing->names, capacity);
+        if (!grown)
+            return -1;
+        listing->names = grown;
+        listing->namesCapacity = capacity;
+    }
+
+    Entry *entry = &listing->entries[listing->count++];
+    memset(entry, 0, sizeof(*entry));
+    entry->name = listing->namesSize;
+    memcpy(listing->names + listing->namesSize, name, len + 1);
+    listing->namesSize += len + 1;
+    return 0;
+}
+
+const char *entryName(const Listing *listing, const Entry *entry) {
+    return listing->names + entry->name;
+}
+
+#ifdef __linux__
+int dirReaderOpen(DirReader *reader, int dirFd) {
+    reader->fd = dirFd;
+    reader->dir = NULL;
+    reader->buffer = malloc(DIRENT_BUFFER_SIZE);
+    return reader->buffer ? 0 : -1;
+}
+
+void dirReaderClose(DirReader *reader) {
+    free(reader->buffer);
+    reader->buffer = NULL;
+}
+
+/*
+ * Appends the names returned by one getdents64 call.  Returns how many
+ * were added, 0 at the end of the directory and -1 on error.
+ */
+long dirReaderNext(DirReader *reader, Listing *listing) {
+    long got = syscall(SYS_getdents64, reader->fd, reader->buffer, DIRENT_BUFFER_SIZE);
+    long added = 0;
+
+    if (got <= 0)
+        return got;
+    for (long offset = 0; offset < got; added++) {
+        struct linux_dirent64 *d = (struct linux_dirent64 *)(reader->buffer + offset);
+        offset += d->d_reclen;
+        if (listingAdd(listing, d->d_name, strlen(d->d_name)) != 0)
+            return -1;
+    }
+    return added;
+}
+
+void fillEntry(Entry *entry, const struct statx *stx) {
+    entry->mode = stx->stx_mode;
+    entry->nlink = stx->stx_nlink;
+    entry->uid = stx->stx_uid;
+    entry->gid = stx->stx_gid;
+    entry->size = stx->stx_size;
+    entry->blocks = stx->stx_blocks;
+    entry->mtime = stx->stx_mtime.tv_sec;
+    entry->mtimeNsec = stx->stx_mtime.tv_nsec;
+}
+
+int statEntry(int dirFd, const char *name, Entry *entry) {
+    struct statx stx;
+
+    if (statx(dirFd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, STATX_FIELDS, &stx) != 0)
+        return -1;
+    fillEntry(entry, &stx);
+    return 0;
+}
+
+#ifdef HAVE_IO_URING
+__thread Ring statRing;
+__thread int statRingState = 0;
+
+int ringInit(Ring *r, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return -1;
+
+    r->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cqRingSize > r->sqRingSize)
+            r->sqRingSize = r->cqRingSize;
+        r->cqRingSize = r->sqRingSize;
+    }
+    r->sqRing = mmap(NULL, r->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sqRing == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cqRing = r->sqRing;
+    } else {
+        r->cqRing = mmap(NULL, r->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cqRing == MAP_FAILED) {
+            munmap(r->sqRing, r->sqRingSize);
+            close(r->fd);
+            return -1;
+        }
+    }
+    r->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        if (r->cqRing != r->sqRing)
+            munmap(r->cqRing, r->cqRingSize);
+        munmap(r->sqRing, r->sqRingSize);
+        close(r->fd);
+        return -1;
+    }
+
+    char *sq = r->sqRing;
+    char *cq = r->cqRing;
+    r->sqHead = (unsigned *)(sq + p.sq_off.head);
+    r->sqTail = (unsigned *)(sq + p.sq_off.tail);
+    r->sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sqArray = (unsigned *)(sq + p.sq_off.array);
+    r->cqHead = (unsigned *)(cq + p.cq_off.head);
+    r->cqTail = (unsigned *)(cq + p.cq_off.tail);
+    r->cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+void ringClose(Ring *r) {
+    munmap(r->sqes, r->sqesSize);
+    if (r->cqRing != r->sqRing)
+        munmap(r->cqRing, r->cqRingSize);
+    munmap(r->sqRing, r->sqRingSize);
+    close(r->fd);
+}
+
+struct io_uring_sqe *ringGetSqe(Ring *r, int opcode, int fd, const void *addr, unsigned len,
+                                unsigned long long offset, unsigned long long userData) {
+    unsigned tail = *r->sqTail;
+    unsigned index = tail & *r->sqMask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = userData;
+    r->sqArray[index] = index;
+    __atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+    r->queued++;
+    return sqe;
+}
+
+int ringSubmitAndWait(Ring *r, unsigned waitFor) {
+    for (;;) {
+        long ret = syscall(__NR_io_uring_enter, r->fd, r->queued, waitFor, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        r->queued -= ret;
+        return 0;
+    }
+}
+
+int ringNextCqe(Ring *r, struct io_uring_cqe *cqe) {
+    unsigned head = *r->cqHead;
+    if (head == __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE))
+        return 0;
+    *cqe = r->cqes[head & *r->cqMask];
+    __atomic_store_n(r->cqHead, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Each thread sets up its ring on first use; -1 remembers that it failed. */
+Ring *statRingGet(void) {
+    if (statRingState == 0)
+        statRingState = ringInit(&statRing, URING_WINDOW) == 0 ? 1 : -1;
+    return statRingState > 0 ? &statRing : NULL;
+}
+
+void statRingClose(void) {
+    if (statRingState > 0)
+        ringClose(&statRing);
+    statRingState = 0;
+}
+
+/*
+ * Keeps up to URING_WINDOW IORING_OP_STATX requests in flight and fills
+ * each record as its completion arrives, in whatever order the filesystem
+ * answers.  Failed entries keep their error so that the caller can retry
+ * them synchronously; a kernel without STATX support disables the ring
+ * for the rest of the run.
+ */
+int statEntriesUring(int dirFd, Listing *listing) {
+    Ring *ring = statRingGet();
+    struct statx buffers[URING_WINDOW];
+    size_t slotEntry[URING_WINDOW];
+    int freeSlots[URING_WINDOW];
+    int freeCount = URING_WINDOW;
+    size_t next = 0;
+    size_t inFlight = 0;
+
+    if (!ring)
+        return -1;
+    for (int k = 0; k < URING_WINDOW; k++)
+        freeSlots[k] = k;
+
+    while (next < listing->count || inFlight > 0) {
+        while (next < listing->count && freeCount > 0) {
+            int slot = freeSlots[--freeCount];
+            Entry *entry = &listing->entries[next];
+            slotEntry[slot] = next++;
+            ringGetSqe(ring, IORING_OP_STATX, dirFd, entryName(listing, entry), STATX_FIELDS,
+                       (unsigned long)&buffers[slot], slot)
+                ->statx_flags = AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT;
+            inFlight++;
+        }
+        if (ringSubmitAndWait(ring, 1) != 0) {
+            ringClose(ring);
+            statRingState = -1;
+            return -1;
+        }
+
+        struct io_uring_cqe cqe;
+        while (ringNextCqe(ring, &cqe)) {
+            int slot = (int)cqe.user_data;
+            Entry *entry = &listing->entries[slotEntry[slot]];
+            if (cqe.res == 0)
+                fillEntry(entry, &buffers[slot]);
+            else
+                entry->statError = -cqe.res;
+            if (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP)
+                statRingState = -2;
+            freeSlots[freeCount++] = slot;
+            inFlight--;
+        }
+    }
+    if (statRingState == -2) {
+        ringClose(ring);
+        statRingState = -1;
+    }
+    return 0;
+}
+#endif
+#else
+int dirReaderOpen(DirReader *reader, int dirFd) {
+    reader->fd = dup(dirFd);
+    reader->buffer = NULL;
+    reader->dir = reader->fd >= 0 ? fdopendir(reader->fd) : NULL;
+    if (!reader->dir) {
+        if (reader->fd >= 0)
+            close(reader->fd);
+        return -1;
+    }
+    return 0;
+}
+
+void dirReaderClose(DirReader *reader) {
+    closedir(reader->dir);
+    reader->dir = NULL;
+}
+
+long dirReaderNext(DirReader *reader, Listing *listing) {
+    struct dirent *d;
+    long added = 0;
+
+    errno = 0;
+    while (added < READDIR_BATCH && (d = readdir(reader->dir)) != NULL) {
+        if (listingAdd(listing, d->d_name, strlen(d->d_name)) != 0)
+            return -1;
+        added++;
+    }
+    return added == 0 && errno != 0 ? -1 : added;
+}
+
+int statEntry(int dirFd, const char *name, Entry *entry) {
+    struct stat st;
+
+    if (fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return -1;
+    entry->mode = st.st_mode;
+    entry->nlink = st.st_nlink;
+    entry->uid = st.st_uid;
+    entry->gid = st.st_gid;
+    entry->size = st.st_size;
+    entry->blocks = st.st_blocks;
+    entry->mtime = st.st_mtime;
+    entry->mtimeNsec = st.st_mtim.tv_nsec;
+    return 0;
+}
+#endif
+
+int readEntries(int dirFd, Listing *listing) {
+    DirReader reader;
+    long got;
+
+    if (dirReaderOpen(&reader, dirFd) != 0)
+        return -1;
+    while ((got = dirReaderNext(&reader, listing)) > 0)
+        ;
+    dirReaderClose(&reader);
+    return got < 0 ? -1 : 0;
+}
+
+void statEntries(int dirFd, Listing *listing) {
+    int batched = 0;
+
+#ifdef HAVE_IO_URING
+    batched = uringStat && listing->count >= URING_MIN_ENTRIES && statEntriesUring(dirFd, listing) == 0;
+#endif
+    for (size_t i = 0; i < listing->count; i++) {
+        Entry *entry = &listing->entries[i];
+        if ((!batched || entry->statError) && statEntry(dirFd, entryName(listing, entry), entry) != 0) {
+            entry->statError = errno;
+            continue;
+        }
+        entry->statError = 0;
+        listing->totalBlocks += entry->blocks;
+    }
+}
+
+/*
+ * Listing snapshot (-C FILE): a header, an open-addressing table of
+ * directories keyed by device and inode, and a heap of blobs, each one
+ * directory's entries followed by its names.  A directory whose own
+ * mtime and ctime are unchanged has had no entry added, removed or
+ * renamed, so its listing is taken from the blob instead of being read
+ * and stat'ed again; only changed directories are rescanned.  Replaced
+ * blobs are left behind as garbage until the file is rebuilt.
+ */
+size_t snapshotDataStart(uint64_t capacity) {
+    return sizeof(SnapshotHeader) + capacity * sizeof(SnapshotSlot);
+}
+
+size_t snapshotBlobSize(uint64_t count, uint64_t namesSize) {
+    return (count * sizeof(Entry) + namesSize + 7) & ~(size_t)7;
+}
+
+int snapshotMap(Snapshot *s, size_t mapSize) {
+    if (ftruncate(s->fd, mapSize) != 0)
+        return -1;
+    void *map = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    if (s->map)
+        munmap(s->map, s->mapSize);
+    s->map = map;
+    s->mapSize = mapSize;
+    s->header = map;
+    s->slots = (SnapshotSlot *)(s->map + sizeof(SnapshotHeader));
+    return 0;
+}
+
+int snapshotFormat(Snapshot *s, uint64_t capacity, size_t dataCapacity) {
+    if (ftruncate(s->fd, 0) != 0 || snapshotMap(s, snapshotDataStart(capacity) + dataCapacity) != 0)
+        return -1;
+    memcpy(s->header->magic, SNAPSHOT_MAGIC, 8);
+    s->header->version = SNAPSHOT_VERSION;
+    s->header->entrySize = sizeof(Entry);
+    s->header->capacity = capacity;
+    return 0;
+}
+
+/*
+ * Opens and locks the file.  A rebuild replaces it by rename, so after
+ * waiting for the lock the path is checked to still name the same file.
+ */
+int snapshotAttach(Snapshot *s) {
+    struct stat st;
+    struct stat current;
+
+    for (;;) {
+        s->fd = open(s->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (s->fd < 0)
+            return -1;
+        if (flock(s->fd, LOCK_EX) != 0 || fstat(s->fd, &st) != 0) {
+            close(s->fd);
+            return -1;
+        }
+        if (stat(s->path, &current) == 0 && current.st_dev == st.st_dev && current.st_ino == st.st_ino)
+            break;
+        close(s->fd);
+    }
+
+    /* Only an empty file or one carrying the magic is reformatted; anything else is refused untouched. */
+    int valid = 0;
+    s->map = NULL;
+    if (st.st_size != 0) {
+        SnapshotHeader header;
+        memset(&header, 0, sizeof(header));
+        if (pread(s->fd, &header, sizeof(header), 0) < 8 || memcmp(header.magic, SNAPSHOT_MAGIC, 8) != 0) {
+            close(s->fd);
+            return SNAPSHOT_FOREIGN;
+        }
+        if ((size_t)st.st_size >= sizeof(SnapshotHeader) && header.version == SNAPSHOT_VERSION &&
+            header.entrySize == sizeof(Entry) && header.capacity > 0 &&
+            (header.capacity & (header.capacity - 1)) == 0 &&
+            header.capacity <= (uint64_t)st.st_size / sizeof(SnapshotSlot) &&
+            header.dataSize <= (uint64_t)st.st_size &&
+            snapshotDataStart(header.capacity) + header.dataSize <= (uint64_t)st.st_size)
+            valid = snapshotMap(s, st.st_size) == 0;
+    }
+    if (!valid && snapshotFormat(s, SNAPSHOT_INITIAL_SLOTS, SNAPSHOT_INITIAL_DATA) != 0) {
+        close(s->fd);
+        return -1;
+    }
+    return 0;
+}
+
+void snapshotDetach(Snapshot *s) {
+    munmap(s->map, s->mapSize);
+    s->map = NULL;
+    flock(s->fd, LOCK_UN);
+    close(s->fd);
+}
+
+int snapshotOpen(Snapshot *s, const char *path) {
+    memset(s, 0, sizeof(*s));
+    s->path = strdup(path);
+    if (!s->path)
+        return -1;
+    int status = snapshotAttach(s);
+    if (status != 0) {
+        free(s->path);
+        return status;
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    return 0;
+}
+
+void snapshotClose(Snapshot *s) {
+    if (s->map)
+        snapshotDetach(s);
+    pthread_mutex_destroy(&s->lock);
+    free(s->path);
+}
+
+uint64_t snapshotHash(uint64_t dev, uint64_t ino) {
+    uint64_t h = dev * 0x9E3779B97F4A7C15ULL ^ ino;
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    return h ^ (h >> 32);
+}
+
+SnapshotSlot *snapshotSlot(Snapshot *s, uint64_t dev, uint64_t ino) {
+    uint64_t mask = s->header->capacity - 1;
+    uint64_t k = snapshotHash(dev, ino) & mask;
+    for (;;) {
+        SnapshotSlot *slot = &s->slots[k];
+        if (slot->offset == 0 || (slot->dev == dev && slot->ino == ino))
+            return slot;
+        k = (k + 1) & mask;
+    }
+}
+
+/*
+ * Writes the live blobs into a fresh file with the given table size and
+ * renames it over the old one; used to grow the table and to drop garbage.
+ */
+int snapshotRebuild(Snapshot *s, uint64_t capacity) {
+    Snapshot next = *s;
+    char *tmpPath = malloc(strlen(s->path) + 5);
+
+    if (!tmpPath)
+        return -1;
+    sprintf(tmpPath, "%s.tmp", s->path);
+    next.map = NULL;
+    next.fd = open(tmpPath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (next.fd < 0) {
+        free(tmpPath);
+        return -1;
+    }
+    if (flock(next.fd, LOCK_EX) != 0 ||
+        snapshotFormat(&next, capacity, s->header->dataSize - s->header->garbage) != 0) {
+        if (next.map)
+            munmap(next.map, next.mapSize);
+        close(next.fd);
+        unlink(tmpPath);
+        free(tmpPath);
+        return -1;
+    }
+
+    size_t offset = snapshotDataStart(capacity);
+    for (uint64_t k = 0; k < s->header->capacity; k++) {
+        const SnapshotSlot *old = &s->slots[k];
+        if (old->offset == 0)
+            continue;
+        size_t size = snapshotBlobSize(old->count, old->namesSize);
+        SnapshotSlot *slot = snapshotSlot(&next, old->dev, old->ino);
+        memcpy(next.map + offset, s->map + old->offset, size);
+        *slot = *old;
+        slot->offset = offset;
+        offset += size;
+        next.header->used++;
+    }
+    next.header->dataSize = offset - snapshotDataStart(capacity);
+
+    if (rename(tmpPath, s->path) != 0) {
+        munmap(next.map, next.mapSize);
+        close(next.fd);
+        unlink(tmpPath);
+        free(tmpPath);
+        return -1;
+    }
+    free(tmpPath);
+    snapshotDetach(s);
+    s->fd = next.fd;
+    s->map = next.map;
+    s->mapSize = next.mapSize;
+    s->header = next.header;
+    s->slots = next.slots;
+    return 0;
+}
+
+/* Reserves size bytes at the end of the heap, growing the file; 0 on failure. */
+uint64_t snapshotReserve(Snapshot *s, size_t size) {
+    uint64_t offset = snapshotDataStart(s->header->capacity) + s->header->dataSize;
+
+    if (offset + size > s->mapSize) {
+        size_t mapSize = s->mapSize * 2;
+        while (mapSize < offset + size)
+            mapSize *= 2;
+        if (snapshotMap(s, mapSize) != 0)
+            return 0;
+    }
+    s->header->dataSize += size;
+    return offset;
+}
+
+int stampMatches(const SnapshotSlot *slot, const DirStamp *stamp) {
+    return slot->mtimeSec == stamp->mtimeSec && slot->mtimeNsec == stamp->mtimeNsec &&
+           slot->ctimeSec == stamp->ctimeSec && slot->ctimeNsec == stamp->ctimeNsec;
+}
+
+int snapshotLoad(Snapshot *s, const DirStamp *stamp, Listing *listing) {
+    int hit = 0;
+
+    pthread_mutex_lock(&s->lock);
+    const SnapshotSlot *slot = snapshotSlot(s, stamp->dev, stamp->ino);
+    uint64_t dataStart = snapshotDataStart(s->header->capacity);
+    uint64_t dataEnd = dataStart + s->header->dataSize;
+    /* A slot pointing outside the heap (a damaged file) is a miss; the directory is rescanned. */
+    if (slot->offset != 0 && stampMatches(slot, stamp) && slot->offset >= dataStart && slot->offset <= dataEnd &&
+        slot->count <= (dataEnd - slot->offset) / sizeof(Entry) && slot->namesSize <= dataEnd - slot->offset &&
+        slot->offset + snapshotBlobSize(slot->count, slot->namesSize) <= dataEnd) {
+        Entry *entries = malloc(slot->count ? slot->count * sizeof(Entry) : 1);
+        char *names = malloc(slot->namesSize ? slot->namesSize : 1);
+        int valid = entries && names && (slot->namesSize == 0 || s->map[slot->offset + slot->count * sizeof(Entry) +
+                                                                           slot->namesSize - 1] == '\0');
+        if (valid) {
+            memcpy(entries, s->map + slot->offset, slot->count * sizeof(Entry));
+            memcpy(names, s->map + slot->offset + slot->count * sizeof(Entry), slot->namesSize);
+            for (uint64_t i = 0; i < slot->count && valid; i++)
+                valid = entries[i].name < slot->namesSize;
+        }
+        if (valid) {
+            listing->entries = entries;
+            listing->count = listing->capacity = slot->count;
+            listing->names = names;
+            listing->namesSize = listing->namesCapacity = slot->namesSize;
+            listing->totalBlocks = slot->totalBlocks;
+            hit = 1;
+        } else {
+            free(entries);
+            free(names);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return hit;
+}
+
+void snapshotStore(Snapshot *s, const DirStamp *stamp, const Listing *listing) {
+    size_t size = snapshotBlobSize(listing->count, listing->namesSize);
+    SnapshotHeader *header;
+
+    pthread_mutex_lock(&s->lock);
+    header = s->header;
+    if ((header->used + 1) * 10 > header->capacity * 7)
+        snapshotRebuild(s, header->capacity * 2);
+    else if (header->garbage > SNAPSHOT_MIN_GARBAGE && header->garbage * 2 > header->dataSize)
+        snapshotRebuild(s, header->capacity);
+    header = s->header;
+
+    uint64_t offset = header->used + 1 < header->capacity ? snapshotReserve(s, size) : 0;
+    if (offset != 0) {
+        header = s->header;
+        memcpy(s->map + offset, listing->entries, listing->count * sizeof(Entry));
+        memcpy(s->map + offset + listing->count * sizeof(Entry), listing->names, listing->namesSize);
+
+        SnapshotSlot *slot = snapshotSlot(s, stamp->dev, stamp->ino);
+        if (slot->offset == 0)
+            header->used++;
+        else
+            header->garbage += snapshotBlobSize(slot->count, slot->namesSize);
+        slot->dev = stamp->dev;
+        slot->ino = stamp->ino;
+        slot->mtimeSec = stamp->mtimeSec;
+        slot->mtimeNsec = stamp->mtimeNsec;
+        slot->ctimeSec = stamp->ctimeSec;
+        slot->ctimeNsec = stamp->ctimeNsec;
+        slot->offset = offset;
+        slot->count = listing->count;
+        slot->namesSize = listing->namesSize;
+        slot->totalBlocks = listing->totalBlocks;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+int dirStamp(int dirFd, DirStamp *stamp) {
+    struct stat st;
+
+    if (fstat(dirFd, &st) != 0)
+        return -1;
+    stamp->dev = st.st_dev;
+    stamp->ino = st.st_ino;
+    stamp->mtimeSec = st.st_mtim.tv_sec;
+    stamp->mtimeNsec = st.st_mtim.tv_nsec;
+    stamp->ctimeSec = st.st_ctim.tv_sec;
+    stamp->ctimeNsec = st.st_ctim.tv_nsec;
+    return 0;
+}
+
+/*
+ * A change made within the same timestamp tick as the scan would leave the
+ * stamps equal, so directories touched in the last few seconds are not saved.
+ */
+int stampIsRecent(const DirStamp *stamp) {
+    int64_t limit = (int64_t)time(NULL) - SNAPSHOT_RACY_SECONDS;
+    return stamp->mtimeSec >= limit || stamp->ctimeSec >= limit;
+}
+
+/*
+ * Directories change without touching the stamps of the directory that
+ * lists them: ".." is the parent, and a subdirectory's mtime moves with
+ * its own contents.  Their rows are stat'ed again on every snapshot hit.
+ */
+void restatDirectories(int dirFd, Listing *listing) {
+    for (size_t i = 0; i < listing->count; i++) {
+        Entry *entry = &listing->entries[i];
+        const char *name = entryName(listing, entry);
+        if (strcmp(name, "..") != 0 && (entry->statError || !S_ISDIR(entry->mode) || strcmp(name, ".") == 0))
+            continue;
+        if (!entry->statError)
+            listing->totalBlocks -= entry->blocks;
+        if (statEntry(dirFd, name, entry) != 0) {
+            entry->statError = errno;
+            continue;
+        }
+        entry->statError = 0;
+        listing->totalBlocks += entry->blocks;
+    }
+}
+
+/*
+ * Reads and stats dirFd into listing, or takes it from the snapshot when
+ * the directory is unchanged.  With refresh set the directory is always
+ * scanned and saved.
+ */
+int loadListing(int dirFd, Listing *listing, int refresh) {
+    DirStamp stamp;
+    int stamped = snapshot && dirStamp(dirFd, &stamp) == 0;
+
+    if (stamped && !refresh && snapshotLoad(snapshot, &stamp, listing)) {
+        restatDirectories(dirFd, listing);
+        return 0;
+    }
+    if (readEntries(dirFd, listing) != 0)
+        return -1;
+    statEntries(dirFd, listing);
+    if (stamped && (refresh || !stampIsRecent(&stamp)))
+        snapshotStore(snapshot, &stamp, listing);
+    return 0;
+}
+
+/* The first eight bytes of a string, big-endian, so that keys order like strcmp. */
+uint64_t stringPrefix(const char *s) {
+    uint64_t key = 0;
+    for (int k = 0; k < 8; k++) {
+        key <<= 8;
+        if (*s)
+            key |= (unsigned char)*s++;
+    }
+    return key;
+}
+
+/* Like ls -X, the extension includes its dot and names without one sort first. */
+const char *entryExtension(const char *name) {
+    const char *dot = strrchr(name, '.');
+    return dot ? dot : "";
+}
+
+/*
+ * The primary key of the sort mode, or with byName the name that breaks
+ * its ties.  String keys are the eight bytes at depth, which callers only
+ * advance past strings that go on.
+ */
+uint64_t sortKey(const Listing *listing, const Entry *entry, size_t depth, int byName) {
+    const char *name = entryName(listing, entry);
+    if (byName)
+        return stringPrefix(name + depth);
+    switch (sortMode) {
+    case SORT_SIZE:
+        return ~entry->size;
+    case SORT_TIME:
+        return ~((uint64_t)(entry->mtime + ((int64_t)1 << 33)) << 30 | entry->mtimeNsec);
+    case SORT_EXTENSION:
+        return stringPrefix(entryExtension(name) + depth);
+    default:
+        return stringPrefix(name + depth);
+    }
+}
+
+int compareRecords(const SortRecord *a, const SortRecord *b, const Listing *listing) {
+    if (a->key != b->key)
+        return a->key < b->key ? -1 : 1;
+    const char *nameA = entryName(listing, &listing->entries[a->index]);
+    const char *nameB = entryName(listing, &listing->entries[b->index]);
+    if (sortMode == SORT_EXTENSION) {
+        int rc = strcmp(entryExtension(nameA), entryExtension(nameB));
+        if (rc != 0)
+            return rc;
+    }
+    return strcmp(nameA, nameB);
+}
+
+void mergeRecords(SortRecord *records, SortRecord *tmp, size_t n, const Listing *listing) {
+    if (n <= SORT_INSERTION_MAX) {
+        for (size_t i = 1; i < n; i++) {
+            SortRecord r = records[i];
+            size_t j = i;
+            while (j > 0 && compareRecords(&r, &records[j - 1], listing) < 0) {
+                records[j] = records[j - 1];
+                j--;
+            }
+            records[j] = r;
+        }
+        return;
+    }
+
+    size_t half = n / 2;
+    mergeRecords(records, tmp, half, listing);
+    mergeRecords(records + half, tmp, n - half, listing);
+    if (compareRecords(&records[half - 1], &records[half], listing) <= 0)
+        return;
+    memcpy(tmp, records, half * sizeof(SortRecord));
+    size_t i = 0;
+    size_t j = half;
+    size_t k = 0;
+    while (i < half && j < n)
+        records[k++] = compareRecords(&records[j], &tmp[i], listing) < 0 ? records[j++] : tmp[i++];
+    while (i < half)
+        records[k++] = tmp[i++];
+}
+
+/*
+ * MSD radix sort, one key byte per level.  A bucket that agrees on all
+ * eight bytes is re-keyed in place: string keys move on to the next eight
+ * bytes, and exhausted primary keys move on to the names that break their
+ * ties, so long shared prefixes and equal sizes or times never fall back
+ * to strcmp.  Only small buckets are finished by comparison.
+ */
+void radixRecords(SortRecord *records, SortRecord *tmp, size_t n, int shift, size_t depth, int byName,
+                  const Listing *listing) {
+    size_t counts[256];
+    size_t starts[256];
+
+    while (n > SORT_INSERTION_MAX) {
+        if (shift < 0) {
+            int stringKey = byName || sortMode == SORT_NAME || sortMode == SORT_EXTENSION;
+            if (stringKey && (records[0].key & 0xFF) != 0) {
+                depth += 8;
+            } else if (!byName && sortMode != SORT_NAME) {
+                byName = 1;
+                depth = 0;
+            } else {
+                break;
+            }
+            shift = 56;
+            for (size_t i = 0; i < n; i++)
+                records[i].key = sortKey(listing, &listing->entries[records[i].index], depth, byName);
+            continue;
+        }
+        memset(counts, 0, sizeof(counts));
+        for (size_t i = 0; i < n; i++)
+            counts[(records[i].key >> shift) & 0xFF]++;
+        if (counts[(records[0].key >> shift) & 0xFF] == n) {
+            shift -= 8;
+            continue;
+        }
+
+        size_t sum = 0;
+        for (int b = 0; b < 256; b++) {
+            starts[b] = sum;
+            sum += counts[b];
+        }
+        for (size_t i = 0; i < n; i++)
+            tmp[starts[(records[i].key >> shift) & 0xFF]++] = records[i];
+        memcpy(records, tmp, n * sizeof(SortRecord));
+
+        size_t begin = 0;
+        for (int b = 0; b < 256; b++) {
+            if (counts[b] > 1)
+                radixRecords(records + begin, tmp, counts[b], shift - 8, depth, byName, listing);
+            begin += counts[b];
+        }
+        return;
+    }
+    mergeRecords(records, tmp, n, listing);
+}
+
+/*
+ * Sorting works on compact {key, index} records rather than on the
+ * entries: most comparisons are settled by the precomputed key, and the
+ * 16-byte records stay cache resident where the names would not.
+ */
+SortRecord *sortListing(const Listing *listing) {
+    SortRecord *records = malloc((listing->count + 1) * sizeof(SortRecord));
+    SortRecord *tmp = malloc((listing->count + 1) * sizeof(SortRecord));
+
+    if (!records || !tmp) {
+        free(records);
+        free(tmp);
+        return NULL;
+    }
+    for (size_t i = 0; i < listing->count; i++) {
+        records[i].key = sortKey(listing, &listing->entries[i], 0, 0);
+        records[i].index = i;
+    }
+    radixRecords(records, tmp, listing->count, 56, 0, 0, listing);
+    free(tmp);
+    return records;
+}
+
+int subdirsAdd(Subdirs *subdirs, const char *path, const char *name) {
+    size_t pathLen = strlen(path);
+    int slash = pathLen > 0 && path[pathLen - 1] != '/';
+
+    if (subdirs->count == subdirs->capacity) {
+        int capacity = subdirs->capacity ? subdirs->capacity * 2 : 16;
+        char **grown = realloc(subdirs->paths, capacity * sizeof(char *));
+        if (!grown)
+            return -1;
+        subdirs->paths = grown;
+        subdirs->capacity = capacity;
+    }
+    char *child = malloc(pathLen + slash + strlen(name) + 1);
+    if (!child)
+        return -1;
+    memcpy(child, path, pathLen);
+    if (slash)
+        child[pathLen] = '/';
+    strcpy(child + pathLen + slash, name);
+    subdirs->paths[subdirs->count++] = child;
+    return 0;
+}
+
+/*
+ * Prints one entry.  With subdirs set, the paths of subdirectories
+ * (symlinks are not followed) are collected in print order.
+ */
+void emitEntry(OutBuffer *out, const Listing *listing, const Entry *entry, const char *path, Subdirs *subdirs) {
+    const char *name = entryName(listing, entry);
+
+    if (entry->statError) {
+        fprintf(stderr, "Failed to get file status: %s: %s\n", name, strerror(entry->statError));
+        return;
+    }
+    printMetadata(out, entry, name);
+    if (subdirs && S_ISDIR(entry->mode) && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 &&
+        subdirsAdd(subdirs, path, name) != 0)
+        fprintf(stderr, "Memory allocation failed\n");
+}
+
+/*
+ * Unsorted listing in directory order (-f).  Every getdents64 batch is
+ * stat'ed, formatted and flushed before the next one is read, so memory
+ * stays bounded by one batch and output starts right away; total can
+ * only be known at the end and comes last.
+ */
+void streamDirectory(const char *path, FILE *file, Subdirs *subdirs) {
+    Listing listing;
+    DirReader reader;
+    OutBuffer out;
+    long got;
+    int dirFd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (dirFd < 0) {
+        fprintf(stderr, "Error opening directory: %s: %s\n", path, strerror(errno));
+        return;
+    }
+    if (dirReaderOpen(&reader, dirFd) != 0) {
+        fprintf(stderr, "Error reading directory: %s: %s\n", path, strerror(errno));
+        close(dirFd);
+        return;
+    }
+
+    listingInit(&listing);
+    outInit(&out, file);
+    while ((got = dirReaderNext(&reader, &listing)) > 0) {
+        statEntries(dirFd, &listing);
+        for (size_t i = 0; i < listing.count; i++)
+            emitEntry(&out, &listing, &listing.entries[i], path, subdirs);
+        listing.count = 0;
+        listing.namesSize = 0;
+        outFlush(&out);
+        fflush(file);
+    }
+    if (got < 0)
+        fprintf(stderr, "Error reading directory: %s: %s\n", path, strerror(errno));
+
+    outString(&out, "total ");
+    outNumber(&out, listing.totalBlocks, 0);
+    outBytes(&out, "\n", 1);
+    outFree(&out);
+    dirReaderClose(&reader);
+    listingFree(&listing);
+    close(dirFd);
+}
+
+/* Prints one directory block to out, sorted by the selected mode. */
+void listDirectory(const char *path, FILE *file, Subdirs *subdirs) {
+    Listing listing;
+    OutBuffer out;
+    int dirFd;
+
+    if (streamMode) {
+        streamDirectory(path, file, subdirs);
+        return;
+    }
+    dirFd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (dirFd < 0) {
+        fprintf(stderr, "Error opening directory: %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    listingInit(&listing);
+    if (loadListing(dirFd, &listing, 0) != 0) {
+        fprintf(stderr, "Error reading directory: %s: %s\n", path, strerror(errno));
+        listingFree(&listing);
+        close(dirFd);
+        return;
+    }
+
+    SortRecord *order = sortListing(&listing);
+    if (!order) {
+        fprintf(stderr, "Memory allocation failed\n");
+        listingFree(&listing);
+        close(dirFd);
         return;
     }
 
-    while ((entry = readdir(dir)) != NULL) {
-        if (count >= MAX_FILES) break;
+    outInit(&out, file);
+    outString(&out, "total ");
+    outNumber(&out, listing.totalBlocks, 0);
+    outBytes(&out, "\n", 1);
+    for (size_t i = 0; i < listing.count; i++)
+        emitEntry(&out, &listing, &listing.entries[order[i].index], path, subdirs);
+    outFree(&out);
+
+    free(order);
+    listingFree(&listing);
+    close(dirFd);
+}
 
-        snprintf(fullPath, sizeof(fullPath), "%s/%s", path, entry->d_name);
+void dequePush(DirDeque *deque, DirNode *node) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity && deque->head > 0) {
+        memmove(deque->items, deque->items + deque->head, (deque->tail - deque->head) * sizeof(DirNode *));
+        deque->tail -= deque->head;
+        deque->head = 0;
+    }
+    if (deque->tail == deque->capacity) {
+        size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+        DirNode **grown = realloc(deque->items, capacity * sizeof(DirNode *));
+        if (!grown) {
+            pthread_mutex_unlock(&deque->lock);
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        deque->items = grown;
+        deque->capacity = capacity;
+    }
+    deque->items[deque->tail++] = node;
+    pthread_mutex_unlock(&deque->lock);
+}
 
-        if (lstat(fullPath, &fileStat) == 0) {
-            totalBlocks += fileStat.st_blocks;
+DirNode *dequePop(DirDeque *deque) {
+    DirNode *node = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head)
+        node = deque->items[--deque->tail];
+    pthread_mutex_unlock(&deque->lock);
+    return node;
+}
+
+DirNode *dequeSteal(DirDeque *deque) {
+    DirNode *node = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head)
+        node = deque->items[deque->head++];
+    pthread_mutex_unlock(&deque->lock);
+    return node;
+}
+
+/*
+ * Owners pop their newest directory (depth first, close to the print
+ * cursor); thieves take the oldest one, which usually carries the largest
+ * unexplored subtree.
+ */
+DirNode *takeDirectory(Walker *walker, int id) {
+    DirNode *node = dequePop(&walker->deques[id]);
+    for (int k = 1; !node && k < walker->workerCount; k++)
+        node = dequeSteal(&walker->deques[(id + k) % walker->workerCount]);
+    if (node) {
+        pthread_mutex_lock(&walker->lock);
+        walker->queued--;
+        pthread_mutex_unlock(&walker->lock);
+    }
+    return node;
+}
 
-            char *name = strdup(entry->d_name);
-            if (name == NULL) {
-                fprintf(stderr, "Memory allocation failed");
-                closedir(dir);
-                return;
+DirNode *newDirNode(char *path) {
+    DirNode *node = calloc(1, sizeof(DirNode));
+    if (!node) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    node->path = path;
+    return node;
+}
+
+void walkDirectory(Walker *walker, int id, DirNode *node) {
+    Subdirs subdirs = {NULL, 0, 0};
+    FILE *out = open_memstream(&node->output, &node->outputLen);
+
+    if (out) {
+        fprintf(out, "\nListing contents of directory: %s\n", node->path);
+        listDirectory(node->path, out, &subdirs);
+        fclose(out);
+    } else {
+        fprintf(stderr, "Memory allocation failed\n");
+    }
+
+    if (subdirs.count > 0) {
+        node->children = malloc(subdirs.count * sizeof(DirNode *));
+        if (!node->children) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        for (int k = 0; k < subdirs.count; k++)
+            node->children[k] = newDirNode(subdirs.paths[k]);
+        node->childCount = subdirs.count;
+        for (int k = subdirs.count - 1; k >= 0; k--)
+            dequePush(&walker->deques[id], node->children[k]);
+    }
+    free(subdirs.paths);
+
+    pthread_mutex_lock(&walker->lock);
+    walker->queued += node->childCount;
+    walker->pending += node->childCount - 1;
+    walker->buffered += node->outputLen;
+    node->done = 1;
+    if (walker->printing == node)
+        pthread_cond_signal(&walker->readyCond);
+    if (walker->pending == 0)
+        pthread_cond_broadcast(&walker->workCond);
+    for (int k = 0; k < node->childCount && k < walker->idle; k++)
+        pthread_cond_signal(&walker->workCond);
+    pthread_mutex_unlock(&walker->lock);
+}
+
+/*
+ * Backpressure: once WALK_BUFFER_LIMIT bytes of finished blocks wait to be
+ * printed, workers stop taking directories until the printer drains them.
+ * They carry on while the printer waits for a block still being listed,
+ * since that block may be the one they would take.
+ */
+void walkThrottle(Walker *walker) {
+    pthread_mutex_lock(&walker->lock);
+    while (walker->buffered >= walker->bufferLimit && !(walker->printing && !walker->printing->done)) {
+        walker->throttled++;
+        pthread_cond_wait(&walker->drainCond, &walker->lock);
+        walker->throttled--;
+    }
+    pthread_mutex_unlock(&walker->lock);
+}
+
+void *walkWorker(void *arg) {
+    WalkWorker *worker = arg;
+    Walker *walker = worker->walker;
+
+    for (;;) {
+        walkThrottle(walker);
+        DirNode *node = takeDirectory(walker, worker->id);
+        if (node) {
+            walkDirectory(walker, worker->id, node);
+            continue;
+        }
+        pthread_mutex_lock(&walker->lock);
+        walker->idle++;
+        while (walker->queued <= 0 && walker->pending > 0)
+            pthread_cond_wait(&walker->workCond, &walker->lock);
+        walker->idle--;
+        int finished = walker->pending == 0;
+        pthread_mutex_unlock(&walker->lock);
+        if (finished)
+            break;
+    }
+    nameCacheFree(&userNames);
+    nameCacheFree(&groupNames);
+#ifdef HAVE_IO_URING
+    statRingClose();
+#endif
+    return NULL;
+}
+
+/*
+ * Recursive listing.  Workers list directories in parallel while the
+ * calling thread acts as the reorder buffer: it walks the tree in the
+ * order a sequential pre-order traversal would print it and emits each
+ * block as soon as it and everything before it are finished.
+ */
+void walkTrees(char **roots, int rootCount, int jobs) {
+    Walker walker;
+    DirNode **stack = malloc(rootCount * sizeof(DirNode *));
+    pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+    WalkWorker *workers = calloc(jobs, sizeof(WalkWorker));
+    size_t stackSize = 0;
+    size_t stackCapacity = rootCount;
+
+    memset(&walker, 0, sizeof(walker));
+    walker.deques = calloc(jobs, sizeof(DirDeque));
+    if (!stack || !threads || !workers || !walker.deques) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    walker.workerCount = jobs;
+    walker.bufferLimit = WALK_BUFFER_LIMIT;
+    pthread_mutex_init(&walker.lock, NULL);
+    pthread_cond_init(&walker.workCond, NULL);
+    pthread_cond_init(&walker.readyCond, NULL);
+    pthread_cond_init(&walker.drainCond, NULL);
+    for (int w = 0; w < jobs; w++)
+        pthread_mutex_init(&walker.deques[w].lock, NULL);
+
+    for (int i = rootCount - 1; i >= 0; i--) {
+        char *path = strdup(roots[i]);
+        if (!path) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        stack[stackSize++] = newDirNode(path);
+        dequePush(&walker.deques[i % jobs], stack[stackSize - 1]);
+    }
+    walker.queued = walker.pending = rootCount;
+
+    int started = 0;
+    for (int w = 0; w < jobs; w++) {
+        workers[w].walker = &walker;
+        workers[w].id = w;
+        if (pthread_create(&threads[w], NULL, walkWorker, &workers[w]) != 0) {
+            fprintf(stderr, "Error creating thread\n");
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        walker.bufferLimit = SIZE_MAX;
+        walkWorker(&workers[0]);
+    }
+
+    while (stackSize > 0) {
+        DirNode *node = stack[--stackSize];
+        pthread_mutex_lock(&walker.lock);
+        walker.printing = node;
+        if (!node->done && walker.throttled > 0)
+            pthread_cond_broadcast(&walker.drainCond);
+        while (!node->done)
+            pthread_cond_wait(&walker.readyCond, &walker.lock);
+        walker.printing = NULL;
+        pthread_mutex_unlock(&walker.lock);
+
+        if (node->output)
+            fwrite(node->output, 1, node->outputLen, stdout);
+        pthread_mutex_lock(&walker.lock);
+        walker.buffered -= node->outputLen;
+        if (walker.throttled > 0 && walker.buffered < walker.bufferLimit)
+            pthread_cond_broadcast(&walker.drainCond);
+        pthread_mutex_unlock(&walker.lock);
+        if (stackSize + node->childCount > stackCapacity) {
+            stackCapacity = (stackSize + node->childCount) * 2;
+            DirNode **grown = realloc(stack, stackCapacity * sizeof(DirNode *));
+            if (!grown) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(1);
             }
+            stack = grown;
+        }
+        for (int k = node->childCount - 1; k >= 0; k--)
+            stack[stackSize++] = node->children[k];
+        free(node->output);
+        free(node->children);
+        free(node->path);
+        free(node);
+    }
 
-            fileNames[count++] = name;
-        } else {
-            fprintf(stderr, "Failed to get file status");
+    for (int w = 0; w < started; w++)
+        pthread_join(threads[w], NULL);
+    for (int w = 0; w < jobs; w++) {
+        pthread_mutex_destroy(&walker.deques[w].lock);
+        free(walker.deques[w].items);
+    }
+    pthread_mutex_destroy(&walker.lock);
+    pthread_cond_destroy(&walker.workCond);
+    pthread_cond_destroy(&walker.readyCond);
+    pthread_cond_destroy(&walker.drainCond);
+    free(walker.deques);
+    free(stack);
+    free(threads);
+    free(workers);
+}
+
+#ifdef __linux__
+/*
+ * Watch mode (--watch): after the listing, directories are watched with
+ * inotify and every one that changes is rescanned into the snapshot, so
+ * that later listings find it current.  Unlike the stamps, inotify also
+ * sees entries modified in place, and adding or removing an entry marks
+ * the parent too, whose listing shows the directory's own metadata.  The
+ * snapshot is locked only while changes are being saved.
+ */
+/*
+ * Watches path and marks it to be visited.  Returns the watch descriptor,
+ * 0 when the directory was already watched and -1 on failure.
+ */
+int watchAdd(Watcher *w, const char *path, int parent) {
+    int wd = inotify_add_watch(w->fd, path, WATCH_EVENTS);
+
+    if (wd < 0) {
+        fprintf(stderr, "Failed to watch directory: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (wd >= w->capacity) {
+        int capacity = w->capacity ? w->capacity : 256;
+        while (wd >= capacity)
+            capacity *= 2;
+        char **paths = realloc(w->paths, capacity * sizeof(char *));
+        if (paths)
+            w->paths = paths;
+        int *parents = realloc(w->parents, capacity * sizeof(int));
+        if (parents)
+            w->parents = parents;
+        char *dirty = realloc(w->dirty, capacity);
+        if (dirty)
+            w->dirty = dirty;
+        if (!paths || !parents || !dirty) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        for (int k = w->capacity; k < capacity; k++) {
+            w->paths[k] = NULL;
+            w->dirty[k] = 0;
         }
+        w->capacity = capacity;
     }
+    if (w->paths[wd])
+        return 0;
+    w->paths[wd] = strdup(path);
+    if (!w->paths[wd]) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    w->parents[wd] = parent;
+    w->dirty[wd] = 1;
+    return wd;
+}
 
-    printf("total %ld\n", totalBlocks);
+void watchForget(Watcher *w, int wd) {
+    free(w->paths[wd]);
+    w->paths[wd] = NULL;
+    w->dirty[wd] = 0;
+    for (int k = 0; k < w->capacity; k++) {
+        if (w->paths[k] && w->parents[k] == wd)
+            w->parents[k] = -1;
+    }
+}
 
-    qsort(fileNames, count, sizeof(char *), compareFilenames);
+/*
+ * Lists one watched directory into the snapshot and, with -R, watches its
+ * subdirectories; those not watched before are marked to be visited too.
+ * Returns 1 when the directory was scanned.
+ */
+int watchVisit(Watcher *w, int wd, int refresh) {
+    Listing listing;
+    Subdirs subdirs = {NULL, 0, 0};
+    int dirFd = open(w->paths[wd], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 
-    for (int i = 0; i < count; i++) {
-        snprintf(fullPath, sizeof(fullPath), "%s/%s", path, fileNames[i]);
-        if (lstat(fullPath, &fileStat) == 0) {
-            printMetadata(&fileStat, fileNames[i]);
+    w->dirty[wd] = 0;
+    if (dirFd < 0) {
+        if (errno == ENOENT || errno == ENOTDIR) {
+            inotify_rm_watch(w->fd, wd);
+            watchForget(w, wd);
         } else {
-            fprintf(stderr, "Failed to get file status");
+            fprintf(stderr, "Error opening directory: %s: %s\n", w->paths[wd], strerror(errno));
+        }
+        return 0;
+    }
+    listingInit(&listing);
+    if (loadListing(dirFd, &listing, refresh) != 0) {
+        fprintf(stderr, "Error reading directory: %s: %s\n", w->paths[wd], strerror(errno));
+        listingFree(&listing);
+        close(dirFd);
+        return 0;
+    }
+    close(dirFd);
+
+    for (size_t i = 0; w->recursive && i < listing.count; i++) {
+        const Entry *entry = &listing.entries[i];
+        const char *name = entryName(&listing, entry);
+        if (!entry->statError && S_ISDIR(entry->mode) && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 &&
+            subdirsAdd(&subdirs, w->paths[wd], name) != 0)
+            fprintf(stderr, "Memory allocation failed\n");
+    }
+    listingFree(&listing);
+    for (int k = 0; k < subdirs.count; k++) {
+        watchAdd(w, subdirs.paths[k], wd);
+        free(subdirs.paths[k]);
+    }
+    free(subdirs.paths);
+    return 1;
+}
+
+/* Visits marked directories until none is left, newly found ones included. */
+void watchSweep(Watcher *w, int refresh) {
+    int again = 1;
+
+    while (again) {
+        again = 0;
+        for (int wd = 0; wd < w->capacity; wd++) {
+            if (!w->dirty[wd] || !w->paths[wd])
+                continue;
+            again = 1;
+            if (watchVisit(w, wd, refresh) && refresh) {
+                printf("Refreshed snapshot of directory: %s\n", w->paths[wd]);
+                fflush(stdout);
+            }
+        }
+    }
+}
+
+/* Marks the directories named by a buffer of events; returns -1 on overflow. */
+int watchEvents(Watcher *w, const char *buffer, ssize_t len) {
+    for (ssize_t offset = 0; offset < len;) {
+        const struct inotify_event *event = (const struct inotify_event *)(buffer + offset);
+        offset += sizeof(struct inotify_event) + event->len;
+        if (event->mask & IN_Q_OVERFLOW)
+            return -1;
+        if (event->wd < 0 || event->wd >= w->capacity || !w->paths[event->wd])
+            continue;
+        if (event->mask & IN_IGNORED) {
+            watchForget(w, event->wd);
+            continue;
+        }
+        w->dirty[event->wd] = 1;
+        if ((event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) && w->parents[event->wd] >= 0)
+            w->dirty[w->parents[event->wd]] = 1;
+    }
+    return 0;
+}
+
+void watchTrees(char **roots, int rootCount, int recursive) {
+    Watcher w;
+    char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    memset(&w, 0, sizeof(w));
+    w.recursive = recursive;
+    w.fd = inotify_init1(IN_CLOEXEC);
+    if (w.fd < 0) {
+        fprintf(stderr, "Failed to initialize inotify: %s\n", strerror(errno));
+        return;
+    }
+    for (int i = 0; i < rootCount; i++)
+        watchAdd(&w, roots[i], -1);
+    watchSweep(&w, 0);
+    snapshotDetach(snapshot);
+
+    for (;;) {
+        ssize_t len = read(w.fd, buffer, sizeof(buffer));
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error reading inotify events: %s\n", strerror(errno));
+            break;
+        }
+        int overflow = watchEvents(&w, buffer, len) != 0;
+        struct pollfd pfd = {w.fd, POLLIN, 0};
+        while (poll(&pfd, 1, WATCH_SETTLE_MS) > 0 && (len = read(w.fd, buffer, sizeof(buffer))) > 0)
+            overflow |= watchEvents(&w, buffer, len) != 0;
+        if (overflow) {
+            for (int wd = 0; wd < w.capacity; wd++)
+                w.dirty[wd] = w.paths[wd] != NULL;
         }
 
-        free(fileNames[i]);
+        int status = snapshotAttach(snapshot);
+        if (status != 0) {
+            fprintf(stderr, "Error opening snapshot: %s: %s\n", snapshot->path,
+                    status == SNAPSHOT_FOREIGN ? "not a snapshot" : strerror(errno));
+            break;
+        }
+        watchSweep(&w, 1);
+        snapshotDetach(snapshot);
     }
 
-    closedir(dir);
+    for (int wd = 0; wd < w.capacity; wd++)
+        free(w.paths[wd]);
+    free(w.paths);
+    free(w.parents);
+    free(w.dirty);
+    close(w.fd);
+}
+#endif
+
+void usage(const char *progName) {
+    fprintf(stderr, "Usage: %s [-R] [-S | -t | -X | -f] [-j N] [--uring] [-C FILE [--watch]] <directory>...\n",
+            progName);
+    fprintf(stderr, "  -R    list subdirectories recursively\n");
+    fprintf(stderr, "  -S    sort by size, largest first\n");
+    fprintf(stderr, "  -t    sort by modification time, newest first\n");
+    fprintf(stderr, "  -X    sort by extension\n");
+    fprintf(stderr, "  -f    do not sort: print entries as they are read, with total on the last line\n");
+    fprintf(stderr, "  -j N  list up to N directories in parallel with -R (default: online CPUs)\n");
+    fprintf(stderr, "  --uring  fetch metadata of large directories with batched io_uring statx\n");
+    fprintf(stderr, "  -C FILE  keep a snapshot of every listing in FILE and reuse it for directories\n");
+    fprintf(stderr, "           whose mtime and ctime are unchanged; files written, chmod'ed or\n");
+    fprintf(stderr, "           chown'ed in place keep their old size, time, permissions and\n");
+    fprintf(stderr, "           owner until an entry is added, removed or renamed in their directory\n");
+    fprintf(stderr, "  --watch  after listing, keep the snapshot current with inotify until killed\n");
 }
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <directory>...\n", argv[0]);
+    int recursive = 0;
+    int watch = 0;
+    const char *snapshotPath = NULL;
+    Snapshot snapshotFile;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int jobs = cpus > 0 ? (int)cpus : 1;
+    int first = 1;
+
+    while (first < argc && argv[first][0] == '-' && argv[first][1] != '\0') {
+        const char *opt = argv[first++];
+        if (strcmp(opt, "--") == 0)
+            break;
+        else if (strcmp(opt, "-R") == 0)
+            recursive = 1;
+        else if (strcmp(opt, "--uring") == 0)
+            uringStat = 1;
+        else if (strcmp(opt, "-S") == 0)
+            sortMode = SORT_SIZE;
+        else if (strcmp(opt, "-t") == 0)
+            sortMode = SORT_TIME;
+        else if (strcmp(opt, "-X") == 0)
+            sortMode = SORT_EXTENSION;
+        else if (strcmp(opt, "-f") == 0)
+            streamMode = 1;
+        else if (strcmp(opt, "--watch") == 0)
+            watch = 1;
+        else if (strcmp(opt, "-C") == 0) {
+            if (first >= argc) {
+                usage(argv[0]);
+                return 1;
+            }
+            snapshotPath = argv[first++];
+        }
+        else if (strcmp(opt, "-j") == 0) {
+            char *endptr;
+            if (first >= argc) {
+                usage(argv[0]);
+                return 1;
+            }
+            long value = strtol(argv[first++], &endptr, 10);
+            if (*endptr != '\0' || value < 1 || value > MAX_JOBS) {
+                fprintf(stderr, "Invalid job count: %s\n", argv[first - 1]);
+                return 1;
+            }
+            jobs = (int)value;
+        }
+        else {
+            fprintf(stderr, "Unknown option: %s\n", opt);
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (first >= argc || (watch && !snapshotPath)) {
+        usage(argv[0]);
+        return 1;
+    }
+#ifndef __linux__
+    if (watch) {
+        fprintf(stderr, "--watch is only supported on Linux\n");
         return 1;
     }
+#endif
 
-    for (int i = 1; i < argc; i++) {
-        printf("\nListing contents of directory: %s\n", argv[i]);
-        listDirectory(argv[i]);
+    tzset();
+    if (snapshotPath) {
+        int status = snapshotOpen(&snapshotFile, snapshotPath);
+        if (status == 0)
+            snapshot = &snapshotFile;
+        else if (status == SNAPSHOT_FOREIGN)
+            fprintf(stderr, "%s: not a snapshot\n", snapshotPath);
+        else
+            perror(snapshotPath);
+    }
+    if (recursive) {
+        fflush(stdout);
+        walkTrees(&argv[first], argc - first, jobs);
+    } else {
+        for (int i = first; i < argc; i++) {
+            printf("\nListing contents of directory: %s\n", argv[i]);
+            listDirectory(argv[i], stdout, NULL);
+        }
+    }
+#ifdef __linux__
+    if (watch && snapshot) {
+        fflush(stdout);
+        watchTrees(&argv[first], argc - first, recursive);
     }
+#endif
+    if (snapshot)
+        snapshotClose(snapshot);
+    nameCacheFree(&userNames);
+    nameCacheFree(&groupNames);
+#ifdef HAVE_IO_URING
+    statRingClose();
+#endif
 
     return 0;
 }
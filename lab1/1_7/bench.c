@@ -0,0 +1,613 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define DEFAULT_WORKDIR "/var/tmp/sysprog-lsbench"
+#define DEFAULT_TMPFS "/dev/shm/sysprog-lsbench"
+#define DEFAULT_SOURCE "7.c"
+#define MAX_ARGS 6
+#define PIPE_SIZE (1 << 20)
+#define READ_BUFFER_SIZE (1 << 20)
+#define TMPFS_MAGIC 0x01021994
+#define SNAPSHOT_SETTLE_SECONDS 3
+#define MAX_FILE_SIZE (1 << 20)
+#define MTIME_SPREAD (2 * 365 * 24 * 3600)
+#define FIRST_OWNER 10000
+
+typedef struct {
+    const char *name;
+    long files;
+    int depth;
+    int fanout;
+    int nameLength;
+    int owners;
+} Corpus;
+
+typedef struct {
+    const char *name;
+    const char *args[MAX_ARGS];
+    int gnu;
+    int snapshot;
+} Mode;
+
+typedef struct {
+    const char *name;
+    const char *dir;
+} Filesystem;
+
+typedef struct {
+    const char *workDir;
+    const char *source;
+    const char *label;
+    const char *cc;
+    const char *corpusFilter;
+    const char *modeFilter;
+    const char *fsFilter;
+    int repeats;
+    int scale;
+    int countSyscalls;
+    int compare;
+    int dropCaches;
+} BenchConfig;
+
+typedef struct {
+    double seconds;
+    double ttfb;
+    long peakRssKb;
+    long long syscalls;
+    int failed;
+} RunResult;
+
+Corpus corpora[] = {
+    {"flat-10k", 10000, 0, 0, 12, 0},
+    {"flat-1m", 1000000, 0, 0, 12, 0},
+    {"flat-5m", 5000000, 0, 0, 12, 0},
+    {"deep", 4, 14, 2, 12, 0},
+    {"owners", 100000, 0, 0, 12, 5000},
+    {"longnames", 100000, 0, 0, 240, 0},
+};
+
+Mode modes[] = {
+    {"sorted", {NULL}, 0, 0},
+    {"size", {"-S", NULL}, 0, 0},
+    {"stream", {"-f", NULL}, 0, 0},
+    {"uring", {"--uring", NULL}, 0, 0},
+    {"snapshot", {NULL}, 0, 1},
+    {"gnu-ls", {"-l", "-a", NULL}, 1, 0},
+    {"gnu-ls-U", {"-l", "-a", "-U", NULL}, 1, 0},
+};
+
+void usage(const char *progName) {
+    fprintf(stderr, "Usage: %s [options]\n", progName);
+    fprintf(stderr, "  -d DIR    work directory for the tool and the on-disk trees (default %s)\n", DEFAULT_WORKDIR);
+    fprintf(stderr, "  -T DIR    directory for the tmpfs trees (default %s)\n", DEFAULT_TMPFS);
+    fprintf(stderr, "  -s FILE   lister source to build (default %s)\n", DEFAULT_SOURCE);
+    fprintf(stderr, "  -l LABEL  label written into every result, e.g. a git revision\n");
+    fprintf(stderr, "  -r N      timed repetitions per run, best time is reported (default 3)\n");
+    fprintf(stderr, "  -q N      divide every file count by N and shorten deep trees to match (default 1)\n");
+    fprintf(stderr, "  -c NAME   only run the named tree (flat-10k, flat-1m, flat-5m, deep, owners, longnames)\n");
+    fprintf(stderr, "  -m NAME   only run the named mode (sorted, size, stream, uring, snapshot, gnu-ls, gnu-ls-U)\n");
+    fprintf(stderr, "  -F NAME   only run on the named filesystem (tmpfs, disk)\n");
+    fprintf(stderr, "  -g        also run GNU ls -l on every tree for comparison\n");
+    fprintf(stderr, "  -D        drop the page, dentry and inode caches before every run (root only)\n");
+    fprintf(stderr, "  -t        count syscalls in an extra ptrace-traced run\n");
+    fprintf(stderr, "Results are printed as one JSON object per line on stdout.\n");
+}
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint64_t nextRandom(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+long corpusFiles(const BenchConfig *config, const Corpus *corpus) {
+    long files = corpus->files / config->scale;
+    return files < 1 ? 1 : files;
+}
+
+int corpusDepth(const BenchConfig *config, const Corpus *corpus) {
+    int depth = corpus->depth;
+    for (int scale = config->scale; scale > 1 && depth > 1; scale /= corpus->fanout)
+        depth--;
+    return depth;
+}
+
+/* Every directory lists its files, its subdirectories, "." and "..". */
+long long corpusEntries(const BenchConfig *config, const Corpus *corpus) {
+    long long dirs = 1;
+    long long level = 1;
+    for (int d = 0; d < corpusDepth(config, corpus); d++) {
+        level *= corpus->fanout;
+        dirs += level;
+    }
+    return dirs * (corpusFiles(config, corpus) + 2) + dirs - 1;
+}
+
+/*
+ * Names are random lowercase letters, a unique index and an extension
+ * drawn from a few common ones, so that every sort mode has work to do.
+ */
+void makeName(char *name, int length, long index, uint64_t *seed) {
+    static const char *extensions[] = {"", ".c", ".h", ".txt", ".o", ".tar.gz"};
+    const char *ext = extensions[nextRandom(seed) % (sizeof(extensions) / sizeof(extensions[0]))];
+    int letters = length - 8 - (int)strlen(ext);
+
+    for (int i = 0; i < letters; i++)
+        name[i] = 'a' + nextRandom(seed) % 26;
+    sprintf(name + (letters > 0 ? letters : 0), "%08lx%s", index, ext);
+}
+
+int generateFiles(int dirFd, const BenchConfig *config, const Corpus *corpus, uint64_t *seed, int *chownWarned) {
+    char name[512];
+    time_t base = time(NULL);
+    long files = corpusFiles(config, corpus);
+
+    for (long i = 0; i < files; i++) {
+        makeName(name, corpus->nameLength, i, seed);
+        int fd = openat(dirFd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            perror(name);
+            return -1;
+        }
+        struct timespec times[2];
+        times[0].tv_sec = times[1].tv_sec = base - (time_t)(nextRandom(seed) % MTIME_SPREAD);
+        times[0].tv_nsec = times[1].tv_nsec = nextRandom(seed) % 1000000000;
+        if (ftruncate(fd, nextRandom(seed) % MAX_FILE_SIZE) != 0 || futimens(fd, times) != 0) {
+            perror(name);
+            close(fd);
+            return -1;
+        }
+        if (corpus->owners > 0 && !*chownWarned) {
+            uid_t uid = FIRST_OWNER + (uid_t)(nextRandom(seed) % corpus->owners);
+            gid_t gid = FIRST_OWNER + (gid_t)(nextRandom(seed) % corpus->owners);
+            if (fchown(fd, uid, gid) != 0) {
+                fprintf(stderr, "cannot change owners (%s), tree %s keeps one owner\n", strerror(errno),
+                        corpus->name);
+                *chownWarned = 1;
+            }
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+int generateTree(int dirFd, int depth, const BenchConfig *config, const Corpus *corpus, uint64_t *seed,
+                 int *chownWarned) {
+    if (generateFiles(dirFd, config, corpus, seed, chownWarned) != 0)
+        return -1;
+    for (int k = 0; depth > 0 && k < corpus->fanout; k++) {
+        char name[32];
+        snprintf(name, sizeof(name), "d%d", k);
+        if (mkdirat(dirFd, name, 0755) != 0) {
+            perror(name);
+            return -1;
+        }
+        int child = openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (child < 0) {
+            perror(name);
+            return -1;
+        }
+        int failed = generateTree(child, depth - 1, config, corpus, seed, chownWarned);
+        close(child);
+        if (failed)
+            return -1;
+    }
+    return 0;
+}
+
+int removeEntry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)ftw;
+    if ((type == FTW_DP ? rmdir(path) : unlink(path)) != 0)
+        perror(path);
+    return 0;
+}
+
+/*
+ * Trees are generated once per filesystem and scale and reused; a stamp
+ * next to the tree records what it was generated with.
+ */
+int prepareCorpus(const BenchConfig *config, const Filesystem *fs, const Corpus *corpus) {
+    char dir[4096];
+    char stamp[4200];
+    char expected[256];
+    char found[256] = "";
+
+    snprintf(dir, sizeof(dir), "%s/%s", fs->dir, corpus->name);
+    snprintf(stamp, sizeof(stamp), "%s.complete", dir);
+    snprintf(expected, sizeof(expected), "v1 scale=%d\n", config->scale);
+
+    FILE *fp = fopen(stamp, "r");
+    if (fp) {
+        size_t got = fread(found, 1, sizeof(found) - 1, fp);
+        found[got] = '\0';
+        fclose(fp);
+        if (strcmp(found, expected) == 0)
+            return 0;
+    }
+
+    unlink(stamp);
+    nftw(dir, removeEntry, 64, FTW_DEPTH | FTW_PHYS);
+    if (mkdir(dir, 0755) != 0) {
+        perror(dir);
+        return -1;
+    }
+    fprintf(stderr, "generating tree %s on %s...\n", corpus->name, fs->name);
+
+    int dirFd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd < 0) {
+        perror(dir);
+        return -1;
+    }
+    uint64_t seed = 0x2545F4914F6CDD1DULL ^ (uint64_t)corpus->files ^ (uint64_t)corpus->nameLength << 32;
+    int chownWarned = 0;
+    int failed = generateTree(dirFd, corpusDepth(config, corpus), config, corpus, &seed, &chownWarned);
+    close(dirFd);
+    if (failed)
+        return -1;
+
+    /* The snapshot mode only saves directories whose stamps are a few seconds old. */
+    sleep(SNAPSHOT_SETTLE_SECONDS);
+
+    fp = fopen(stamp, "w");
+    if (!fp) {
+        perror(stamp);
+        return -1;
+    }
+    fputs(expected, fp);
+    fclose(fp);
+    return 0;
+}
+
+int buildTool(const BenchConfig *config, const char *toolPath) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        execlp(config->cc, config->cc, "-O2", "-pthread", "-o", toolPath, config->source, (char *)NULL);
+        perror(config->cc);
+        _exit(127);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Failed to build %s\n", config->source);
+        return -1;
+    }
+    return 0;
+}
+
+char **buildArgv(const char *toolPath, const Mode *mode, const Corpus *corpus, const char *snapshotPath,
+                 const char *dir) {
+    char **argv = calloc(MAX_ARGS + 6, sizeof(char *));
+    if (!argv)
+        return NULL;
+    int n = 0;
+    argv[n++] = mode->gnu ? "ls" : (char *)toolPath;
+    if (corpus->depth > 0)
+        argv[n++] = "-R";
+    for (int i = 0; i < MAX_ARGS && mode->args[i]; i++)
+        argv[n++] = (char *)mode->args[i];
+    if (mode->snapshot) {
+        argv[n++] = "-C";
+        argv[n++] = (char *)snapshotPath;
+    }
+    argv[n++] = (char *)dir;
+    argv[n] = NULL;
+    return argv;
+}
+
+/* Both listers run in the C locale so that GNU ls sorts and formats bytewise too. */
+void execLister(char **argv, int gnu) {
+    setenv("LC_ALL", "C", 1);
+    if (gnu)
+        execvp(argv[0], argv);
+    else
+        execv(argv[0], argv);
+    _exit(127);
+}
+
+void redirectOutput(void) {
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) {
+        dup2(null, STDOUT_FILENO);
+        close(null);
+    }
+}
+
+int dropCaches(void) {
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd < 0)
+        return -1;
+    int ok = write(fd, "3", 1) == 1;
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+/*
+ * Output goes through a pipe that is drained here, so that the arrival
+ * of the first byte can be timed as well as the whole run.
+ */
+RunResult runTimed(char **argv, int gnu) {
+    RunResult result = {0, 0, 0, -1, 0};
+    struct rusage usage;
+    int status;
+    int fds[2];
+
+    if (pipe(fds) != 0) {
+        result.failed = 1;
+        return result;
+    }
+    fcntl(fds[0], F_SETPIPE_SZ, PIPE_SIZE);
+    double start = now();
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        result.failed = 1;
+        return result;
+    }
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execLister(argv, gnu);
+    }
+    close(fds[1]);
+
+    static char buffer[READ_BUFFER_SIZE];
+    ssize_t got;
+    int first = 1;
+    while ((got = read(fds[0], buffer, sizeof(buffer))) != 0) {
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (first) {
+            result.ttfb = now() - start;
+            first = 0;
+        }
+    }
+    close(fds[0]);
+
+    if (wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        result.failed = 1;
+    result.seconds = now() - start;
+    result.peakRssKb = usage.ru_maxrss;
+    return result;
+}
+
+long long countSyscalls(char **argv, int gnu) {
+    long long stops = 0;
+    int status;
+
+    pid_t pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0) {
+        redirectOutput();
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0)
+            _exit(127);
+        raise(SIGSTOP);
+        execLister(argv, gnu);
+    }
+
+    if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status))
+        return -1;
+    ptrace(PTRACE_SETOPTIONS, pid, NULL,
+           (void *)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK |
+                          PTRACE_O_TRACEVFORK | PTRACE_O_EXITKILL));
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+    for (;;) {
+        pid_t child = waitpid(-1, &status, __WALL);
+        if (child < 0)
+            break;
+        if (WIFEXITED(status) || WIFSIGNALED(status))
+            continue;
+        int signal = 0;
+        if (WIFSTOPPED(status)) {
+            int stop = WSTOPSIG(status);
+            if (stop == (SIGTRAP | 0x80))
+                stops++;
+            else if (stop != SIGTRAP && stop != SIGSTOP)
+                signal = stop;
+        }
+        ptrace(PTRACE_SYSCALL, child, NULL, (void *)(long)signal);
+    }
+    return stops / 2;
+}
+
+void jsonString(const char *text) {
+    putchar('"');
+    for (const char *c = text; *c; c++) {
+        if (*c == '"' || *c == '\\')
+            putchar('\\');
+        if ((unsigned char)*c < 0x20)
+            printf("\\u%04x", *c);
+        else
+            putchar(*c);
+    }
+    putchar('"');
+}
+
+void report(const BenchConfig *config, const Filesystem *fs, const Corpus *corpus, const Mode *mode,
+            long long entries, const RunResult *result) {
+    double entriesPerSecond = result->seconds > 0 ? entries / result->seconds : 0;
+
+    printf("{\"label\":");
+    jsonString(config->label);
+    printf(",\"fs\":\"%s\",\"tree\":\"%s\",\"mode\":\"%s\",\"entries\":%lld,\"seconds\":%.6f,"
+           "\"ttfb_ms\":%.3f,\"entries_per_s\":%.1f,\"peak_rss_kb\":%ld,",
+           fs->name, corpus->name, mode->name, entries, result->seconds, result->ttfb * 1e3, entriesPerSecond,
+           result->peakRssKb);
+    if (result->syscalls >= 0)
+        printf("\"syscalls\":%lld,\"syscalls_per_entry\":%.3f,", result->syscalls,
+               (double)result->syscalls / entries);
+    else
+        printf("\"syscalls\":null,\"syscalls_per_entry\":null,");
+    printf("\"ok\":%s}\n", result->failed ? "false" : "true");
+    fflush(stdout);
+
+    fprintf(stderr, "%-5s %-9s %-9s %8.3f s %9.3f ms ttfb %12.1f entries/s %8ld KB", fs->name, corpus->name,
+            mode->name, result->seconds, result->ttfb * 1e3, entriesPerSecond, result->peakRssKb);
+    if (result->syscalls >= 0)
+        fprintf(stderr, " %7.3f syscalls/entry", (double)result->syscalls / entries);
+    fprintf(stderr, "%s\n", result->failed ? "  FAILED" : "");
+}
+
+int runCorpus(BenchConfig *config, const Filesystem *fs, const Corpus *corpus, const char *toolPath) {
+    char dir[4096];
+    char snapshotPath[4200];
+
+    if (prepareCorpus(config, fs, corpus) != 0)
+        return -1;
+    snprintf(dir, sizeof(dir), "%s/%s", fs->dir, corpus->name);
+    snprintf(snapshotPath, sizeof(snapshotPath), "%s/%s-%s.snapshot", config->workDir, fs->name, corpus->name);
+    long long entries = corpusEntries(config, corpus);
+
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        const Mode *mode = &modes[m];
+        if (config->modeFilter ? strcmp(config->modeFilter, mode->name) != 0 : mode->gnu && !config->compare)
+            continue;
+        char **argv = buildArgv(toolPath, mode, corpus, snapshotPath, dir);
+        if (!argv)
+            break;
+
+        /* The first run warms the caches, and fills the snapshot in snapshot mode. */
+        unlink(snapshotPath);
+        RunResult best = runTimed(argv, mode->gnu);
+        for (int r = 0; r < config->repeats; r++) {
+            if (config->dropCaches && dropCaches() != 0) {
+                fprintf(stderr, "cannot drop caches: %s\n", strerror(errno));
+                config->dropCaches = 0;
+            }
+            RunResult run = runTimed(argv, mode->gnu);
+            if (r == 0 || run.seconds < best.seconds) {
+                best.seconds = run.seconds;
+                best.ttfb = run.ttfb;
+            }
+            if (run.peakRssKb > best.peakRssKb)
+                best.peakRssKb = run.peakRssKb;
+            best.failed |= run.failed;
+        }
+        if (config->countSyscalls)
+            best.syscalls = countSyscalls(argv, mode->gnu);
+        report(config, fs, corpus, mode, entries, &best);
+        free(argv);
+    }
+    unlink(snapshotPath);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    BenchConfig config = {DEFAULT_WORKDIR, DEFAULT_SOURCE, "", NULL, NULL, NULL, NULL, 3, 1, 0, 0, 0};
+    Filesystem filesystems[] = {{"tmpfs", DEFAULT_TMPFS}, {"disk", NULL}};
+    int opt;
+
+    config.cc = getenv("CC") ? getenv("CC") : "cc";
+    while ((opt = getopt(argc, argv, "d:T:s:l:r:q:c:m:F:gDth")) != -1) {
+        switch (opt) {
+        case 'd':
+            config.workDir = optarg;
+            break;
+        case 'T':
+            filesystems[0].dir = optarg;
+            break;
+        case 's':
+            config.source = optarg;
+            break;
+        case 'l':
+            config.label = optarg;
+            break;
+        case 'r':
+            config.repeats = atoi(optarg);
+            break;
+        case 'q':
+            config.scale = atoi(optarg);
+            break;
+        case 'c':
+            config.corpusFilter = optarg;
+            break;
+        case 'm':
+            config.modeFilter = optarg;
+            break;
+        case 'F':
+            config.fsFilter = optarg;
+            break;
+        case 'g':
+            config.compare = 1;
+            break;
+        case 'D':
+            config.dropCaches = 1;
+            break;
+        case 't':
+            config.countSyscalls = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (config.repeats < 1 || config.scale < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    filesystems[1].dir = config.workDir;
+
+    if (mkdir(config.workDir, 0755) != 0 && errno != EEXIST) {
+        perror(config.workDir);
+        return 1;
+    }
+    int useTmpfs = !config.fsFilter || strcmp(config.fsFilter, "tmpfs") == 0;
+    if (useTmpfs && mkdir(filesystems[0].dir, 0755) != 0 && errno != EEXIST) {
+        perror(filesystems[0].dir);
+        return 1;
+    }
+    struct statfs sfs;
+    if (useTmpfs && (statfs(filesystems[0].dir, &sfs) != 0 || sfs.f_type != TMPFS_MAGIC))
+        fprintf(stderr, "warning: %s is not on tmpfs\n", filesystems[0].dir);
+
+    char toolPath[4096];
+    snprintf(toolPath, sizeof(toolPath), "%s/tool", config.workDir);
+    if (buildTool(&config, toolPath) != 0)
+        return 1;
+
+    int failures = 0;
+    for (size_t f = 0; f < sizeof(filesystems) / sizeof(filesystems[0]); f++) {
+        if (config.fsFilter && strcmp(config.fsFilter, filesystems[f].name) != 0)
+            continue;
+        for (size_t c = 0; c < sizeof(corpora) / sizeof(corpora[0]); c++) {
+            if (config.corpusFilter && strcmp(config.corpusFilter, corpora[c].name) != 0)
+                continue;
+            if (runCorpus(&config, &filesystems[f], &corpora[c], toolPath) != 0)
+                failures++;
+        }
+    }
+    return failures ? 1 : 0;
+}